@@ -75,7 +75,7 @@ static NSString *const kSkipStartupMessage = @"Skip Startup Message";
 #if !ISH_LINUX
     NSURL *root = [Roots.instance rootUrl:Roots.instance.defaultRoot];
 
-    int err = mount_root(&fakefs, [root URLByAppendingPathComponent:@"data"].fileSystemRepresentation);
+    int err = mount_root(&fakefs, [root URLByAppendingPathComponent:@"data"].fileSystemRepresentation, "");
     if (err < 0)
         return err;
 
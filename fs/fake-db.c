@@ -1,12 +1,15 @@
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include "kernel/errno.h"
 #include "debug.h"
 #include "misc.h"
 #include "fs/fake-db.h"
 
-static void db_check_error(struct fakefs_db *fs) {
-    int errcode = sqlite3_errcode(fs->db);
+static void db_check_error_on(sqlite3 *db) {
+    int errcode = sqlite3_errcode(db);
     switch (errcode) {
         case SQLITE_OK:
         case SQLITE_ROW:
@@ -14,74 +17,643 @@ static void db_check_error(struct fakefs_db *fs) {
             break;
 
         default:
-            die("sqlite error: %d %#x %s", errcode, sqlite3_extended_errcode(fs->db), sqlite3_errmsg(fs->db));
+            die("sqlite error: %d %#x %s", errcode, sqlite3_extended_errcode(db), sqlite3_errmsg(db));
     }
 }
+static void db_check_error(struct fakefs_db *fs) {
+    db_check_error_on(fs->db);
+}
 
-static sqlite3_stmt *db_prepare(struct fakefs_db *fs, const char *stmt) {
+static sqlite3_stmt *db_prepare_on(sqlite3 *db, const char *stmt) {
     sqlite3_stmt *statement;
-    sqlite3_prepare_v2(fs->db, stmt, strlen(stmt) + 1, &statement, NULL);
-    db_check_error(fs);
+    sqlite3_prepare_v2(db, stmt, strlen(stmt) + 1, &statement, NULL);
+    db_check_error_on(db);
     return statement;
 }
+static sqlite3_stmt *db_prepare(struct fakefs_db *fs, const char *stmt) {
+    return db_prepare_on(fs->db, stmt);
+}
 
-bool db_exec(struct fakefs_db *fs, sqlite3_stmt *stmt) {
+// these work for statements on any connection, including the readers
+bool db_exec(struct fakefs_db *UNUSED(fs), sqlite3_stmt *stmt) {
     int err = sqlite3_step(stmt);
-    db_check_error(fs);
+    db_check_error_on(sqlite3_db_handle(stmt));
     return err == SQLITE_ROW;
 }
-void db_reset(struct fakefs_db *fs, sqlite3_stmt *stmt) {
+void db_reset(struct fakefs_db *UNUSED(fs), sqlite3_stmt *stmt) {
     sqlite3_reset(stmt);
-    db_check_error(fs);
+    db_check_error_on(sqlite3_db_handle(stmt));
 }
 void db_exec_reset(struct fakefs_db *fs, sqlite3_stmt *stmt) {
     db_exec(fs, stmt);
     db_reset(fs, stmt);
 }
 
+// The paths and stats tables are fronted by an in-memory cache, since getting
+// anything out of sqlite means taking fs->lock, starting a transaction and
+// walking a B-tree. Entries map a path to its inode (0 if there's no such
+// path) or an inode to its stat. They're only added or changed with fs->lock
+// held, by the functions below that read or write the same rows, so the cache
+// follows the database. Looking something up only takes a shard lock.
+//
+// If a transaction changes anything and then gets rolled back, the whole
+// cache is thrown out. A group commit savepoint (see below) that's rolled
+// back only forgets the entries put in while it was open. Other processes (the file provider) write to the same
+// database, which shows up as a change in pragma data_version. That gets
+// checked at most every CACHE_RECHECK_NS.
+//
+// Reader connections (see below) read without fs->lock, so what they read
+// might be out of date by the time they put it in the cache. cache.seq is odd
+// while a transaction on the main connection has changed something and
+// increases whenever that ends or the cache is flushed. A reader only puts
+// something in the cache if seq is even and unchanged since before it started
+// reading.
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256 // per shard
+#define CACHE_MAX 2048 // entries per shard
+#define CACHE_RECHECK_NS 50000000
+#define CACHE_SEQ_LOCKED UINT64_MAX // for callers with fs->lock
+#define CACHE_UNDO_MAX 16
+
+struct cache_entry {
+    struct cache_entry *next; // in the bucket
+    struct cache_entry *lru_prev, *lru_next;
+    uint64_t hash;
+    bool is_path;
+    inode_t inode;
+    struct ish_stat stat; // only if !is_path
+    size_t path_len;
+    char path[];
+};
+
+// What's been put in the cache since the current savepoint started
+struct fake_cache_undo {
+    unsigned count; // CACHE_UNDO_MAX + 1 if there were too many to keep track of
+    struct {
+        bool is_path;
+        inode_t inode;
+        char *path;
+    } entries[CACHE_UNDO_MAX];
+};
+
+struct fake_cache_shard {
+    sqlite3_mutex *lock;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    // most recently used first
+    struct cache_entry *lru_first, *lru_last;
+    unsigned count;
+};
+
+static uint64_t cache_hash_path(const char *path, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) path[i]) * 0x100000001b3;
+    return hash;
+}
+
+static uint64_t cache_hash_inode(inode_t inode) {
+    return (inode + 1) * 0x9e3779b97f4a7c15;
+}
+
+static struct fake_cache_shard *cache_shard(struct fakefs_db *fs, uint64_t hash) {
+    return &fs->cache.shards[hash % CACHE_SHARDS];
+}
+
+static struct cache_entry **cache_bucket(struct fake_cache_shard *shard, uint64_t hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+static void cache_lru_unlink(struct fake_cache_shard *shard, struct cache_entry *entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_first = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_last = entry->lru_prev;
+}
+
+static void cache_lru_push(struct fake_cache_shard *shard, struct cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_first;
+    if (shard->lru_first)
+        shard->lru_first->lru_prev = entry;
+    else
+        shard->lru_last = entry;
+    shard->lru_first = entry;
+}
+
+// Must be called with the shard locked
+static struct cache_entry **cache_find(struct fake_cache_shard *shard, uint64_t hash, bool is_path, const char *path, size_t path_len, inode_t inode) {
+    struct cache_entry **entry;
+    for (entry = cache_bucket(shard, hash); *entry != NULL; entry = &(*entry)->next) {
+        struct cache_entry *e = *entry;
+        if (e->hash != hash || e->is_path != is_path)
+            continue;
+        if (is_path ? e->path_len == path_len && memcmp(e->path, path, path_len) == 0 : e->inode == inode)
+            return entry;
+    }
+    return NULL;
+}
+
+// Must be called with the shard locked
+static void cache_remove(struct fake_cache_shard *shard, struct cache_entry **entry) {
+    struct cache_entry *e = *entry;
+    *entry = e->next;
+    cache_lru_unlink(shard, e);
+    shard->count--;
+    free(e);
+}
+
+static void cache_remove_entry(struct fake_cache_shard *shard, struct cache_entry *e) {
+    struct cache_entry **entry = cache_bucket(shard, e->hash);
+    while (*entry != e)
+        entry = &(*entry)->next;
+    cache_remove(shard, entry);
+}
+
+// Must be called with fs->lock
+static void cache_undo_record(struct fakefs_db *fs, bool is_path, const char *path, inode_t inode) {
+    struct fake_cache_undo *undo = fs->cache.undo;
+    if (undo->count >= CACHE_UNDO_MAX) {
+        undo->count = CACHE_UNDO_MAX + 1;
+        return;
+    }
+    char *path_copy = NULL;
+    if (is_path && (path_copy = strdup(path)) == NULL) {
+        undo->count = CACHE_UNDO_MAX + 1;
+        return;
+    }
+    undo->entries[undo->count].is_path = is_path;
+    undo->entries[undo->count].inode = inode;
+    undo->entries[undo->count].path = path_copy;
+    undo->count++;
+}
+
+// Adds or replaces an entry
+static void cache_put(struct fakefs_db *fs, uint64_t seq, bool is_path, const char *path, inode_t inode, struct ish_stat *stat) {
+    if (fs->cache.shards == NULL)
+        return;
+    if (seq == CACHE_SEQ_LOCKED && fs->batch.in_savepoint)
+        cache_undo_record(fs, is_path, path, inode);
+    size_t path_len = is_path ? strlen(path) : 0;
+    uint64_t hash = is_path ? cache_hash_path(path, path_len) : cache_hash_inode(inode);
+    struct fake_cache_shard *shard = cache_shard(fs, hash);
+    sqlite3_mutex_enter(shard->lock);
+    if (seq != CACHE_SEQ_LOCKED && ((seq & 1) || seq != __atomic_load_n(&fs->cache.seq, __ATOMIC_SEQ_CST))) {
+        sqlite3_mutex_leave(shard->lock);
+        return;
+    }
+    struct cache_entry **entry = cache_find(shard, hash, is_path, path, path_len, inode);
+    struct cache_entry *e;
+    if (entry != NULL) {
+        e = *entry;
+        cache_lru_unlink(shard, e);
+    } else {
+        e = malloc(sizeof(struct cache_entry) + path_len);
+        if (e == NULL) {
+            sqlite3_mutex_leave(shard->lock);
+            return;
+        }
+        e->hash = hash;
+        e->is_path = is_path;
+        e->path_len = path_len;
+        memcpy(e->path, path, path_len);
+        struct cache_entry **bucket = cache_bucket(shard, hash);
+        e->next = *bucket;
+        *bucket = e;
+        shard->count++;
+    }
+    e->inode = inode;
+    if (stat != NULL)
+        e->stat = *stat;
+    cache_lru_push(shard, e);
+    if (shard->count > CACHE_MAX)
+        cache_remove_entry(shard, shard->lru_last);
+    sqlite3_mutex_leave(shard->lock);
+}
+
+static void cache_put_path(struct fakefs_db *fs, uint64_t seq, const char *path, inode_t inode) {
+    cache_put(fs, seq, true, path, inode, NULL);
+}
+static void cache_put_inode(struct fakefs_db *fs, uint64_t seq, inode_t inode, struct ish_stat *stat) {
+    cache_put(fs, seq, false, NULL, inode, stat);
+}
+
+// Must be called with fs->lock by anything that changes the database, before
+// the transaction ends
+static void cache_write(struct fakefs_db *fs) {
+    if (!fs->cache.dirty) {
+        fs->cache.dirty = true;
+        __atomic_fetch_add(&fs->cache.seq, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Must be called with fs->lock at the end of a transaction
+static void cache_write_done(struct fakefs_db *fs) {
+    if (fs->cache.dirty) {
+        fs->cache.dirty = false;
+        __atomic_fetch_add(&fs->cache.seq, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static bool cache_get(struct fakefs_db *fs, bool is_path, const char *path, inode_t *inode, struct ish_stat *stat) {
+    size_t path_len = is_path ? strlen(path) : 0;
+    uint64_t hash = is_path ? cache_hash_path(path, path_len) : cache_hash_inode(*inode);
+    struct fake_cache_shard *shard = cache_shard(fs, hash);
+    sqlite3_mutex_enter(shard->lock);
+    struct cache_entry **entry = cache_find(shard, hash, is_path, path, path_len, *inode);
+    if (entry != NULL) {
+        struct cache_entry *e = *entry;
+        *inode = e->inode;
+        if (stat != NULL)
+            *stat = e->stat;
+        cache_lru_unlink(shard, e);
+        cache_lru_push(shard, e);
+    }
+    sqlite3_mutex_leave(shard->lock);
+    return entry != NULL;
+}
+
+static void cache_forget_inode(struct fakefs_db *fs, inode_t inode) {
+    uint64_t hash = cache_hash_inode(inode);
+    struct fake_cache_shard *shard = cache_shard(fs, hash);
+    sqlite3_mutex_enter(shard->lock);
+    struct cache_entry **entry = cache_find(shard, hash, false, NULL, 0, inode);
+    if (entry != NULL)
+        cache_remove(shard, entry);
+    sqlite3_mutex_leave(shard->lock);
+}
+
+static void cache_forget_path(struct fakefs_db *fs, const char *path) {
+    size_t path_len = strlen(path);
+    uint64_t hash = cache_hash_path(path, path_len);
+    struct fake_cache_shard *shard = cache_shard(fs, hash);
+    sqlite3_mutex_enter(shard->lock);
+    struct cache_entry **entry = cache_find(shard, hash, true, path, path_len, 0);
+    if (entry != NULL)
+        cache_remove(shard, entry);
+    sqlite3_mutex_leave(shard->lock);
+}
+
+// Forgets the path and everything under it. Must be called with fs->lock.
+static void cache_forget_tree(struct fakefs_db *fs, const char *path) {
+    size_t path_len = strlen(path);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct fake_cache_shard *shard = &fs->cache.shards[i];
+        sqlite3_mutex_enter(shard->lock);
+        struct cache_entry *e = shard->lru_first;
+        while (e != NULL) {
+            struct cache_entry *next = e->lru_next;
+            if (e->is_path && e->path_len >= path_len && memcmp(e->path, path, path_len) == 0
+                    && (e->path_len == path_len || e->path[path_len] == '/'))
+                cache_remove_entry(shard, e);
+            e = next;
+        }
+        sqlite3_mutex_leave(shard->lock);
+    }
+}
+
+void fake_cache_flush(struct fakefs_db *fs) {
+    __atomic_fetch_add(&fs->cache.seq, 2, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct fake_cache_shard *shard = &fs->cache.shards[i];
+        sqlite3_mutex_enter(shard->lock);
+        while (shard->lru_first != NULL)
+            cache_remove_entry(shard, shard->lru_first);
+        sqlite3_mutex_leave(shard->lock);
+    }
+}
+
+// Must be called with fs->lock when a savepoint ends. If it was rolled back,
+// what it put in the cache is forgotten, since it might not be true anymore.
+static void cache_undo_end(struct fakefs_db *fs, bool rolled_back) {
+    struct fake_cache_undo *undo = fs->cache.undo;
+    if (undo == NULL)
+        return;
+    if (rolled_back && undo->count > CACHE_UNDO_MAX)
+        fake_cache_flush(fs);
+    for (unsigned i = 0; i < undo->count && i < CACHE_UNDO_MAX; i++) {
+        if (rolled_back) {
+            if (undo->entries[i].is_path)
+                cache_forget_path(fs, undo->entries[i].path);
+            else
+                cache_forget_inode(fs, undo->entries[i].inode);
+        }
+        free(undo->entries[i].path);
+    }
+    undo->count = 0;
+}
+
+static uint64_t cache_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Throws out the cache if another process wrote to the database
+static void cache_check_external(struct fakefs_db *fs) {
+    uint64_t now = cache_now();
+    if (now - __atomic_load_n(&fs->cache.checked, __ATOMIC_RELAXED) < CACHE_RECHECK_NS)
+        return;
+    sqlite3_mutex_enter(fs->lock);
+    int64_t data_version = 0;
+    if (db_exec(fs, fs->stmt.data_version))
+        data_version = sqlite3_column_int64(fs->stmt.data_version, 0);
+    db_reset(fs, fs->stmt.data_version);
+    if (data_version != fs->cache.data_version) {
+        fs->cache.data_version = data_version;
+        fake_cache_flush(fs);
+    }
+    __atomic_store_n(&fs->cache.checked, now, __ATOMIC_RELAXED);
+    sqlite3_mutex_leave(fs->lock);
+}
+
+static void cache_init(struct fakefs_db *fs) {
+    fs->cache.shards = calloc(CACHE_SHARDS, sizeof(struct fake_cache_shard));
+    if (fs->cache.shards == NULL)
+        die("could not allocate fakefs cache");
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        fs->cache.shards[i].lock = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    fs->cache.undo = calloc(1, sizeof(struct fake_cache_undo));
+    if (fs->cache.undo == NULL)
+        die("could not allocate fakefs cache");
+    fs->cache.dirty = false;
+    fs->cache.seq = 0;
+    fs->cache.data_version = 0;
+    fs->cache.checked = 0;
+}
+
+static void cache_deinit(struct fakefs_db *fs) {
+    if (fs->cache.shards == NULL)
+        return;
+    fake_cache_flush(fs);
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        sqlite3_mutex_free(fs->cache.shards[i].lock);
+    free(fs->cache.shards);
+    fs->cache.shards = NULL;
+    cache_undo_end(fs, false);
+    free(fs->cache.undo);
+    fs->cache.undo = NULL;
+}
+
+// Group commit
+//
+// Committing a transaction in WAL mode means appending to the WAL and syncing
+// it, which adds up when something like untarring a package creates thousands
+// of files one transaction at a time. With group commit on, the first
+// db_begin_write starts a transaction that's kept open after db_commit, and
+// later transactions become savepoints in it, so a rollback still only undoes
+// its own changes. The whole batch is committed once it's been open for
+// window_ns or has BATCH_MAX_OPS transactions in it, or when db_flush is
+// called for fsync or sync. Until then nothing in it is visible to other
+// connections, so while it's open the readers aren't used.
+
+#define BATCH_MAX_OPS 1000
+
+static void batch_commit(struct fakefs_db *fs) {
+    db_exec_reset(fs, fs->stmt.commit);
+    __atomic_store_n(&fs->batch.open, false, __ATOMIC_SEQ_CST);
+    cache_write_done(fs);
+}
+
+void db_batch_enable(struct fakefs_db *fs, uint64_t window_ns, void (*opened)(struct fakefs_db *fs, void *data), void *data) {
+    sqlite3_mutex_enter(fs->lock);
+    fs->batch.window_ns = window_ns;
+    fs->batch.opened = opened;
+    fs->batch.data = data;
+    sqlite3_mutex_leave(fs->lock);
+}
+
+void db_flush(struct fakefs_db *fs) {
+    sqlite3_mutex_enter(fs->lock);
+    if (fs->batch.open)
+        batch_commit(fs);
+    sqlite3_mutex_leave(fs->lock);
+}
+
 void db_begin_read(struct fakefs_db *fs) {
     sqlite3_mutex_enter(fs->lock);
+    if (fs->batch.open) {
+        db_exec_reset(fs, fs->stmt.savepoint);
+        fs->batch.in_savepoint = true;
+        return;
+    }
     db_exec_reset(fs, fs->stmt.begin_deferred);
 }
 void db_begin_write(struct fakefs_db *fs) {
     sqlite3_mutex_enter(fs->lock);
-    db_exec_reset(fs, fs->stmt.begin_immediate);
+    if (fs->batch.window_ns == 0) {
+        db_exec_reset(fs, fs->stmt.begin_immediate);
+        return;
+    }
+    if (!fs->batch.open) {
+        db_exec_reset(fs, fs->stmt.begin_immediate);
+        __atomic_store_n(&fs->batch.open, true, __ATOMIC_SEQ_CST);
+        fs->batch.ops = 0;
+        fs->batch.started = cache_now();
+        if (fs->batch.opened)
+            fs->batch.opened(fs, fs->batch.data);
+    }
+    db_exec_reset(fs, fs->stmt.savepoint);
+    fs->batch.in_savepoint = true;
 }
 void db_commit(struct fakefs_db *fs) {
-    db_exec_reset(fs, fs->stmt.commit);
+    if (fs->batch.in_savepoint) {
+        fs->batch.in_savepoint = false;
+        db_exec_reset(fs, fs->stmt.release);
+        cache_undo_end(fs, false);
+        if (++fs->batch.ops >= BATCH_MAX_OPS || cache_now() - fs->batch.started >= fs->batch.window_ns)
+            batch_commit(fs);
+    } else {
+        db_exec_reset(fs, fs->stmt.commit);
+        cache_write_done(fs);
+    }
     sqlite3_mutex_leave(fs->lock);
 }
 void db_rollback(struct fakefs_db *fs) {
+    if (fs->batch.in_savepoint) {
+        // the rest of the batch stays, and so does cache.dirty
+        fs->batch.in_savepoint = false;
+        db_exec_reset(fs, fs->stmt.rollback_to);
+        db_exec_reset(fs, fs->stmt.release);
+        cache_undo_end(fs, true);
+        sqlite3_mutex_leave(fs->lock);
+        return;
+    }
     db_exec_reset(fs, fs->stmt.rollback);
+    if (fs->cache.dirty)
+        fake_cache_flush(fs);
+    cache_write_done(fs);
     sqlite3_mutex_leave(fs->lock);
 }
 
+// Lookups that miss the cache use one of these connections instead of the
+// main one, so they don't have to wait for fs->lock and whatever transaction
+// is holding it. WAL mode lets them read while the main connection writes.
+// The last one is on the main connection, for when the rest are all in use,
+// and it needs fs->lock.
+#define READERS 4
+struct fakefs_reader {
+    sqlite3 *db;
+    bool busy; // protected by readers_lock
+    struct {
+        sqlite3_stmt *begin;
+        sqlite3_stmt *commit;
+        sqlite3_stmt *path_get_inode;
+        sqlite3_stmt *path_read_stat;
+        sqlite3_stmt *inode_read_stat;
+        sqlite3_stmt *dir_next_child;
+    } stmt;
+};
+
+static void reader_prepare(struct fakefs_reader *reader) {
+    reader->busy = false;
+    reader->stmt.begin = db_prepare_on(reader->db, "begin deferred");
+    reader->stmt.commit = db_prepare_on(reader->db, "commit");
+    reader->stmt.path_get_inode = db_prepare_on(reader->db, "select inode from paths where path = ?");
+    reader->stmt.path_read_stat = db_prepare_on(reader->db, "select inode, stat from stats natural join paths where path = ?");
+    reader->stmt.inode_read_stat = db_prepare_on(reader->db, "select stat from stats where inode = ?");
+    reader->stmt.dir_next_child = db_prepare_on(reader->db, "select path, inode, stat from paths cross join stats using (inode) "
+            "where path >= ? and path < ? order by path limit 1");
+}
+
+static void reader_finalize(struct fakefs_reader *reader) {
+    sqlite3_finalize(reader->stmt.begin);
+    sqlite3_finalize(reader->stmt.commit);
+    sqlite3_finalize(reader->stmt.path_get_inode);
+    sqlite3_finalize(reader->stmt.path_read_stat);
+    sqlite3_finalize(reader->stmt.inode_read_stat);
+    sqlite3_finalize(reader->stmt.dir_next_child);
+}
+
+static void readers_init(struct fakefs_db *fs, const char *db_path) {
+    fs->readers = calloc(READERS + 1, sizeof(struct fakefs_reader));
+    if (fs->readers == NULL)
+        die("could not allocate fakefs readers");
+    fs->readers_lock = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    for (int i = 0; i < READERS; i++) {
+        struct fakefs_reader *reader = &fs->readers[i];
+        if (sqlite3_open_v2(db_path, &reader->db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+            printk("error opening database: %s\n", sqlite3_errmsg(reader->db));
+            sqlite3_close(reader->db);
+            reader->db = NULL;
+            // it's fine, just less parallel
+            reader->busy = true;
+            continue;
+        }
+        sqlite3_busy_timeout(reader->db, 1000);
+        reader_prepare(reader);
+    }
+    fs->readers[READERS].db = fs->db;
+    reader_prepare(&fs->readers[READERS]);
+}
+
+static void readers_deinit(struct fakefs_db *fs) {
+    if (fs->readers == NULL)
+        return;
+    for (int i = 0; i <= READERS; i++) {
+        struct fakefs_reader *reader = &fs->readers[i];
+        if (reader->db == NULL)
+            continue;
+        reader_finalize(reader);
+        if (i != READERS)
+            sqlite3_close(reader->db);
+    }
+    sqlite3_mutex_free(fs->readers_lock);
+    free(fs->readers);
+    fs->readers = NULL;
+}
+
+// Starts a read transaction on a free reader. *seq gets what to pass to
+// cache_put for what's read.
+static struct fakefs_reader *reader_begin(struct fakefs_db *fs, uint64_t *seq) {
+    struct fakefs_reader *reader = NULL;
+    // a group commit batch is only visible on the main connection
+    if (!__atomic_load_n(&fs->batch.open, __ATOMIC_SEQ_CST)) {
+        sqlite3_mutex_enter(fs->readers_lock);
+        for (int i = 0; i < READERS; i++) {
+            if (!fs->readers[i].busy) {
+                reader = &fs->readers[i];
+                reader->busy = true;
+                break;
+            }
+        }
+        sqlite3_mutex_leave(fs->readers_lock);
+    }
+
+    if (reader == NULL) {
+        db_begin_read(fs);
+        *seq = CACHE_SEQ_LOCKED;
+        return &fs->readers[READERS];
+    }
+    *seq = __atomic_load_n(&fs->cache.seq, __ATOMIC_SEQ_CST);
+    db_exec_reset(fs, reader->stmt.begin);
+    return reader;
+}
+
+static void reader_end(struct fakefs_db *fs, struct fakefs_reader *reader) {
+    if (reader == &fs->readers[READERS]) {
+        db_commit(fs);
+        return;
+    }
+    db_exec_reset(fs, reader->stmt.commit);
+    sqlite3_mutex_enter(fs->readers_lock);
+    reader->busy = false;
+    sqlite3_mutex_leave(fs->readers_lock);
+}
+
 static void bind_path(sqlite3_stmt *stmt, int i, const char *path) {
     sqlite3_bind_blob(stmt, i, path, strlen(path), SQLITE_TRANSIENT);
 }
 
-inode_t path_get_inode(struct fakefs_db *fs, const char *path) {
+static inode_t query_path_inode(struct fakefs_db *fs, uint64_t seq, sqlite3_stmt *stmt, const char *path) {
     // select inode from paths where path = ?
-    bind_path(fs->stmt.path_get_inode, 1, path);
+    bind_path(stmt, 1, path);
     inode_t inode = 0;
-    if (db_exec(fs, fs->stmt.path_get_inode))
-        inode = sqlite3_column_int64(fs->stmt.path_get_inode, 0);
-    db_reset(fs, fs->stmt.path_get_inode);
+    if (db_exec(fs, stmt))
+        inode = sqlite3_column_int64(stmt, 0);
+    db_reset(fs, stmt);
+    cache_put_path(fs, seq, path, inode);
     return inode;
 }
-bool path_read_stat(struct fakefs_db *fs, const char *path, struct ish_stat *stat, inode_t *inode) {
+static bool query_path_stat(struct fakefs_db *fs, uint64_t seq, sqlite3_stmt *stmt, const char *path, struct ish_stat *stat, inode_t *inode) {
     // select inode, stat from stats natural join paths where path = ?
-    bind_path(fs->stmt.path_read_stat, 1, path);
-    bool exists = db_exec(fs, fs->stmt.path_read_stat);
+    bind_path(stmt, 1, path);
+    bool exists = db_exec(fs, stmt);
     if (exists) {
+        inode_t the_inode = sqlite3_column_int64(stmt, 0);
+        struct ish_stat the_stat = *(struct ish_stat *) sqlite3_column_blob(stmt, 1);
+        cache_put_path(fs, seq, path, the_inode);
+        cache_put_inode(fs, seq, the_inode, &the_stat);
         if (inode)
-            *inode = sqlite3_column_int64(fs->stmt.path_read_stat, 0);
+            *inode = the_inode;
         if (stat)
-            *stat = *(struct ish_stat *) sqlite3_column_blob(fs->stmt.path_read_stat, 1);
+            *stat = the_stat;
     }
-    db_reset(fs, fs->stmt.path_read_stat);
+    db_reset(fs, stmt);
     return exists;
 }
+static bool query_inode_stat(struct fakefs_db *fs, uint64_t seq, sqlite3_stmt *stmt, inode_t inode, struct ish_stat *stat) {
+    // select stat from stats where inode = ?
+    sqlite3_bind_int64(stmt, 1, inode);
+    bool exist = db_exec(fs, stmt);
+    if (exist) {
+        *stat = *(struct ish_stat *) sqlite3_column_blob(stmt, 0);
+        cache_put_inode(fs, seq, inode, stat);
+    }
+    db_reset(fs, stmt);
+    return exist;
+}
+
+inode_t path_get_inode(struct fakefs_db *fs, const char *path) {
+    return query_path_inode(fs, CACHE_SEQ_LOCKED, fs->stmt.path_get_inode, path);
+}
+bool path_read_stat(struct fakefs_db *fs, const char *path, struct ish_stat *stat, inode_t *inode) {
+    return query_path_stat(fs, CACHE_SEQ_LOCKED, fs->stmt.path_read_stat, path, stat, inode);
+}
 inode_t path_create(struct fakefs_db *fs, const char *path, struct ish_stat *stat) {
     // insert into stats (stat) values (?)
     sqlite3_bind_blob(fs->stmt.path_create_stat, 1, stat, sizeof(*stat), SQLITE_TRANSIENT);
@@ -90,6 +662,9 @@ inode_t path_create(struct fakefs_db *fs, const char *path, struct ish_stat *sta
     // insert or replace into paths values (?, last_insert_rowid())
     bind_path(fs->stmt.path_create_path, 1, path);
     db_exec_reset(fs, fs->stmt.path_create_path);
+    cache_write(fs);
+    cache_put_path(fs, CACHE_SEQ_LOCKED, path, inode);
+    cache_put_inode(fs, CACHE_SEQ_LOCKED, inode, stat);
     return inode;
 }
 
@@ -98,19 +673,15 @@ void inode_read_stat_or_die(struct fakefs_db *fs, inode_t inode, struct ish_stat
         die("inode_read_stat(%llu): missing inode", (unsigned long long) inode);
 }
 bool inode_read_stat_if_exist(struct fakefs_db *fs, inode_t inode, struct ish_stat *stat) {
-    // select stat from stats where inode = ?
-    sqlite3_bind_int64(fs->stmt.inode_read_stat, 1, inode);
-    bool exist = db_exec(fs, fs->stmt.inode_read_stat);
-    if (exist)
-        *stat = *(struct ish_stat *) sqlite3_column_blob(fs->stmt.inode_read_stat, 0);
-    db_reset(fs, fs->stmt.inode_read_stat);
-    return exist;
+    return query_inode_stat(fs, CACHE_SEQ_LOCKED, fs->stmt.inode_read_stat, inode, stat);
 }
 void inode_write_stat(struct fakefs_db *fs, inode_t inode, struct ish_stat *stat) {
     // update stats set stat = ? where inode = ?
     sqlite3_bind_blob(fs->stmt.inode_write_stat, 1, stat, sizeof(*stat), SQLITE_TRANSIENT);
     sqlite3_bind_int64(fs->stmt.inode_write_stat, 2, inode);
     db_exec_reset(fs, fs->stmt.inode_write_stat);
+    cache_write(fs);
+    cache_put_inode(fs, CACHE_SEQ_LOCKED, inode, stat);
 }
 
 void path_link(struct fakefs_db *fs, const char *src, const char *dst) {
@@ -121,6 +692,8 @@ void path_link(struct fakefs_db *fs, const char *src, const char *dst) {
     bind_path(fs->stmt.path_link, 1, dst);
     sqlite3_bind_int64(fs->stmt.path_link, 2, inode);
     db_exec_reset(fs, fs->stmt.path_link);
+    cache_write(fs);
+    cache_put_path(fs, CACHE_SEQ_LOCKED, dst, inode);
 }
 inode_t path_unlink(struct fakefs_db *fs, const char *path) {
     inode_t inode = path_get_inode(fs, path);
@@ -129,6 +702,8 @@ inode_t path_unlink(struct fakefs_db *fs, const char *path) {
     // delete from paths where path = ?
     bind_path(fs->stmt.path_unlink, 1, path);
     db_exec_reset(fs, fs->stmt.path_unlink);
+    cache_write(fs);
+    cache_put_path(fs, CACHE_SEQ_LOCKED, path, 0);
     return inode;
 }
 void path_rename(struct fakefs_db *fs, const char *src, const char *dst) {
@@ -151,6 +726,117 @@ void path_rename(struct fakefs_db *fs, const char *src, const char *dst) {
     sqlite3_bind_blob(fs->stmt.path_rename, 4, src_extra, src_len + 1, SQLITE_TRANSIENT);
     sqlite3_bind_blob(fs->stmt.path_rename, 5, src_extra, src_len, SQLITE_TRANSIENT);
     db_exec_reset(fs, fs->stmt.path_rename);
+    cache_write(fs);
+    cache_forget_tree(fs, src);
+    cache_forget_tree(fs, dst);
+    cache_put_path(fs, CACHE_SEQ_LOCKED, src, 0);
+}
+
+void inode_try_cleanup(struct fakefs_db *fs, inode_t inode) {
+    // delete from stats where inode = ? and not exists (select 1 from paths where inode = stats.inode)
+    sqlite3_bind_int64(fs->stmt.try_cleanup_inode, 1, inode);
+    db_exec_reset(fs, fs->stmt.try_cleanup_inode);
+    cache_write(fs);
+    cache_forget_inode(fs, inode);
+}
+
+inode_t path_get_inode_cached(struct fakefs_db *fs, const char *path) {
+    cache_check_external(fs);
+    inode_t inode = 0;
+    if (cache_get(fs, true, path, &inode, NULL))
+        return inode;
+    uint64_t seq;
+    struct fakefs_reader *reader = reader_begin(fs, &seq);
+    inode = query_path_inode(fs, seq, reader->stmt.path_get_inode, path);
+    reader_end(fs, reader);
+    return inode;
+}
+
+bool path_read_stat_cached(struct fakefs_db *fs, const char *path, struct ish_stat *stat, inode_t *inode) {
+    cache_check_external(fs);
+    inode_t the_inode = 0;
+    if (cache_get(fs, true, path, &the_inode, NULL)) {
+        if (the_inode == 0)
+            return false;
+        struct ish_stat the_stat;
+        if (cache_get(fs, false, NULL, &the_inode, &the_stat)) {
+            if (inode)
+                *inode = the_inode;
+            if (stat)
+                *stat = the_stat;
+            return true;
+        }
+    }
+    uint64_t seq;
+    struct fakefs_reader *reader = reader_begin(fs, &seq);
+    bool exists = query_path_stat(fs, seq, reader->stmt.path_read_stat, path, stat, inode);
+    reader_end(fs, reader);
+    return exists;
+}
+
+// Finding the children means skipping over everything else under the
+// directory. Rather than scanning all of that, each step is one seek: past the
+// last child found, or past the subtree of the child a descendant belongs to.
+void dir_read_cached(struct fakefs_db *fs, const char *path) {
+    cache_check_external(fs);
+    size_t dir_len = strlen(path);
+    // children sort after "dir/" and before "dir0"
+    char upper[dir_len + 1];
+    memcpy(upper, path, dir_len);
+    upper[dir_len] = '/' + 1;
+    char lower[PATH_MAX + 2];
+    memcpy(lower, path, dir_len);
+    lower[dir_len] = '/';
+    size_t lower_len = dir_len + 1;
+
+    uint64_t seq;
+    struct fakefs_reader *reader = reader_begin(fs, &seq);
+    sqlite3_stmt *stmt = reader->stmt.dir_next_child;
+    for (;;) {
+        // select path, inode, stat from paths cross join stats using (inode)
+        //  where path >= ? and path < ? order by path limit 1
+        sqlite3_bind_blob(stmt, 1, lower, lower_len, SQLITE_TRANSIENT);
+        sqlite3_bind_blob(stmt, 2, upper, dir_len + 1, SQLITE_TRANSIENT);
+        if (!db_exec(fs, stmt))
+            break;
+        const char *child = sqlite3_column_blob(stmt, 0);
+        size_t child_len = sqlite3_column_bytes(stmt, 0);
+        if (child_len > PATH_MAX)
+            break;
+        const char *slash = memchr(child + dir_len + 1, '/', child_len - dir_len - 1);
+        if (slash != NULL) {
+            // this is under a subdirectory, skip to after the subdirectory
+            lower_len = slash - child;
+            memcpy(lower, child, lower_len);
+            lower[lower_len++] = '/' + 1;
+        } else {
+            char child_path[child_len + 1];
+            memcpy(child_path, child, child_len);
+            child_path[child_len] = '\0';
+            inode_t inode = sqlite3_column_int64(stmt, 1);
+            struct ish_stat stat = *(struct ish_stat *) sqlite3_column_blob(stmt, 2);
+            cache_put_path(fs, seq, child_path, inode);
+            cache_put_inode(fs, seq, inode, &stat);
+            // the next thing after this path
+            memcpy(lower, child, child_len);
+            lower[child_len] = '\0';
+            lower_len = child_len + 1;
+        }
+        db_reset(fs, stmt);
+    }
+    db_reset(fs, stmt);
+    reader_end(fs, reader);
+}
+
+bool inode_read_stat_cached(struct fakefs_db *fs, inode_t inode, struct ish_stat *stat) {
+    cache_check_external(fs);
+    if (cache_get(fs, false, NULL, &inode, stat))
+        return true;
+    uint64_t seq;
+    struct fakefs_reader *reader = reader_begin(fs, &seq);
+    bool exists = query_inode_stat(fs, seq, reader->stmt.inode_read_stat, inode, stat);
+    reader_end(fs, reader);
+    return exists;
 }
 
 #if DEBUG_sql
@@ -179,10 +865,14 @@ extern int fakefs_rebuild(struct fakefs_db *fs, int root_fd);
 extern int fakefs_migrate(struct fakefs_db *fs, int root_fd);
 
 int fake_db_init(struct fakefs_db *fs, const char *db_path, int root_fd) {
+    // rebuilding and migrating go through the functions that fill the cache
+    cache_init(fs);
+    fs->batch = (struct fake_batch) {};
     int err = sqlite3_open_v2(db_path, &fs->db, SQLITE_OPEN_READWRITE, NULL);
     if (err != SQLITE_OK) {
         printk("error opening database: %s\n", sqlite3_errmsg(fs->db));
         sqlite3_close(fs->db);
+        cache_deinit(fs);
         return _EINVAL;
     }
     sqlite3_busy_timeout(fs->db, 1000);
@@ -263,11 +953,18 @@ int fake_db_init(struct fakefs_db *fs, const char *db_path, int root_fd) {
             "where (path >= ? and path < ?) or path = ?");
     fs->stmt.path_from_inode = db_prepare(fs, "select path from paths where inode = ?");
     fs->stmt.try_cleanup_inode = db_prepare(fs, "delete from stats where inode = ? and not exists (select 1 from paths where inode = stats.inode)");
+    fs->stmt.data_version = db_prepare(fs, "pragma data_version");
+    fs->stmt.savepoint = db_prepare(fs, "savepoint op");
+    fs->stmt.release = db_prepare(fs, "release op");
+    fs->stmt.rollback_to = db_prepare(fs, "rollback to op");
+    fake_cache_flush(fs);
+    readers_init(fs, db_path);
     return 0;
 }
 
 int fake_db_deinit(struct fakefs_db *fs) {
     if (fs->db) {
+        db_flush(fs);
         sqlite3_finalize(fs->stmt.begin_deferred);
         sqlite3_finalize(fs->stmt.begin_immediate);
         sqlite3_finalize(fs->stmt.commit);
@@ -283,6 +980,12 @@ int fake_db_deinit(struct fakefs_db *fs) {
         sqlite3_finalize(fs->stmt.path_rename);
         sqlite3_finalize(fs->stmt.path_from_inode);
         sqlite3_finalize(fs->stmt.try_cleanup_inode);
+        sqlite3_finalize(fs->stmt.data_version);
+        sqlite3_finalize(fs->stmt.savepoint);
+        sqlite3_finalize(fs->stmt.release);
+        sqlite3_finalize(fs->stmt.rollback_to);
+        readers_deinit(fs);
+        cache_deinit(fs);
         return sqlite3_close(fs->db);
     }
     return SQLITE_OK;
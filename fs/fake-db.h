@@ -23,8 +23,40 @@ struct fakefs_db {
         sqlite3_stmt *path_rename;
         sqlite3_stmt *path_from_inode;
         sqlite3_stmt *try_cleanup_inode;
+        sqlite3_stmt *data_version;
+        sqlite3_stmt *savepoint;
+        sqlite3_stmt *release;
+        sqlite3_stmt *rollback_to;
     } stmt;
     sqlite3_mutex *lock;
+    // extra connections for reading without the lock, see fake-db.c
+    struct fakefs_reader *readers;
+    sqlite3_mutex *readers_lock;
+
+    // recently used paths and stats, see fake-db.c
+    struct fake_cache {
+        struct fake_cache_shard *shards;
+        // protected by lock
+        struct fake_cache_undo *undo;
+        bool dirty; // the current transaction changed what's cached
+        uint64_t seq; // odd while dirty, read without lock
+        int64_t data_version;
+        uint64_t checked; // when data_version was last looked at
+    } cache;
+
+    // group commit, see fake-db.c
+    struct fake_batch {
+        uint64_t window_ns; // 0 if off
+        // protected by lock
+        bool open; // read without lock
+        bool in_savepoint;
+        unsigned ops;
+        uint64_t started;
+        // called with lock when a batch is opened, to arrange for db_flush
+        // to be called within window_ns
+        void (*opened)(struct fakefs_db *fs, void *data);
+        void *data;
+    } batch;
 };
 
 int fake_db_init(struct fakefs_db *fs, const char *db_path, int root_fd);
@@ -34,6 +66,11 @@ void db_begin_read(struct fakefs_db *fs);
 void db_begin_write(struct fakefs_db *fs);
 void db_commit(struct fakefs_db *fs);
 void db_rollback(struct fakefs_db *fs);
+// Turns on group commit: writes are committed together, at most window_ns
+// after the first one or when db_flush is called
+void db_batch_enable(struct fakefs_db *fs, uint64_t window_ns, void (*opened)(struct fakefs_db *fs, void *data), void *data);
+// Commits any writes that are being held back
+void db_flush(struct fakefs_db *fs);
 
 bool db_exec(struct fakefs_db *fs, sqlite3_stmt *stmt);
 void db_reset(struct fakefs_db *fs, sqlite3_stmt *stmt);
@@ -59,5 +96,16 @@ void inode_write_stat(struct fakefs_db *fs, inode_t inode, struct ish_stat *stat
 void path_link(struct fakefs_db *fs, const char *src, const char *dst);
 inode_t path_unlink(struct fakefs_db *fs, const char *path);
 void path_rename(struct fakefs_db *fs, const char *src, const char *dst);
+void inode_try_cleanup(struct fakefs_db *fs, inode_t inode);
+
+// Same as the ones above, but these look in the cache first and only start a
+// transaction if they have to, usually on another connection so they don't
+// wait for the lock. Don't call them inside a transaction.
+inode_t path_get_inode_cached(struct fakefs_db *fs, const char *path);
+bool path_read_stat_cached(struct fakefs_db *fs, const char *path, struct ish_stat *stat, inode_t *inode);
+bool inode_read_stat_cached(struct fakefs_db *fs, inode_t inode, struct ish_stat *stat);
+// Loads the inodes and stats of everything in a directory into the cache
+void dir_read_cached(struct fakefs_db *fs, const char *path);
+void fake_cache_flush(struct fakefs_db *fs);
 
 #endif
@@ -1,122 +1,228 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "fs/sqlutil.h"
 #include "fs/fake-db.h"
 #include "kernel/errno.h"
-#include "util/list.h"
 #include "debug.h"
 
 // rebuild process in pseudocode:
 //
-// table = {}
-// for each path, inode:
+// for each path, inode, stat, in order of inode:
 //     real_inode = stat(path).st_ino
-//     if inode in table:
+//     if inode is the same as the last path's:
 //         unlink(path)
-//         link(table[inode], path)
-//     else:
-//         table[inode] = path
-//     stat = db['stat ' + inode]
+//         link(last path, path)
+//         real_inode = last path's real_inode
 //     new_db['inode ' + path] = real_inode
 //     new_db['stat ' + real_inode] = stat
+//
+// Everything is read into memory first. The stat calls are what takes the
+// time when there's a lot of files, and they don't depend on each other, so
+// they're done by a few threads at once. The new rows are written in order of
+// primary key, which makes each insert an append, and the inode_to_path index
+// is only built once they're all in.
 
-// ad hoc hashtable
-struct entry {
-    ino_t inode;
+#define REBUILD_THREADS 8
+#define REBUILD_INSERT_ROWS 64 // rows per insert statement
+
+struct rebuild_entry {
     char *path;
-    struct list chain;
+    size_t path_len;
+    ino_t inode;
+    ino_t real_inode; // 0 if the file is missing
+    bool has_stat;
+    struct ish_stat stat;
 };
 
+struct rebuild {
+    int root_fd;
+    struct rebuild_entry *entries;
+    size_t count;
+    size_t next; // next entry to stat, atomic
+};
+
+#define REBUILD_STAT_CHUNK 256
+
+static void *rebuild_stat_thread(void *data) {
+    struct rebuild *r = data;
+    for (;;) {
+        size_t start = __atomic_fetch_add(&r->next, REBUILD_STAT_CHUNK, __ATOMIC_RELAXED);
+        if (start >= r->count)
+            break;
+        size_t end = start + REBUILD_STAT_CHUNK;
+        if (end > r->count)
+            end = r->count;
+        for (size_t i = start; i < end; i++) {
+            struct rebuild_entry *entry = &r->entries[i];
+            struct stat stat;
+            if (fstatat(r->root_fd, fix_path(entry->path), &stat, 0) == 0)
+                entry->real_inode = stat.st_ino;
+        }
+    }
+    return NULL;
+}
+
+static void rebuild_stat_all(struct rebuild *r) {
+    pthread_t threads[REBUILD_THREADS];
+    int started = 0;
+    if (r->count > REBUILD_STAT_CHUNK) {
+        for (; started < REBUILD_THREADS - 1; started++) {
+            if (pthread_create(&threads[started], NULL, rebuild_stat_thread, r) != 0)
+                break;
+        }
+    }
+    rebuild_stat_thread(r);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static int compare_real_inode(const void *a, const void *b) {
+    const struct rebuild_entry *x = a, *y = b;
+    return (x->real_inode > y->real_inode) - (x->real_inode < y->real_inode);
+}
+
+static int compare_path(const void *a, const void *b) {
+    const struct rebuild_entry *x = a, *y = b;
+    size_t len = x->path_len < y->path_len ? x->path_len : y->path_len;
+    int cmp = memcmp(x->path, y->path, len);
+    if (cmp != 0)
+        return cmp;
+    return (x->path_len > y->path_len) - (x->path_len < y->path_len);
+}
+
+// "insert ... values (?, ?), (?, ?), ..." with rows rows
+static sqlite3_stmt *prepare_insert(sqlite3 *db, const char *insert, int rows) {
+    size_t len = strlen(insert);
+    char *sql = malloc(len + rows * strlen(", (?, ?)") + 1);
+    strcpy(sql, insert);
+    for (int i = 0; i < rows; i++) {
+        strcpy(sql + len, i == 0 ? " (?, ?)" : ", (?, ?)");
+        len += strlen(sql + len);
+    }
+    int err;
+    sqlite3_stmt *stmt = PREPARE(sql);
+    free(sql);
+    return stmt;
+}
+
+// Calls bind_row for every entry that has_stat, a statement's worth of rows at a time
+static void insert_all(sqlite3 *db, const char *insert, struct rebuild_entry *entries, size_t count,
+        void (*bind_row)(sqlite3_stmt *stmt, int param, struct rebuild_entry *entry)) {
+    int err;
+    sqlite3_stmt *full = prepare_insert(db, insert, REBUILD_INSERT_ROWS);
+    sqlite3_stmt *single = prepare_insert(db, insert, 1);
+    size_t i = 0;
+    for (;;) {
+        // find the next batch
+        struct rebuild_entry *batch[REBUILD_INSERT_ROWS];
+        int rows = 0;
+        while (rows < REBUILD_INSERT_ROWS && i < count) {
+            if (entries[i].has_stat)
+                batch[rows++] = &entries[i];
+            i++;
+        }
+        if (rows == REBUILD_INSERT_ROWS) {
+            for (int row = 0; row < rows; row++)
+                bind_row(full, row * 2 + 1, batch[row]);
+            STEP_RESET(full);
+        } else {
+            for (int row = 0; row < rows; row++) {
+                bind_row(single, 1, batch[row]);
+                STEP_RESET(single);
+            }
+            break;
+        }
+    }
+    FINALIZE(full);
+    FINALIZE(single);
+}
+
+static void bind_stat_row(sqlite3_stmt *stmt, int param, struct rebuild_entry *entry) {
+    sqlite3_bind_int64(stmt, param, entry->real_inode);
+    sqlite3_bind_blob(stmt, param + 1, &entry->stat, sizeof(entry->stat), SQLITE_STATIC);
+}
+
+static void bind_path_row(sqlite3_stmt *stmt, int param, struct rebuild_entry *entry) {
+    sqlite3_bind_blob(stmt, param, entry->path, entry->path_len, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, param + 1, entry->real_inode);
+}
+
 int fakefs_rebuild(struct fakefs_db *fs, int root_fd) {
     sqlite3 *db = fs->db;
     int err;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     EXEC("begin");
-    EXEC("create table paths_old (path blob primary key, inode integer)");
-    EXEC("create table stats_old (inode integer primary key, stat blob)");
-    EXEC("insert into paths_old select * from paths");
-    EXEC("insert into stats_old select * from stats");
-    EXEC("delete from paths");
-    EXEC("delete from stats");
-    sqlite3_stmt *get_paths = PREPARE("select path, inode from paths_old");
-    sqlite3_stmt *read_stat = PREPARE("select stat from stats_old where inode = ?");
-    sqlite3_stmt *write_path = PREPARE("insert into paths (path, inode) values (?, ?)");
-    sqlite3_stmt *write_stat = PREPARE("replace into stats (inode, stat) values (?, ?)");
-
-    struct list hashtable[2000];
-#define HASH_SIZE (sizeof(hashtable)/sizeof(hashtable[0]))
-    for (unsigned i = 0; i < HASH_SIZE; i++)
-        list_init(&hashtable[i]);
-
-    while (STEP(get_paths)) {
-        const char *path = (const char *) sqlite3_column_text(get_paths, 0);
-        ino_t inode = sqlite3_column_int64(get_paths, 1);
-
-        // grab real inode
-        struct stat stat;
-        int err = fstatat(root_fd, fix_path(path), &stat, 0);
-        if (err < 0)
-            continue;
-        ino_t real_inode = stat.st_ino;
-
-        // restore hardlinks
-        struct list *bucket = &hashtable[inode % HASH_SIZE];
-        struct entry *entry;
-        bool found = false;
-        list_for_each_entry(bucket, entry, chain) {
-            if (entry->inode == inode) {
-                unlinkat(root_fd, fix_path(path), 0);
-                linkat(root_fd, fix_path(entry->path), root_fd, fix_path(path), 0);
-                found = true;
-                break;
-            }
-        }
-        if (!found) {
-            entry = malloc(sizeof(struct entry));
-            entry->inode = inode;
-            entry->path = strdup(path);
-            list_add(bucket, &entry->chain);
-        }
+    struct rebuild r = {.root_fd = root_fd};
+    sqlite3_stmt *count = PREPARE("select count(*) from paths");
+    STEP(count);
+    size_t capacity = sqlite3_column_int64(count, 0);
+    FINALIZE(count);
+    r.entries = calloc(capacity ? capacity : 1, sizeof(struct rebuild_entry));
+    if (r.entries == NULL)
+        die("could not allocate fakefs rebuild");
 
-        // extract the stat so we can copy it
-        err = sqlite3_bind_int64(read_stat, 1, inode); CHECK_ERR();
-        if (STEP(read_stat) == false) {
-            RESET(read_stat);
-            continue;
+    sqlite3_stmt *get_paths = PREPARE("select path, inode, stat from paths left join stats using (inode) order by inode");
+    while (STEP(get_paths) && r.count < capacity) {
+        struct rebuild_entry *entry = &r.entries[r.count++];
+        entry->path_len = sqlite3_column_bytes(get_paths, 0);
+        entry->path = malloc(entry->path_len + 1);
+        memcpy(entry->path, sqlite3_column_blob(get_paths, 0), entry->path_len);
+        entry->path[entry->path_len] = '\0';
+        entry->inode = sqlite3_column_int64(get_paths, 1);
+        const void *stat_data = sqlite3_column_blob(get_paths, 2);
+        size_t stat_data_size = sqlite3_column_bytes(get_paths, 2);
+        if (stat_data != NULL) {
+            entry->has_stat = true;
+            memcpy(&entry->stat, stat_data, stat_data_size < sizeof(entry->stat) ? stat_data_size : sizeof(entry->stat));
         }
-        const void *stat_data = sqlite3_column_blob(read_stat, 0);
-        size_t stat_data_size = sqlite3_column_bytes(read_stat, 0);
-
-        // store all the information in the new database
-        err = sqlite3_bind_int64(write_stat, 1, real_inode); CHECK_ERR();
-        err = sqlite3_bind_blob(write_stat, 2, stat_data, stat_data_size, SQLITE_TRANSIENT); CHECK_ERR();
-        STEP(write_stat);
-        RESET(write_stat);
-        err = sqlite3_bind_blob(write_path, 1, path, strlen(path), SQLITE_TRANSIENT); CHECK_ERR();
-        err = sqlite3_bind_int64(write_path, 2, real_inode); CHECK_ERR();
-        STEP(write_path);
-        RESET(write_path);
-
-        RESET(read_stat);
     }
+    FINALIZE(get_paths);
+
+    rebuild_stat_all(&r);
 
-    for (unsigned i = 0; i < HASH_SIZE; i++) {
-        struct entry *entry, *tmp;
-        list_for_each_entry_safe(&hashtable[i], entry, tmp, chain) {
-            list_remove(&entry->chain);
-            free(entry->path);
-            free(entry);
+    // restore hardlinks
+    struct rebuild_entry *first = NULL;
+    for (size_t i = 0; i < r.count; i++) {
+        struct rebuild_entry *entry = &r.entries[i];
+        if (entry->real_inode == 0) {
+            entry->has_stat = false;
+            continue;
+        }
+        if (first == NULL || first->inode != entry->inode) {
+            first = entry;
+            continue;
+        }
+        if (entry->real_inode != first->real_inode) {
+            unlinkat(root_fd, fix_path(entry->path), 0);
+            linkat(root_fd, fix_path(first->path), root_fd, fix_path(entry->path), 0);
+            entry->real_inode = first->real_inode;
         }
     }
 
-    EXEC("drop table paths_old");
-    EXEC("drop table stats_old");
+    EXEC("drop index if exists inode_to_path");
+    EXEC("delete from paths");
+    EXEC("delete from stats");
+    qsort(r.entries, r.count, sizeof(struct rebuild_entry), compare_real_inode);
+    insert_all(db, "replace into stats (inode, stat) values", r.entries, r.count, bind_stat_row);
+    qsort(r.entries, r.count, sizeof(struct rebuild_entry), compare_path);
+    insert_all(db, "replace into paths (path, inode) values", r.entries, r.count, bind_path_row);
+    EXEC("create index inode_to_path on paths (inode, path)");
     EXEC("commit");
-    FINALIZE(get_paths);
-    FINALIZE(read_stat);
-    FINALIZE(write_path);
-    FINALIZE(write_stat);
+
+    for (size_t i = 0; i < r.count; i++)
+        free(r.entries[i].path);
+    free(r.entries);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printk("fakefs: rebuilt %zu paths in %.2fs (%.0f paths/s)\n", r.count, secs, secs > 0 ? r.count / secs : 0);
     return 0;
 }
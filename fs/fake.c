@@ -1,4 +1,6 @@
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <string.h>
 #include <fcntl.h>
@@ -26,20 +28,20 @@ static struct fd *fakefs_open(struct mount *mount, const char *path, int flags,
     struct fd *fd = realfs.open(mount, path, flags, 0666);
     if (IS_ERR(fd))
         return fd;
-    db_begin_write(fs);
-    fd->fake_inode = path_get_inode(fs, path);
     if (flags & O_CREAT_) {
+        db_begin_write(fs);
+        fd->fake_inode = path_get_inode(fs, path);
         struct ish_stat ishstat;
         ishstat.mode = mode | S_IFREG;
         ishstat.uid = current->euid;
         ishstat.gid = current->egid;
         ishstat.rdev = 0;
-        if (fd->fake_inode == 0) {
-            path_create(fs, path, &ishstat);
-            fd->fake_inode = path_get_inode(fs, path);
-        }
+        if (fd->fake_inode == 0)
+            fd->fake_inode = path_create(fs, path, &ishstat);
+        db_commit(fs);
+    } else {
+        fd->fake_inode = path_get_inode_cached(fs, path);
     }
-    db_commit(fs);
     if (fd->fake_inode == 0) {
         // metadata for this file is missing
         // TODO unlink the real file
@@ -186,15 +188,11 @@ static int fakefs_mknod(struct mount *mount, const char *path, mode_t_ mode, dev
 
 static int fakefs_stat(struct mount *mount, const char *path, struct statbuf *fake_stat) {
     struct fakefs_db *fs = &mount->fakefs;
-    db_begin_read(fs);
     struct ish_stat ishstat;
-    ino_t inode;
-    if (!path_read_stat(fs, path, &ishstat, &inode)) {
-        db_rollback(fs);
+    inode_t inode;
+    if (!path_read_stat_cached(fs, path, &ishstat, &inode))
         return _ENOENT;
-    }
     int err = realfs.stat(mount, path, fake_stat);
-    db_commit(fs);
     if (err < 0)
         return err;
     fake_stat->inode = inode;
@@ -210,13 +208,9 @@ static int fakefs_fstat(struct fd *fd, struct statbuf *fake_stat) {
     int err = realfs.fstat(fd, fake_stat);
     if (err < 0)
         return err;
-    db_begin_read(fs);
     struct ish_stat ishstat;
-    if (!inode_read_stat_if_exist(fs, fd->fake_inode, &ishstat)) {
-        db_rollback(fs);
+    if (!inode_read_stat_cached(fs, fd->fake_inode, &ishstat))
         return _ENOENT;
-    }
-    db_commit(fs);
     fake_stat->inode = fd->fake_inode;
     fake_stat->mode = ishstat.mode;
     fake_stat->uid = ishstat.uid;
@@ -303,21 +297,15 @@ static ssize_t file_readlink(struct mount *mount, const char *path, char *buf, s
 
 static ssize_t fakefs_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
     struct fakefs_db *fs = &mount->fakefs;
-    db_begin_read(fs);
     struct ish_stat ishstat;
-    if (!path_read_stat(fs, path, &ishstat, NULL)) {
-        db_rollback(fs);
+    if (!path_read_stat_cached(fs, path, &ishstat, NULL))
         return _ENOENT;
-    }
-    if (!S_ISLNK(ishstat.mode)) {
-        db_rollback(fs);
+    if (!S_ISLNK(ishstat.mode))
         return _EINVAL;
-    }
 
     ssize_t err = realfs.readlink(mount, path, buf, bufsize);
     if (err == _EINVAL)
         err = file_readlink(mount, path, buf, bufsize);
-    db_commit(fs);
     return err;
 }
 
@@ -332,6 +320,11 @@ retry:
     // this is annoying
     char entry_path[MAX_PATH + 1];
     realfs_getpath(fd, entry_path);
+    // get the whole directory at once, instead of a transaction per entry
+    if (!fd->fakefs.dir_read) {
+        dir_read_cached(&fd->mount->fakefs, entry_path);
+        fd->fakefs.dir_read = true;
+    }
     if (strcmp(entry->name, "..") == 0) {
         if (strcmp(entry_path, "") != 0) {
             *strrchr(entry_path, '/') = '\0';
@@ -342,10 +335,7 @@ retry:
         strcat(entry_path, entry->name);
     }
 
-    struct fakefs_db *fs = &fd->mount->fakefs;
-    db_begin_read(fs);
-    entry->inode = path_get_inode(fs, entry_path);
-    db_commit(fs);
+    entry->inode = path_get_inode_cached(&fd->mount->fakefs, entry_path);
     // it's quite possible that due to some mishap there's no metadata for this file
     // so just skip this entry, instead of crashing the program, so there's hope for recovery
     if (entry->inode == 0)
@@ -353,10 +343,100 @@ retry:
     return res;
 }
 
+static int fakefs_fsync(struct fd *fd) {
+    db_flush(&fd->mount->fakefs);
+    return realfs_fsync(fd);
+}
+
 static struct fd_ops fakefs_fdops;
 static void __attribute__((constructor)) init_fake_fdops() {
     fakefs_fdops = realfs_fdops;
     fakefs_fdops.readdir = fakefs_readdir;
+    fakefs_fdops.fsync = fakefs_fsync;
+}
+
+// Commits a group commit batch once its window is up. This gets its own
+// thread instead of a timer because committing waits for the disk, and all
+// the timers share one thread that the guest's timers need to run on time.
+struct fakefs_flusher {
+    pthread_t thread;
+    lock_t lock;
+    cond_t cond;
+    struct fakefs_db *fs;
+    struct timespec window;
+    bool opened; // a batch was opened and hasn't been flushed yet
+    bool quit;
+};
+
+static void *fakefs_flusher_thread(void *data) {
+    struct fakefs_flusher *flusher = data;
+    lock(&flusher->lock);
+    while (!flusher->quit) {
+        if (!flusher->opened) {
+            wait_for_ignore_signals(&flusher->cond, &flusher->lock, NULL);
+            continue;
+        }
+        // only quitting wakes this up early
+        while (!flusher->quit && wait_for_ignore_signals(&flusher->cond, &flusher->lock, &flusher->window) != _ETIMEDOUT)
+            ;
+        flusher->opened = false;
+        unlock(&flusher->lock);
+        db_flush(flusher->fs);
+        lock(&flusher->lock);
+    }
+    unlock(&flusher->lock);
+    return NULL;
+}
+
+// called with fs->lock
+static void fakefs_batch_opened(struct fakefs_db *UNUSED(fs), void *data) {
+    struct fakefs_flusher *flusher = data;
+    lock(&flusher->lock);
+    if (!flusher->opened) {
+        flusher->opened = true;
+        notify(&flusher->cond);
+    }
+    unlock(&flusher->lock);
+}
+
+static struct fakefs_flusher *fakefs_flusher_start(struct fakefs_db *fs, uint64_t window_ns) {
+    struct fakefs_flusher *flusher = malloc(sizeof(struct fakefs_flusher));
+    if (flusher == NULL)
+        return NULL;
+    lock_init(&flusher->lock);
+    cond_init(&flusher->cond);
+    flusher->fs = fs;
+    flusher->window = (struct timespec) {.tv_sec = window_ns / 1000000000, .tv_nsec = window_ns % 1000000000};
+    flusher->opened = false;
+    flusher->quit = false;
+    if (pthread_create(&flusher->thread, NULL, fakefs_flusher_thread, flusher) != 0) {
+        cond_destroy(&flusher->cond);
+        free(flusher);
+        return NULL;
+    }
+    return flusher;
+}
+
+static void fakefs_flusher_stop(struct fakefs_flusher *flusher) {
+    lock(&flusher->lock);
+    flusher->quit = true;
+    notify(&flusher->cond);
+    unlock(&flusher->lock);
+    pthread_join(flusher->thread, NULL);
+    cond_destroy(&flusher->cond);
+    free(flusher);
+}
+
+// commit=<ms> turns on group commit, see fake-db.c
+static long fakefs_commit_option(const char *info) {
+    char options[strlen(info) + 1];
+    strcpy(options, info);
+    char *saveptr;
+    for (char *option = strtok_r(options, ",", &saveptr); option != NULL; option = strtok_r(NULL, ",", &saveptr)) {
+        if (strncmp(option, "commit=", 7) == 0)
+            return atol(option + 7);
+    }
+    return 0;
 }
 
 static int fakefs_mount(struct mount *mount) {
@@ -375,10 +455,28 @@ static int fakefs_mount(struct mount *mount) {
     if (err < 0)
         return err;
 
+    long commit_ms = fakefs_commit_option(mount->info);
+    if (commit_ms > 0) {
+        uint64_t window_ns = (uint64_t) commit_ms * 1000000;
+        struct fakefs_flusher *flusher = fakefs_flusher_start(&mount->fakefs, window_ns);
+        // without a flusher, writes are just committed right away
+        if (flusher != NULL)
+            db_batch_enable(&mount->fakefs, window_ns, fakefs_batch_opened, flusher);
+    }
+    return 0;
+}
+
+static int fakefs_sync(struct mount *mount) {
+    db_flush(&mount->fakefs);
     return 0;
 }
 
 static int fakefs_umount(struct mount *mount) {
+    struct fakefs_flusher *flusher = mount->fakefs.batch.data;
+    if (flusher != NULL) {
+        db_batch_enable(&mount->fakefs, 0, NULL, NULL);
+        fakefs_flusher_stop(flusher);
+    }
     int err = fake_db_deinit(&mount->fakefs);
     if (err != SQLITE_OK) {
         printk("sqlite failed to close: %d\n", err);
@@ -390,8 +488,7 @@ static int fakefs_umount(struct mount *mount) {
 static void fakefs_inode_orphaned(struct mount *mount, ino_t inode) {
     struct fakefs_db *fs = &mount->fakefs;
     db_begin_write(fs);
-    sqlite3_bind_int64(fs->stmt.try_cleanup_inode, 1, inode);
-    db_exec_reset(fs, fs->stmt.try_cleanup_inode);
+    inode_try_cleanup(fs, inode);
     db_commit(fs);
 }
 
@@ -399,6 +496,7 @@ const struct fs_ops fakefs = {
     .name = "fake", .magic = 0x66616b65,
     .mount = fakefs_mount,
     .umount = fakefs_umount,
+    .sync = fakefs_sync,
     .statfs = realfs_statfs,
     .open = fakefs_open,
     .readlink = fakefs_readlink,
@@ -43,8 +43,11 @@ int fd_close(struct fd *fd) {
                 err = new_err;
         }
 
-        if (fd->inode)
+        if (fd->inode) {
+            // OFD locks belong to the fd, so they last until it's closed
+            file_lock_remove_owned_by(fd, fd);
             inode_release(fd->inode);
+        }
         if (fd->mount)
             mount_release(fd->mount);
         free(fd);
@@ -62,6 +65,7 @@ struct fdtable *fdtable_new(int size) {
     fdt->size = 0;
     fdt->files = NULL;
     fdt->cloexec = NULL;
+    fdt->files_refcount = NULL;
     lock_init(&fdt->lock);
     int err = fdtable_resize(fdt, size);
     if (err < 0) {
@@ -73,14 +77,70 @@ struct fdtable *fdtable_new(int size) {
 
 static int fdtable_close(struct fdtable *table, fd_t f);
 
+// Drops a table's use of a files array that might be shared, closing
+// everything in it if that was the last one.
+static void fdtable_files_release(struct fd **files, bits_t *cloexec, unsigned size, atomic_uint *files_refcount) {
+    if (files_refcount != NULL && --*files_refcount != 0)
+        return;
+    for (unsigned f = 0; f < size; f++)
+        if (files[f] != NULL)
+            fd_close(files[f]);
+    free(files);
+    free(cloexec);
+    free(files_refcount);
+}
+
+// Gives the table its own files and cloexec arrays if they're shared with
+// another table. Must be called with the table locked before changing either.
+static int fdtable_unshare(struct fdtable *table) {
+    if (table->files_refcount == NULL)
+        return 0;
+    if (*table->files_refcount == 1) {
+        // only this table can make it go back up, so it's all ours now
+        free(table->files_refcount);
+        table->files_refcount = NULL;
+        return 0;
+    }
+
+    struct fd **files = malloc(sizeof(struct fd *) * table->size);
+    bits_t *cloexec = malloc(BITS_SIZE(table->size));
+    if (files == NULL || cloexec == NULL) {
+        free(files);
+        free(cloexec);
+        return _ENOMEM;
+    }
+    memcpy(files, table->files, sizeof(struct fd *) * table->size);
+    memcpy(cloexec, table->cloexec, BITS_SIZE(table->size));
+    for (unsigned f = 0; f < table->size; f++)
+        if (files[f] != NULL)
+            fd_retain(files[f]);
+
+    fdtable_files_release(table->files, table->cloexec, table->size, table->files_refcount);
+    table->files = files;
+    table->cloexec = cloexec;
+    table->files_refcount = NULL;
+    return 0;
+}
+
 // FIXME this looks like it has the classic refcount UAF
 void fdtable_release(struct fdtable *table) {
     lock(&table->lock);
     if (--table->refcount == 0) {
-        for (fd_t f = 0; (unsigned) f < table->size; f++)
-            fdtable_close(table, f);
-        free(table->files);
-        free(table->cloexec);
+        if (table->files_refcount != NULL) {
+            // the fds might still be open in another table, but the locks
+            // this table owns have to go now
+            for (fd_t f = 0; (unsigned) f < table->size; f++) {
+                struct fd *fd = table->files[f];
+                if (fd != NULL && fd->inode != NULL)
+                    file_lock_remove_owned_by(fd, table);
+            }
+            fdtable_files_release(table->files, table->cloexec, table->size, table->files_refcount);
+        } else {
+            for (fd_t f = 0; (unsigned) f < table->size; f++)
+                fdtable_close(table, f);
+            free(table->files);
+            free(table->cloexec);
+        }
         unlock(&table->lock);
         free(table);
     } else {
@@ -91,6 +151,7 @@ void fdtable_release(struct fdtable *table) {
 static int fdtable_resize(struct fdtable *table, unsigned size) {
     // currently the only legitimate use of this is to expand the table
     assert(size > table->size);
+    assert(table->files_refcount == NULL);
 
     struct fd **files = malloc(sizeof(struct fd *) * size);
     if (files == NULL)
@@ -116,19 +177,29 @@ static int fdtable_resize(struct fdtable *table, unsigned size) {
     return 0;
 }
 
+// The copy shares the files array with the original, so forking doesn't have
+// to touch every fd. Whichever table changes something first gets its own.
 struct fdtable *fdtable_copy(struct fdtable *table) {
+    struct fdtable *new_table = malloc(sizeof(struct fdtable));
+    if (new_table == NULL)
+        return ERR_PTR(_ENOMEM);
     lock(&table->lock);
-    int size = table->size;
-    struct fdtable *new_table = fdtable_new(size);
-    if (IS_ERR(new_table)) {
-        unlock(&table->lock);
-        return new_table;
+    if (table->files_refcount == NULL) {
+        table->files_refcount = malloc(sizeof(atomic_uint));
+        if (table->files_refcount == NULL) {
+            unlock(&table->lock);
+            free(new_table);
+            return ERR_PTR(_ENOMEM);
+        }
+        *table->files_refcount = 1;
     }
-    memcpy(new_table->files, table->files, sizeof(struct fd *) * size);
-    for (fd_t f = 0; f < size; f++)
-        if (new_table->files[f])
-            new_table->files[f]->refcount++;
-    memcpy(new_table->cloexec, table->cloexec, BITS_SIZE(size));
+    ++*table->files_refcount;
+    new_table->refcount = 1;
+    new_table->size = table->size;
+    new_table->files = table->files;
+    new_table->cloexec = table->cloexec;
+    new_table->files_refcount = table->files_refcount;
+    lock_init(&new_table->lock);
     unlock(&table->lock);
     return new_table;
 }
@@ -143,7 +214,7 @@ static int fdtable_expand(struct fdtable *table, fd_t max) {
 }
 
 struct fd *fdtable_get(struct fdtable *table, fd_t f) {
-    if (f < 0 || (unsigned) f >= current->files->size)
+    if (f < 0 || (unsigned) f >= table->size)
         return NULL;
     return table->files[f];
 }
@@ -158,6 +229,11 @@ struct fd *f_get(fd_t f) {
 static fd_t f_install_start(struct fd *fd, fd_t start) {
     assert(start >= 0);
     struct fdtable *table = current->files;
+    int err = fdtable_unshare(table);
+    if (err < 0) {
+        fd_close(fd);
+        return err;
+    }
     unsigned size = rlimit(RLIMIT_NOFILE_);
     if (size > table->size)
         size = table->size;
@@ -167,7 +243,7 @@ static fd_t f_install_start(struct fd *fd, fd_t start) {
         if (table->files[f] == NULL)
             break;
     if ((unsigned) f >= size) {
-        int err = fdtable_expand(table, f);
+        err = fdtable_expand(table, f);
         if (err < 0)
             f = err;
     }
@@ -181,9 +257,9 @@ static fd_t f_install_start(struct fd *fd, fd_t start) {
     return f;
 }
 
-fd_t f_install(struct fd *fd, int flags) {
+static fd_t f_install_from(struct fd *fd, fd_t start, int flags) {
     lock(&current->files->lock);
-    fd_t f = f_install_start(fd, 0);
+    fd_t f = f_install_start(fd, start);
     if (f >= 0) {
         if (flags & O_CLOEXEC_)
             bit_set(f, current->files->cloexec);
@@ -194,6 +270,10 @@ fd_t f_install(struct fd *fd, int flags) {
     return f;
 }
 
+fd_t f_install(struct fd *fd, int flags) {
+    return f_install_from(fd, 0, flags);
+}
+
 static int fdtable_close(struct fdtable *table, fd_t f) {
     struct fd *fd = fdtable_get(table, f);
     if (fd == NULL)
@@ -207,9 +287,32 @@ static int fdtable_close(struct fdtable *table, fd_t f) {
 }
 
 int f_close(fd_t f) {
-    lock(&current->files->lock);
-    int err = fdtable_close(current->files, f);
-    unlock(&current->files->lock);
+    struct fdtable *table = current->files;
+    lock(&table->lock);
+    int err = _EBADF;
+    if (fdtable_get(table, f) != NULL && (err = fdtable_unshare(table)) >= 0)
+        err = fdtable_close(table, f);
+    unlock(&table->lock);
+    return err;
+}
+
+int f_set_cloexec(fd_t f, bool cloexec) {
+    struct fdtable *table = current->files;
+    lock(&table->lock);
+    int err = _EBADF;
+    if (fdtable_get(table, f) == NULL)
+        goto out;
+    err = 0;
+    if (bit_test(f, table->cloexec) == cloexec)
+        goto out;
+    if ((err = fdtable_unshare(table)) < 0)
+        goto out;
+    if (cloexec)
+        bit_set(f, table->cloexec);
+    else
+        bit_clear(f, table->cloexec);
+out:
+    unlock(&table->lock);
     return err;
 }
 
@@ -220,9 +323,47 @@ dword_t sys_close(fd_t f) {
 
 void fdtable_do_cloexec(struct fdtable *table) {
     lock(&table->lock);
+    bool any = false;
+    for (fd_t f = 0; (unsigned) f < table->size && !any; f++)
+        any = table->files[f] != NULL && bit_test(f, table->cloexec);
+    if (!any)
+        goto out;
+
+    if (table->files_refcount != NULL && *table->files_refcount > 1) {
+        // make a copy with only the fds that stay open, rather than copying
+        // everything and then closing most of it
+        struct fd **files = malloc(sizeof(struct fd *) * table->size);
+        bits_t *cloexec = malloc(BITS_SIZE(table->size));
+        if (files == NULL || cloexec == NULL) {
+            // FIXME too late to fail the exec, so the fds stay open
+            free(files);
+            free(cloexec);
+            goto out;
+        }
+        memset(cloexec, 0, BITS_SIZE(table->size));
+        for (fd_t f = 0; (unsigned) f < table->size; f++) {
+            struct fd *fd = table->files[f];
+            files[f] = NULL;
+            if (fd == NULL)
+                continue;
+            if (!bit_test(f, table->cloexec)) {
+                files[f] = fd_retain(fd);
+            } else if (fd->inode != NULL) {
+                file_lock_remove_owned_by(fd, table);
+            }
+        }
+        fdtable_files_release(table->files, table->cloexec, table->size, table->files_refcount);
+        table->files = files;
+        table->cloexec = cloexec;
+        table->files_refcount = NULL;
+        goto out;
+    }
+
+    fdtable_unshare(table);
     for (fd_t f = 0; (unsigned) f < table->size; f++)
         if (bit_test(f, table->cloexec))
             fdtable_close(table, f);
+out:
     unlock(&table->lock);
 }
 
@@ -239,7 +380,13 @@ void fdtable_do_cloexec(struct fdtable *table) {
 #define F_SETLK64_ 13
 #define F_SETLKW64_ 14
 
+#define F_OFD_GETLK_ 36
+#define F_OFD_SETLK_ 37
+#define F_OFD_SETLKW_ 38
+
 #define F_DUPFD_CLOEXEC_ 1030
+#define F_ADD_SEALS_ 1033
+#define F_GET_SEALS_ 1034
 
 dword_t sys_dup(fd_t f) {
     STRACE("dup(%d)", f);
@@ -253,18 +400,24 @@ dword_t sys_dup(fd_t f) {
 dword_t sys_dup3(fd_t f, fd_t new_f, int_t flags) {
     STRACE("dup3(%d, %d, %d)", f, new_f, flags);
     struct fdtable *table = current->files;
-    struct fd *fd = f_get(f);
+    lock(&table->lock);
+    struct fd *fd = fdtable_get(table, f);
+    int err = _EBADF;
     if (fd == NULL)
-        return _EBADF;
-    int err = fdtable_expand(table, new_f);
-    if (err < 0)
-        return err;
+        goto out;
+    if ((err = fdtable_unshare(table)) < 0)
+        goto out;
+    if ((err = fdtable_expand(table, new_f)) < 0)
+        goto out;
     fd_retain(fd);
-    f_close(new_f);
+    fdtable_close(table, new_f);
     table->files[new_f] = fd;
     if (flags & O_CLOEXEC_)
         bit_set(new_f, table->cloexec);
-    return new_f;
+    err = new_f;
+out:
+    unlock(&table->lock);
+    return err;
 }
 
 dword_t sys_dup2(fd_t f, fd_t new_f) {
@@ -285,6 +438,22 @@ int fd_setflags(struct fd *fd, int flags) {
     return 0;
 }
 
+static void flock_from_32(struct flock_ *flock, struct flock32_ *flock32) {
+    flock->type = flock32->type;
+    flock->whence = flock32->whence;
+    flock->start = flock32->start;
+    flock->len = flock32->len;
+    flock->pid = flock32->pid;
+}
+
+static void flock_to_32(struct flock32_ *flock32, struct flock_ *flock) {
+    flock32->type = flock->type;
+    flock32->whence = flock->whence;
+    flock32->start = flock->start;
+    flock32->len = flock->len;
+    flock32->pid = flock->pid;
+}
+
 dword_t sys_fcntl(fd_t f, dword_t cmd, dword_t arg) {
     struct fdtable *table = current->files;
     struct fd *fd = f_get(f);
@@ -292,31 +461,24 @@ dword_t sys_fcntl(fd_t f, dword_t cmd, dword_t arg) {
         return _EBADF;
     struct flock32_ flock32;
     struct flock_ flock;
-    fd_t new_f;
     int err;
     switch (cmd) {
         case F_DUPFD_:
             STRACE("fcntl(%d, F_DUPFD, %d)", f, arg);
             fd->refcount++;
-            return f_install_start(fd, arg);
+            return f_install_from(fd, arg, 0);
 
         case F_DUPFD_CLOEXEC_:
             STRACE("fcntl(%d, F_DUPFD_CLOEXEC, %d)", f, arg);
             fd->refcount++;
-            new_f = f_install_start(fd, arg);
-            bit_set(new_f, table->cloexec);
-            return new_f;
+            return f_install_from(fd, arg, O_CLOEXEC_);
 
         case F_GETFD_:
             STRACE("fcntl(%d, F_GETFD)", f);
             return bit_test(f, table->cloexec);
         case F_SETFD_:
             STRACE("fcntl(%d, F_SETFD, 0x%x)", f, arg);
-            if (arg & 1)
-                bit_set(f, table->cloexec);
-            else
-                bit_clear(f, table->cloexec);
-            return 0;
+            return f_set_cloexec(f, arg & 1);
 
         case F_GETFL_:
             STRACE("fcntl(%d, F_GETFL)", f);
@@ -329,18 +491,10 @@ dword_t sys_fcntl(fd_t f, dword_t cmd, dword_t arg) {
             STRACE("fcntl(%d, F_GETLK, %#x)", f, arg);
             if (user_read(arg, &flock32, sizeof(flock32)))
                 return _EFAULT;
-            flock.type = flock32.type;
-            flock.whence = flock32.whence;
-            flock.start = flock32.start;
-            flock.len = flock32.len;
-            flock.pid = flock32.pid;
-            err = fcntl_getlk(fd, &flock);
+            flock_from_32(&flock, &flock32);
+            err = fcntl_getlk(fd, &flock, false);
             if (err >= 0) {
-                flock32.type = flock.type;
-                flock32.whence = flock.whence;
-                flock32.start = flock.start;
-                flock32.len = flock.len;
-                flock32.pid = flock.pid;
+                flock_to_32(&flock32, &flock);
                 if (user_write(arg, &flock32, sizeof(flock32)))
                     return _EFAULT;
             }
@@ -350,7 +504,7 @@ dword_t sys_fcntl(fd_t f, dword_t cmd, dword_t arg) {
             STRACE("fcntl(%d, F_GETLK64, %#x)", f, arg);
             if (user_read(arg, &flock, sizeof(flock)))
                 return _EFAULT;
-            err = fcntl_getlk(fd, &flock);
+            err = fcntl_getlk(fd, &flock, false);
             if (err >= 0)
                 if (user_write(arg, &flock, sizeof(flock)))
                     return _EFAULT;
@@ -361,19 +515,41 @@ dword_t sys_fcntl(fd_t f, dword_t cmd, dword_t arg) {
             STRACE("fcntl(%d, F_SETLK%*s, %#x)", f, cmd == F_SETLKW_, "W", arg);
             if (user_read(arg, &flock32, sizeof(flock32)))
                 return _EFAULT;
-            flock.type = flock32.type;
-            flock.whence = flock32.whence;
-            flock.start = flock32.start;
-            flock.len = flock32.len;
-            flock.pid = flock32.pid;
-            return fcntl_setlk(fd, &flock, cmd == F_SETLKW64_);
+            flock_from_32(&flock, &flock32);
+            return fcntl_setlk(fd, &flock, cmd == F_SETLKW_, false);
 
         case F_SETLK64_:
         case F_SETLKW64_:
-            STRACE("fcntl(%d, F_SETLK%*s64, %#x)", f, cmd == F_SETLKW_, "W", arg);
+            STRACE("fcntl(%d, F_SETLK%*s64, %#x)", f, cmd == F_SETLKW64_, "W", arg);
+            if (user_read(arg, &flock, sizeof(flock)))
+                return _EFAULT;
+            return fcntl_setlk(fd, &flock, cmd == F_SETLKW64_, false);
+
+        // these take a struct flock64 here, sys_fcntl32 handles the struct
+        // flock that comes from fcntl
+        case F_OFD_GETLK_:
+            STRACE("fcntl(%d, F_OFD_GETLK, %#x)", f, arg);
+            if (user_read(arg, &flock, sizeof(flock)))
+                return _EFAULT;
+            err = fcntl_getlk(fd, &flock, true);
+            if (err >= 0)
+                if (user_write(arg, &flock, sizeof(flock)))
+                    return _EFAULT;
+            return err;
+
+        case F_OFD_SETLK_:
+        case F_OFD_SETLKW_:
+            STRACE("fcntl(%d, F_OFD_SETLK%*s, %#x)", f, cmd == F_OFD_SETLKW_, "W", arg);
             if (user_read(arg, &flock, sizeof(flock)))
                 return _EFAULT;
-            return fcntl_setlk(fd, &flock, cmd == F_SETLKW_);
+            return fcntl_setlk(fd, &flock, cmd == F_OFD_SETLKW_, true);
+
+        case F_ADD_SEALS_:
+            STRACE("fcntl(%d, F_ADD_SEALS, %#x)", f, arg);
+            return memfd_add_seals(fd, arg);
+        case F_GET_SEALS_:
+            STRACE("fcntl(%d, F_GET_SEALS)", f);
+            return memfd_get_seals(fd);
 
         default:
             STRACE("fcntl(%d, %d)", f, cmd);
@@ -381,12 +557,43 @@ dword_t sys_fcntl(fd_t f, dword_t cmd, dword_t arg) {
     }
 }
 
-dword_t sys_fcntl32(fd_t fd, dword_t cmd, dword_t arg) {
+dword_t sys_fcntl32(fd_t f, dword_t cmd, dword_t arg) {
+    struct flock32_ flock32;
+    struct flock_ flock;
+    struct fd *fd;
+    int err;
     switch (cmd) {
         case F_GETLK64_:
         case F_SETLK64_:
         case F_SETLKW64_:
             return _EINVAL;
+
+        case F_OFD_GETLK_:
+            STRACE("fcntl(%d, F_OFD_GETLK, %#x)", f, arg);
+            fd = f_get(f);
+            if (fd == NULL)
+                return _EBADF;
+            if (user_read(arg, &flock32, sizeof(flock32)))
+                return _EFAULT;
+            flock_from_32(&flock, &flock32);
+            err = fcntl_getlk(fd, &flock, true);
+            if (err >= 0) {
+                flock_to_32(&flock32, &flock);
+                if (user_write(arg, &flock32, sizeof(flock32)))
+                    return _EFAULT;
+            }
+            return err;
+
+        case F_OFD_SETLK_:
+        case F_OFD_SETLKW_:
+            STRACE("fcntl(%d, F_OFD_SETLK%*s, %#x)", f, cmd == F_OFD_SETLKW_, "W", arg);
+            fd = f_get(f);
+            if (fd == NULL)
+                return _EBADF;
+            if (user_read(arg, &flock32, sizeof(flock32)))
+                return _EFAULT;
+            flock_from_32(&flock, &flock32);
+            return fcntl_setlk(fd, &flock, cmd == F_OFD_SETLKW_, true);
     }
-    return sys_fcntl(fd, cmd, arg);
+    return sys_fcntl(f, cmd, arg);
 }
@@ -39,6 +39,10 @@ struct fd {
             struct timer *timer;
             uint64_t expirations;
         } timerfd;
+        struct {
+            char *name;
+            unsigned seals; // locked by fd->lock
+        } memfd;
         struct {
             int domain;
             int type;
@@ -91,6 +95,9 @@ struct fd {
             struct tmp_dirent *dirent;
             struct tmp_dirent *dir_pos;
         } tmpfs;
+        struct {
+            bool dir_read; // the directory's metadata has been loaded
+        } fakefs;
         void *fs_data;
     };
 
@@ -173,6 +180,9 @@ struct fdtable {
     unsigned size;
     struct fd **files;
     bits_t *cloexec;
+    // non-NULL if files and cloexec might be shared with tables copied from
+    // this one, counts the tables using them
+    atomic_uint *files_refcount;
     lock_t lock;
 };
 
@@ -188,5 +198,6 @@ struct fd *f_get(fd_t f);
 // flags is checked for O_CLOEXEC and O_NONBLOCK
 fd_t f_install(struct fd *fd, int flags);
 int f_close(fd_t f);
+int f_set_cloexec(fd_t f, bool cloexec);
 
 #endif
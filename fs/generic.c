@@ -51,15 +51,15 @@ struct fd *generic_openat(struct fd *at, const char *path_raw, int flags, int mo
     }
     fd->mount = mount;
 
-    lock(&inodes_lock); // TODO: don't do this
+    read_wrlock(&inodes_lock); // TODO: don't do this
     struct statbuf stat;
     err = fd->mount->fs->fstat(fd, &stat);
     if (err < 0) {
-        unlock(&inodes_lock);
+        read_wrunlock(&inodes_lock);
         goto error;
     }
-    fd->inode = inode_get_unlocked(mount, stat.inode);
-    unlock(&inodes_lock);
+    fd->inode = inode_get(mount, stat.inode);
+    read_wrunlock(&inodes_lock);
     fd->type = stat.mode & S_IFMT;
     fd->flags = flags;
 
@@ -161,6 +161,7 @@ int generic_unlinkat(struct fd *at, const char *path_raw) {
     err = _EPERM;
     if (mount->fs->unlink)
         err = mount->fs->unlink(mount, path);
+    dentry_invalidate(mount, path, false);
     mount_release(mount);
     return err;
 }
@@ -184,6 +185,8 @@ int generic_renameat(struct fd *src_at, const char *src_raw, struct fd *dst_at,
         err = _EPERM;
     else
         err = mount->fs->rename(mount, src, dst);
+    dentry_invalidate(mount, src, true);
+    dentry_invalidate(dst_mount, dst, true);
     mount_release(mount);
     mount_release(dst_mount);
     return err;
@@ -198,6 +201,7 @@ int generic_symlinkat(const char *target, struct fd *at, const char *link_raw) {
     err = _EPERM;
     if (mount->fs->symlink)
         err = mount->fs->symlink(mount, target, link);
+    dentry_invalidate(mount, link, false);
     mount_release(mount);
     return err;
 }
@@ -229,6 +233,7 @@ int generic_setattrat(struct fd *at, const char *path_raw, struct attr attr, boo
     err = _EPERM;
     if (mount->fs->setattr)
         err = mount->fs->setattr(mount, path, attr);
+    dentry_invalidate(mount, path, false);
     mount_release(mount);
     return err;
 }
@@ -283,6 +288,7 @@ int generic_rmdirat(struct fd *at, const char *path_raw) {
     err = _EPERM;
     if (mount->fs->rmdir)
         err = mount->fs->rmdir(mount, path);
+    dentry_invalidate(mount, path, true);
     mount_release(mount);
     return err;
 }
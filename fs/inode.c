@@ -4,26 +4,109 @@
 #include "fs/inode.h"
 #include "debug.h"
 
-lock_t inodes_lock = LOCK_INITIALIZER;
-#define INODES_HASH_SIZE (1 << 10)
-static struct list inodes_hash[INODES_HASH_SIZE];
+wrlock_t inodes_lock;
+
+// The inode table is a hash table keyed by (mount, inode number). Each bucket
+// has its own lock, so looking up or releasing inodes in different buckets
+// doesn't contend. When the table gets too full it's doubled, which takes
+// table_lock for writing to keep everything else out; everything else takes
+// it for reading.
+//
+// Lock order: inodes_lock, table_lock, bucket lock, inode->lock, mount->lock
+
+struct inode_bucket {
+    lock_t lock;
+    struct list chain;
+};
+
+static wrlock_t table_lock;
+static struct inode_bucket *table;
+static unsigned table_size;
+static atomic_uint inode_count;
+
+#define INODES_MIN_SIZE (1 << 10)
+// average chain length at which the table is grown
+#define INODES_LOAD 2
 
 int current_pid(void);
 
-static struct inode_data *inode_get_data(struct mount *mount, ino_t ino) {
-    int index = ino % INODES_HASH_SIZE;
-    if (list_null(&inodes_hash[index]))
-        list_init(&inodes_hash[index]);
+static struct inode_bucket *buckets_new(unsigned size) {
+    struct inode_bucket *buckets = malloc(size * sizeof(struct inode_bucket));
+    if (buckets == NULL)
+        return NULL;
+    for (unsigned i = 0; i < size; i++) {
+        lock_init(&buckets[i].lock);
+        list_init(&buckets[i].chain);
+    }
+    return buckets;
+}
+
+static void __attribute__((constructor)) inodes_init() {
+    wrlock_init(&inodes_lock);
+    wrlock_init(&table_lock);
+    table_size = INODES_MIN_SIZE;
+    table = buckets_new(table_size);
+    if (table == NULL)
+        die("could not allocate inode table");
+}
+
+static uint64_t inode_hash(struct mount *mount, ino_t ino) {
+    uint64_t hash = (uint64_t) ino ^ ((uint64_t) (uintptr_t) mount * 0x9e3779b97f4a7c15ull);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Must call with table_lock read-locked
+static struct inode_bucket *inode_bucket(struct mount *mount, ino_t ino) {
+    return &table[inode_hash(mount, ino) & (table_size - 1)];
+}
+
+// Must call with the bucket locked
+static struct inode_data *inode_get_data(struct inode_bucket *bucket, struct mount *mount, ino_t ino) {
     struct inode_data *inode;
-    list_for_each_entry(&inodes_hash[index], inode, chain) {
+    list_for_each_entry(&bucket->chain, inode, chain) {
         if (inode->mount == mount && inode->number == ino)
             return inode;
     }
     return NULL;
 }
 
-struct inode_data *inode_get_unlocked(struct mount *mount, ino_t ino) {
-    struct inode_data *inode = inode_get_data(mount, ino);
+static void table_grow() {
+    write_wrlock(&table_lock);
+    if (inode_count <= table_size * INODES_LOAD) {
+        // somebody else got here first
+        write_wrunlock(&table_lock);
+        return;
+    }
+    unsigned new_size = table_size * 2;
+    struct inode_bucket *new_table = buckets_new(new_size);
+    if (new_table == NULL) {
+        // longer chains are slower but still work
+        write_wrunlock(&table_lock);
+        return;
+    }
+    for (unsigned i = 0; i < table_size; i++) {
+        struct inode_data *inode, *tmp;
+        list_for_each_entry_safe(&table[i].chain, inode, tmp, chain) {
+            list_remove(&inode->chain);
+            uint64_t hash = inode_hash(inode->mount, inode->number);
+            list_add(&new_table[hash & (new_size - 1)].chain, &inode->chain);
+        }
+    }
+    free(table);
+    table = new_table;
+    table_size = new_size;
+    write_wrunlock(&table_lock);
+}
+
+struct inode_data *inode_get(struct mount *mount, ino_t ino) {
+    read_wrlock(&table_lock);
+    struct inode_bucket *bucket = inode_bucket(mount, ino);
+    lock(&bucket->lock);
+    struct inode_data *inode = inode_get_data(bucket, mount, ino);
+    bool grow = false;
     if (inode == NULL) {
         inode = malloc(sizeof(struct inode_data));
         inode->refcount = 0;
@@ -31,30 +114,33 @@ struct inode_data *inode_get_unlocked(struct mount *mount, ino_t ino) {
         mount_retain(mount);
         inode->mount = mount;
         inode->socket_id = 0;
-        cond_init(&inode->posix_unlock);
         list_init(&inode->posix_locks);
+        inode->posix_lock_tree = NULL;
         list_init(&inode->chain);
         lock_init(&inode->lock);
-        list_add(&inodes_hash[ino % INODES_HASH_SIZE], &inode->chain);
+        list_add(&bucket->chain, &inode->chain);
+        grow = ++inode_count > table_size * INODES_LOAD;
     }
 
     inode_retain(inode);
+    unlock(&bucket->lock);
+    read_wrunlock(&table_lock);
+    if (grow)
+        table_grow();
     return inode;
 }
 
-struct inode_data *inode_get(struct mount *mount, ino_t ino) {
-    lock(&inodes_lock);
-    struct inode_data *data = inode_get_unlocked(mount, ino);
-    unlock(&inodes_lock);
-    return data;
-}
-
 void inode_check_orphaned(struct mount *mount, ino_t ino) {
-    lock(&inodes_lock);
-    struct inode_data *inode = inode_get_data(mount, ino);
+    write_wrlock(&inodes_lock);
+    read_wrlock(&table_lock);
+    struct inode_bucket *bucket = inode_bucket(mount, ino);
+    lock(&bucket->lock);
+    struct inode_data *inode = inode_get_data(bucket, mount, ino);
     if (inode == NULL)
         mount->fs->inode_orphaned(mount, ino);
-    unlock(&inodes_lock);
+    unlock(&bucket->lock);
+    read_wrunlock(&table_lock);
+    write_wrunlock(&inodes_lock);
 }
 
 void inode_retain(struct inode_data *inode) {
@@ -64,18 +150,43 @@ void inode_retain(struct inode_data *inode) {
 }
 
 void inode_release(struct inode_data *inode) {
-    lock(&inodes_lock);
+    // if this isn't the last reference, there's no need to touch the table
+    lock(&inode->lock);
+    if (inode->refcount > 1) {
+        inode->refcount--;
+        unlock(&inode->lock);
+        return;
+    }
+    unlock(&inode->lock);
+
+    // the inode is about to go away, and if the filesystem wants to know when
+    // that happens, opens have to be kept from finding the file in between
+    // (see generic_openat)
+    struct mount *mount = inode->mount;
+    bool orphan_check = mount->fs->inode_orphaned != NULL;
+    if (orphan_check)
+        write_wrlock(&inodes_lock);
+    read_wrlock(&table_lock);
+    struct inode_bucket *bucket = inode_bucket(mount, inode->number);
+    lock(&bucket->lock);
     lock(&inode->lock);
     if (--inode->refcount == 0) {
         unlock(&inode->lock);
         list_remove(&inode->chain);
-        if (inode->mount->fs->inode_orphaned)
-            inode->mount->fs->inode_orphaned(inode->mount, inode->number);
-        unlock(&inodes_lock);
-        mount_release(inode->mount);
+        inode_count--;
+        if (orphan_check)
+            mount->fs->inode_orphaned(mount, inode->number);
+        unlock(&bucket->lock);
+        read_wrunlock(&table_lock);
+        if (orphan_check)
+            write_wrunlock(&inodes_lock);
+        mount_release(mount);
         free(inode);
     } else {
         unlock(&inode->lock);
-        unlock(&inodes_lock);
+        unlock(&bucket->lock);
+        read_wrunlock(&table_lock);
+        if (orphan_check)
+            write_wrunlock(&inodes_lock);
     }
 }
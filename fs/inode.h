@@ -14,7 +14,7 @@ struct inode_data {
     struct list chain;
 
     struct list posix_locks;
-    cond_t posix_unlock;
+    struct file_lock *posix_lock_tree; // same locks, see fs/lock.c
 
     uint32_t socket_id;
 
@@ -27,13 +27,13 @@ void inode_release(struct inode_data *inode);
 
 // generic_open must lock out anything trying to destroy an inode between
 // opening the file and acquiring a reference to its inode. For this purpose
-// only, the inodes_lock and inode_get_unlocked are made available. Think
-// carefully before using them for anything else.
+// only, the inodes_lock is made available: generic_open read-locks it, and
+// anything that calls inode_orphaned write-locks it. Think carefully before
+// using it for anything else.
 // mount->lock nests inside this.
 // To quote @dril: i despise this lock. id love nothing more than to kick it
 // through the wall and shatter it into 100 deadlocks. But i need it
-extern lock_t inodes_lock;
-struct inode_data *inode_get_unlocked(struct mount *mount, ino_t inode);
+extern wrlock_t inodes_lock;
 
 // calls mount->fs->inode_orphaned if this inode is orphaned, while holding indoes_lock
 void inode_check_orphaned(struct mount *mount, ino_t ino);
@@ -49,8 +49,17 @@ struct file_lock {
     off_t_ end;
     int type;
     pid_t_ pid;
+    // the fdtable for process-associated locks, the fd for OFD locks
     void *owner;
     struct list locks;
+
+    // interval tree node
+    struct file_lock *left, *right;
+    int height;
+    off_t_ max_end;
+
+    // requests that are waiting for this lock to go away
+    struct list waiters;
 };
 
 struct flock_ {
@@ -68,9 +77,11 @@ struct flock32_ {
     pid_t_ pid;
 } __attribute__((packed));
 
-int fcntl_getlk(struct fd *fd, struct flock_ *flock);
+// ofd is true for the F_OFD_* versions, where locks belong to the open file
+// description instead of the process
+int fcntl_getlk(struct fd *fd, struct flock_ *flock, bool ofd);
 // cmd should be either F_SETLK or F_SETLKW
-int fcntl_setlk(struct fd *fd, struct flock_ *flock, bool block);
+int fcntl_setlk(struct fd *fd, struct flock_ *flock, bool block, bool ofd);
 
 // locks the inode internally
 void file_lock_remove_owned_by(struct fd *fd, void *owner);
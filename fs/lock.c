@@ -18,78 +18,261 @@ static bool file_locks_conflict(struct file_lock *a, struct file_lock *b) {
     return false;
 }
 
-static bool file_locks_adjacent(struct file_lock *a, struct file_lock *b) {
-    return a->end == b->start - 1 || b->end == a->start - 1;
+#define OFF_T_MAX ~(1l << (sizeof(off_t) * 8 - 1))
+
+// The locks on an inode are in a list, for going through all of them, and an
+// interval tree, for finding the ones that overlap a range without looking at
+// the rest. The tree is an AVL tree ordered by start, where each node also
+// knows the largest end in its subtree.
+//
+// A request that has to wait waits on the lock it conflicts with, and is woken
+// when that lock goes away or changes, so unlocking one range doesn't wake
+// everyone waiting on the file.
+
+struct file_lock_waiter {
+    cond_t cond;
+    struct list waiters;
+};
+
+static int lock_height(struct file_lock *node) {
+    return node != NULL ? node->height : 0;
 }
 
-static struct file_lock *file_lock_test(struct inode_data *inode, struct file_lock *request) {
-    struct file_lock *lock;
-    list_for_each_entry(&inode->posix_locks, lock, locks) {
-        if (file_locks_conflict(lock, request))
-            return lock;
+static void lock_node_update(struct file_lock *node) {
+    int left = lock_height(node->left), right = lock_height(node->right);
+    node->height = (left > right ? left : right) + 1;
+    node->max_end = node->end;
+    if (node->left != NULL && node->left->max_end > node->max_end)
+        node->max_end = node->left->max_end;
+    if (node->right != NULL && node->right->max_end > node->max_end)
+        node->max_end = node->right->max_end;
+}
+
+static struct file_lock *lock_rotate_left(struct file_lock *node) {
+    struct file_lock *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    lock_node_update(node);
+    lock_node_update(right);
+    return right;
+}
+
+static struct file_lock *lock_rotate_right(struct file_lock *node) {
+    struct file_lock *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    lock_node_update(node);
+    lock_node_update(left);
+    return left;
+}
+
+static struct file_lock *lock_balance(struct file_lock *node) {
+    lock_node_update(node);
+    int balance = lock_height(node->left) - lock_height(node->right);
+    if (balance > 1) {
+        if (lock_height(node->left->left) < lock_height(node->left->right))
+            node->left = lock_rotate_left(node->left);
+        return lock_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (lock_height(node->right->right) < lock_height(node->right->left))
+            node->right = lock_rotate_right(node->right);
+        return lock_rotate_left(node);
+    }
+    return node;
+}
+
+// Locks can start at the same place, so break ties by address
+static bool lock_before(struct file_lock *a, struct file_lock *b) {
+    if (a->start != b->start)
+        return a->start < b->start;
+    return (uintptr_t) a < (uintptr_t) b;
+}
+
+static struct file_lock *lock_tree_insert(struct file_lock *node, struct file_lock *lock) {
+    if (node == NULL) {
+        lock->left = lock->right = NULL;
+        lock_node_update(lock);
+        return lock;
     }
-    return NULL;
+    if (lock_before(lock, node))
+        node->left = lock_tree_insert(node->left, lock);
+    else
+        node->right = lock_tree_insert(node->right, lock);
+    return lock_balance(node);
+}
+
+static struct file_lock *lock_tree_remove_min(struct file_lock *node, struct file_lock **min) {
+    if (node->left == NULL) {
+        *min = node;
+        return node->right;
+    }
+    node->left = lock_tree_remove_min(node->left, min);
+    return lock_balance(node);
+}
+
+static struct file_lock *lock_tree_remove(struct file_lock *node, struct file_lock *lock) {
+    assert(node != NULL);
+    if (node == lock) {
+        if (node->right == NULL)
+            return node->left;
+        struct file_lock *min;
+        struct file_lock *right = lock_tree_remove_min(node->right, &min);
+        min->left = node->left;
+        min->right = right;
+        return lock_balance(min);
+    }
+    if (lock_before(lock, node))
+        node->left = lock_tree_remove(node->left, lock);
+    else
+        node->right = lock_tree_remove(node->right, lock);
+    return lock_balance(node);
+}
+
+// Calls fn on each lock that overlaps start to end, in order of start, until
+// it returns true, and returns that lock
+static struct file_lock *lock_tree_search(struct file_lock *node, off_t_ start, off_t_ end,
+        bool (*fn)(struct file_lock *lock, void *data), void *data) {
+    if (node == NULL || node->max_end < start)
+        return NULL;
+    struct file_lock *found = lock_tree_search(node->left, start, end, fn, data);
+    if (found != NULL)
+        return found;
+    if (node->start > end)
+        return NULL;
+    if (node->end >= start && fn(node, data))
+        return node;
+    return lock_tree_search(node->right, start, end, fn, data);
+}
+
+static void file_lock_wake(struct file_lock *lock) {
+    struct file_lock_waiter *waiter, *tmp;
+    list_for_each_entry_safe(&lock->waiters, waiter, tmp, waiters) {
+        list_remove(&waiter->waiters);
+        notify(&waiter->cond);
+    }
+}
+
+static void file_lock_insert(struct inode_data *inode, struct file_lock *lock) {
+    list_add_tail(&inode->posix_locks, &lock->locks);
+    inode->posix_lock_tree = lock_tree_insert(inode->posix_lock_tree, lock);
+}
+
+static void file_lock_delete(struct inode_data *inode, struct file_lock *lock) {
+    file_lock_wake(lock);
+    inode->posix_lock_tree = lock_tree_remove(inode->posix_lock_tree, lock);
+    list_remove(&lock->locks);
+    free(lock);
+}
+
+// Changing the range of a lock moves it in the tree, and might let its waiters in
+static void file_lock_move(struct inode_data *inode, struct file_lock *lock, off_t_ start, off_t_ end) {
+    file_lock_wake(lock);
+    inode->posix_lock_tree = lock_tree_remove(inode->posix_lock_tree, lock);
+    lock->start = start;
+    lock->end = end;
+    inode->posix_lock_tree = lock_tree_insert(inode->posix_lock_tree, lock);
+}
+
+static bool file_lock_conflict_fn(struct file_lock *lock, void *request) {
+    return file_locks_conflict(lock, request);
+}
+
+static struct file_lock *file_lock_test(struct inode_data *inode, struct file_lock *request) {
+    return lock_tree_search(inode->posix_lock_tree, request->start, request->end,
+            file_lock_conflict_fn, request);
 }
 
 static struct file_lock *file_lock_copy(struct file_lock *request) {
     struct file_lock *lock = malloc(sizeof(struct file_lock));
+    if (lock == NULL)
+        return NULL;
     lock->start = request->start;
     lock->end = request->end;
     lock->type = request->type;
     lock->owner = request->owner;
     lock->pid = request->pid;
     list_init(&lock->locks);
+    list_init(&lock->waiters);
     return lock;
 }
 
-static void file_lock_delete(struct file_lock *lock) {
-    list_remove(&lock->locks);
-    free(lock);
-}
+struct owned_locks {
+    void *owner;
+    struct file_lock **locks;
+    unsigned count;
+    unsigned capacity;
+};
 
-static int file_lock_acquire(struct inode_data *inode, struct file_lock *request) {
-    struct file_lock *lock;
+static bool file_lock_collect_fn(struct file_lock *lock, void *data) {
+    struct owned_locks *owned = data;
+    if (lock->owner != owned->owner)
+        return false;
+    if (owned->count == owned->capacity) {
+        unsigned capacity = owned->capacity ? owned->capacity * 2 : 8;
+        struct file_lock **locks = realloc(owned->locks, capacity * sizeof(*locks));
+        if (locks == NULL)
+            return true; // stop, as a way of reporting the error
+        owned->locks = locks;
+        owned->capacity = capacity;
+    }
+    owned->locks[owned->count++] = lock;
+    return false;
+}
 
+// If the request conflicts with a lock, returns _EAGAIN and that lock in *conflict
+static int file_lock_acquire(struct inode_data *inode, struct file_lock *request, struct file_lock **conflict) {
     if (request->type != F_UNLCK_) {
-        list_for_each_entry(&inode->posix_locks, lock, locks) {
-            if (file_locks_conflict(lock, request))
-                return _EAGAIN;
-            // TODO check for deadlocks
-        }
+        *conflict = file_lock_test(inode, request);
+        if (*conflict != NULL)
+            return _EAGAIN;
+        // TODO check for deadlocks
     }
 
-    // If the loop above succeeded, the lock can be placed. Now we just need to
+    // If the test above succeeded, the lock can be placed. Now we just need to
     // add it into our existing set of locks. This is complicated because it
     // might need to:
     // - merge with an adjacent or overlapping lock of the same type
     // - override an existing overlapping lock of a different type
     // - split an existing lock into two, if it overlaps just the middle
     // - do any or all of the above at the same time
+    // Our own locks never overlap each other, so the only ones that matter are
+    // the ones that overlap the request or touch either end of it.
 
-    bool found_our_locks = false;
-    struct file_lock *tmp;
-    list_for_each_entry_safe(&inode->posix_locks, lock, tmp, locks) {
-        // To speed up looping over all of our locks, the locks are grouped by owner.
-        if (!found_our_locks) {
-            if (lock->owner != request->owner)
-                continue;
-            found_our_locks = true;
-        } else {
-            if (lock->owner != request->owner)
-                break;
+    struct file_lock *new_lock = NULL;
+    if (request->type != F_UNLCK_) {
+        new_lock = file_lock_copy(request);
+        if (new_lock == NULL)
+            return _ENOMEM;
+    }
+    struct owned_locks owned = {.owner = request->owner};
+    off_t_ search_start = request->start > 0 ? request->start - 1 : request->start;
+    off_t_ search_end = request->end < OFF_T_MAX ? request->end + 1 : request->end;
+    if (lock_tree_search(inode->posix_lock_tree, search_start, search_end, file_lock_collect_fn, &owned) != NULL)
+        goto nomem;
+    // a split needs a new lock, get it now so nothing can fail halfway through
+    struct file_lock *split = NULL;
+    for (unsigned i = 0; i < owned.count; i++) {
+        struct file_lock *lock = owned.locks[i];
+        if (lock->type != request->type && request->start > lock->start && request->end < lock->end) {
+            split = file_lock_copy(lock);
+            if (split == NULL)
+                goto nomem;
         }
+    }
+
+    for (unsigned i = 0; i < owned.count; i++) {
+        struct file_lock *lock = owned.locks[i];
         assert(lock->owner == request->owner);
 
         if (request->type == lock->type) {
-            if (!file_locks_overlap(lock, request) && !file_locks_adjacent(request, lock))
-                continue;
             // merge request with lock
             // extend request until it covers lock, then delete lock
             if (lock->start < request->start)
                 request->start = lock->start;
             if (lock->end > request->end)
                 request->end = lock->end;
-            file_lock_delete(lock);
+            file_lock_delete(inode, lock);
         } else {
             if (!file_locks_overlap(lock, request))
                 continue;
@@ -101,43 +284,44 @@ static int file_lock_acquire(struct inode_data *inode, struct file_lock *request
             // test cases to think about: request on the top, lock on the bottom
             // ..::'' ''::.. ..::.. ''::'' :::... ...::: '''::: :::''' ::::::
 
-            // every case here has the possibility of reducing the locking on some region
-            notify(&inode->posix_unlock);
-
             if (request->start > lock->start && request->end < lock->end) {
                 // lock sticks out on both ends, split
-                struct file_lock *lock2 = file_lock_copy(lock);
                 // see below for why these can't overflow
-                lock->end = request->start - 1;
-                lock2->start = request->end + 1;
-                list_add_after(&lock->locks, &lock2->locks);
+                split->start = request->end + 1;
+                file_lock_move(inode, lock, lock->start, request->start - 1);
+                file_lock_insert(inode, split);
             } else if (request->start <= lock->start && request->end >= lock->end) {
                 // lock doesn't stick out at all, so just remove it
-                file_lock_delete(lock);
+                file_lock_delete(inode, lock);
             } else if (lock->start < request->start) {
                 // lock sticks out on the start, so move the end down
                 assert(lock->end >= request->start);
                 // subtract can't overflow since the comparison above would fail if request->start is 0
-                lock->end = request->start - 1;
+                file_lock_move(inode, lock, lock->start, request->start - 1);
             } else if (lock->end > request->end) {
                 // lock sticks out on the end, so move the start up
                 assert(lock->start <= request->end);
                 // add can't overflow since the comparison above would fail if request->start is OFF_T_MAX
-                lock->start = request->end + 1;
+                file_lock_move(inode, lock, request->end + 1, lock->end);
             }
         }
     }
+    free(owned.locks);
 
-    if (request->type != F_UNLCK_) {
-        struct file_lock *new_lock = file_lock_copy(request);
-        list_add_before(&lock->locks, &new_lock->locks);
+    if (new_lock != NULL) {
+        new_lock->start = request->start;
+        new_lock->end = request->end;
+        file_lock_insert(inode, new_lock);
     }
     return 0;
-}
 
-#define OFF_T_MAX ~(1l << (sizeof(off_t) * 8 - 1))
+nomem:
+    free(owned.locks);
+    free(new_lock);
+    return _ENOMEM;
+}
 
-static int file_lock_from_flock(struct fd *fd, struct flock_ *flock, struct file_lock *lock) {
+static int file_lock_from_flock(struct fd *fd, struct flock_ *flock, struct file_lock *lock, bool ofd) {
     off_t_ offset;
     switch (flock->whence) {
         case LSEEK_SET:
@@ -176,8 +360,13 @@ static int file_lock_from_flock(struct fd *fd, struct flock_ *flock, struct file
         lock->end = OFF_T_MAX;
     }
     lock->type = flock->type;
-    lock->owner = current->files;
-    lock->pid = current->pid;
+    if (ofd) {
+        lock->owner = fd;
+        lock->pid = -1;
+    } else {
+        lock->owner = current->files;
+        lock->pid = current->pid;
+    }
     return 0;
 }
 
@@ -193,14 +382,16 @@ static int flock_from_file_lock(struct file_lock *lock, struct flock_ *flock) {
     return 0;
 }
 
-int fcntl_getlk(struct fd *fd, struct flock_ *flock) {
+int fcntl_getlk(struct fd *fd, struct flock_ *flock, bool ofd) {
     if (flock->type != F_RDLCK_ && flock->type != F_WRLCK_)
         return _EINVAL;
+    if (ofd && flock->pid != 0)
+        return _EINVAL;
     struct inode_data *inode = fd->inode;
     lock(&inode->lock);
 
     struct file_lock request;
-    int err = file_lock_from_flock(fd, flock, &request);
+    int err = file_lock_from_flock(fd, flock, &request, ofd);
     if (err < 0)
         goto out;
     struct file_lock *lock = file_lock_test(inode, &request);
@@ -214,7 +405,7 @@ out:
     return err;
 }
 
-int fcntl_setlk(struct fd *fd, struct flock_ *flock, bool blocking) {
+int fcntl_setlk(struct fd *fd, struct flock_ *flock, bool blocking, bool ofd) {
     if (flock->type != F_RDLCK_ && flock->type != F_WRLCK_ && flock->type != F_UNLCK_)
         return _EINVAL;
     int fd_mode = fd_getflags(fd) & O_ACCMODE_;
@@ -222,18 +413,27 @@ int fcntl_setlk(struct fd *fd, struct flock_ *flock, bool blocking) {
         return _EBADF;
     if (flock->type == F_WRLCK_ && fd_mode == O_RDONLY_)
         return _EBADF;
+    if (ofd && flock->pid != 0)
+        return _EINVAL;
 
     struct inode_data *inode = fd->inode;
     lock(&inode->lock);
 
     struct file_lock request;
-    int err = file_lock_from_flock(fd, flock, &request);
+    int err = file_lock_from_flock(fd, flock, &request, ofd);
     if (err < 0)
         goto out;
-    while ((err = file_lock_acquire(inode, &request)) == _EAGAIN) {
+    struct file_lock *conflict;
+    while ((err = file_lock_acquire(inode, &request, &conflict)) == _EAGAIN) {
         if (!blocking)
             break;
-        err = wait_for(&inode->posix_unlock, &inode->lock, NULL);
+        struct file_lock_waiter waiter;
+        cond_init(&waiter.cond);
+        list_add_tail(&conflict->waiters, &waiter.waiters);
+        err = wait_for(&waiter.cond, &inode->lock, NULL);
+        // still on the list if woken by a signal
+        list_remove_safe(&waiter.waiters);
+        cond_destroy(&waiter.cond);
         if (err < 0)
             break;
     }
@@ -248,7 +448,7 @@ void file_lock_remove_owned_by(struct fd *fd, void *owner) {
     struct file_lock *lock, *tmp;
     list_for_each_entry_safe(&inode->posix_locks, lock, tmp, locks) {
         if (lock->owner == owner)
-            file_lock_delete(lock);
+            file_lock_delete(inode, lock);
     }
     unlock(&inode->lock);
 }
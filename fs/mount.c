@@ -78,6 +78,7 @@ int do_mount(const struct fs_ops *fs, const char *source, const char *point, con
             break;
     }
     list_add_before(&mount->mounts, &new_mount->mounts);
+    dentry_invalidate_all();
     return 0;
 }
 
@@ -88,6 +89,7 @@ int mount_remove(struct mount *mount) {
     if (mount->fs->umount)
         mount->fs->umount(mount);
     list_remove(&mount->mounts);
+    dentry_invalidate_all();
     free((void *) mount->info);
     free((void *) mount->source);
     free((void *) mount->point);
@@ -190,5 +192,17 @@ dword_t sys_umount2(addr_t target_addr, dword_t flags) {
     return err;
 }
 
+dword_t sys_sync() {
+    STRACE("sync()");
+    lock(&mounts_lock);
+    struct mount *mount;
+    list_for_each_entry(&mounts, mount, mounts) {
+        if (mount->fs->sync)
+            mount->fs->sync(mount);
+    }
+    unlock(&mounts_lock);
+    return 0;
+}
+
 struct list mounts = {&mounts, &mounts};
 lock_t mounts_lock = LOCK_INITIALIZER;
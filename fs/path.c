@@ -2,6 +2,212 @@
 #include <sys/stat.h>
 #include "kernel/calls.h"
 #include "fs/path.h"
+#include "util/timer.h"
+
+// Resolving a path means a readlink on every component, and a stat on every
+// directory to check it's a directory that can be searched. Those results are
+// cached here, by the path up to and including the component, so resolving
+// /usr/lib/python3/site-packages/foo doesn't go to the filesystem for /usr
+// again and again.
+//
+// Changes made through the generic_* functions invalidate what they affect.
+// A lookup only adds its result if nothing was invalidated while it was
+// looking, since otherwise what it found might already be out of date.
+// Something outside ish could change the underlying files too, so entries
+// also expire after DENTRY_TTL_NS. Procfs is never cached, since its symlinks
+// depend on who's asking.
+
+#define DENTRY_BUCKETS 1024
+#define DENTRY_MAX 4096
+#define DENTRY_TTL_NS 1000000000ull
+
+struct dentry {
+    struct list chain; // in the bucket
+    struct list lru;
+    uint32_t hash;
+    uint64_t expires;
+    int readlink; // length of target, or an error if not a symlink
+    bool has_stat;
+    mode_t_ mode;
+    uid_t_ uid;
+    uid_t_ gid;
+    char *target;
+    char path[];
+};
+
+static lock_t dentries_lock = LOCK_INITIALIZER;
+static struct list dentry_buckets[DENTRY_BUCKETS];
+static struct list dentry_lru;
+static unsigned dentry_count;
+// changed whenever anything is invalidated
+static uint64_t dentry_gen;
+
+static void __attribute__((constructor)) init_dentries() {
+    for (int i = 0; i < DENTRY_BUCKETS; i++)
+        list_init(&dentry_buckets[i]);
+    list_init(&dentry_lru);
+}
+
+static uint64_t dentry_now() {
+    struct timespec now = timespec_now(CLOCK_MONOTONIC);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t dentry_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char) *c) * 16777619;
+    return hash;
+}
+
+static struct dentry *dentry_find(const char *path, uint32_t hash) {
+    struct dentry *dentry;
+    list_for_each_entry(&dentry_buckets[hash % DENTRY_BUCKETS], dentry, chain) {
+        if (dentry->hash == hash && strcmp(dentry->path, path) == 0)
+            return dentry;
+    }
+    return NULL;
+}
+
+static void dentry_remove(struct dentry *dentry) {
+    list_remove(&dentry->chain);
+    list_remove(&dentry->lru);
+    dentry_count--;
+    free(dentry->target);
+    free(dentry);
+}
+
+static void dentry_put(const char *path, uint32_t hash, uint64_t gen, int readlink, const char *target, struct statbuf *stat) {
+    size_t path_len = strlen(path);
+    struct dentry *new = malloc(sizeof(struct dentry) + path_len + 1);
+    if (new == NULL)
+        return;
+    new->hash = hash;
+    new->expires = dentry_now() + DENTRY_TTL_NS;
+    new->readlink = readlink;
+    new->target = NULL;
+    if (readlink >= 0) {
+        new->target = malloc(readlink);
+        if (new->target == NULL) {
+            free(new);
+            return;
+        }
+        memcpy(new->target, target, readlink);
+    }
+    new->has_stat = stat != NULL;
+    if (stat != NULL) {
+        new->mode = stat->mode;
+        new->uid = stat->uid;
+        new->gid = stat->gid;
+    }
+    memcpy(new->path, path, path_len + 1);
+
+    lock(&dentries_lock);
+    if (gen != dentry_gen) {
+        unlock(&dentries_lock);
+        free(new->target);
+        free(new);
+        return;
+    }
+    struct dentry *old = dentry_find(path, hash);
+    if (old != NULL)
+        dentry_remove(old);
+    if (dentry_count >= DENTRY_MAX)
+        dentry_remove(list_entry(dentry_lru.prev, struct dentry, lru));
+    list_add(&dentry_buckets[hash % DENTRY_BUCKETS], &new->chain);
+    list_add(&dentry_lru, &new->lru);
+    dentry_count++;
+    unlock(&dentries_lock);
+}
+
+void dentry_invalidate(struct mount *mount, const char *path, bool subtree) {
+    char full_path[MAX_PATH];
+    if (strlen(mount->point) + strlen(path) >= sizeof(full_path)) {
+        dentry_invalidate_all();
+        return;
+    }
+    strcpy(full_path, mount->point);
+    strcat(full_path, path);
+    size_t len = strlen(full_path);
+
+    lock(&dentries_lock);
+    dentry_gen++;
+    if (!subtree) {
+        struct dentry *dentry = dentry_find(full_path, dentry_hash(full_path));
+        if (dentry != NULL)
+            dentry_remove(dentry);
+    } else {
+        struct dentry *dentry, *tmp;
+        list_for_each_entry_safe(&dentry_lru, dentry, tmp, lru) {
+            if (strncmp(dentry->path, full_path, len) == 0 &&
+                    (dentry->path[len] == '\0' || dentry->path[len] == '/'))
+                dentry_remove(dentry);
+        }
+    }
+    unlock(&dentries_lock);
+}
+
+void dentry_invalidate_all() {
+    lock(&dentries_lock);
+    dentry_gen++;
+    struct dentry *dentry, *tmp;
+    list_for_each_entry_safe(&dentry_lru, dentry, tmp, lru) {
+        dentry_remove(dentry);
+    }
+    unlock(&dentries_lock);
+}
+
+// Readlinks path into buf, and if want_stat, also stats it. Returns the
+// length of the symlink target or an error if it isn't one. If it isn't, and
+// want_stat, *stat_err is the result of the stat.
+static int path_lookup(const char *path, char *buf, size_t bufsize, bool want_stat, struct statbuf *stat, int *stat_err) {
+    uint32_t hash = dentry_hash(path);
+    lock(&dentries_lock);
+    struct dentry *dentry = dentry_find(path, hash);
+    if (dentry != NULL && dentry_now() >= dentry->expires) {
+        dentry_remove(dentry);
+        dentry = NULL;
+    }
+    if (dentry != NULL && (dentry->readlink >= 0 || !want_stat || dentry->has_stat) &&
+            (dentry->readlink < 0 || (size_t) dentry->readlink < bufsize)) {
+        int res = dentry->readlink;
+        if (res >= 0) {
+            memcpy(buf, dentry->target, res);
+        } else if (want_stat) {
+            *stat_err = 0;
+            stat->mode = dentry->mode;
+            stat->uid = dentry->uid;
+            stat->gid = dentry->gid;
+        }
+        list_remove(&dentry->lru);
+        list_add(&dentry_lru, &dentry->lru);
+        unlock(&dentries_lock);
+        return res;
+    }
+    uint64_t gen = dentry_gen;
+    unlock(&dentries_lock);
+
+    char trimmed_path[MAX_PATH];
+    strcpy(trimmed_path, path);
+    struct mount *mount = find_mount_and_trim_path(trimmed_path);
+    assert(path_is_normalized(trimmed_path));
+    int res = _EINVAL;
+    if (mount->fs->readlink)
+        res = mount->fs->readlink(mount, trimmed_path, buf, bufsize);
+    if (res < 0 && want_stat)
+        *stat_err = mount->fs->stat(mount, trimmed_path, stat);
+    bool cacheable = mount->fs != &procfs;
+    mount_release(mount);
+
+    // only remember things that exist, and targets that weren't cut off
+    if (cacheable) {
+        if (res >= 0 && (size_t) res < bufsize)
+            dentry_put(path, hash, gen, res, buf, NULL);
+        else if (res == _EINVAL && (!want_stat || *stat_err >= 0))
+            dentry_put(path, hash, gen, res, NULL, want_stat ? stat : NULL);
+    }
+    return res;
+}
 
 static int __path_normalize(const char *at_path, const char *path, char *out, int flags, int levels) {
     // you must choose one
@@ -64,19 +270,14 @@ static int __path_normalize(const char *at_path, const char *path, char *out, in
             return _ENAMETOOLONG;
 
         if ((flags & N_SYMLINK_FOLLOW) || *p != '\0') {
-            // this buffer is used to store the path that we're readlinking, then
-            // if it turns out to point to a symlink it's reused as the buffer
-            // passed to the next path_normalize call
-            char possible_symlink[MAX_PATH];
             *o = '\0';
-            strcpy(possible_symlink, out);
-            struct mount *mount = find_mount_and_trim_path(possible_symlink);
-            assert(path_is_normalized(possible_symlink));
-            int res = _EINVAL;
-            if (mount->fs->readlink)
-                res = mount->fs->readlink(mount, possible_symlink, c, MAX_PATH - (c - out));
+            // if there's a slash after this component, ensure that if it
+            // exists, it's a directory and that we have execute perms on it
+            bool check_dir = *(p - 1) == '/';
+            struct statbuf stat;
+            int err = 0;
+            int res = path_lookup(out, c, MAX_PATH - (c - out), check_dir, &stat, &err);
             if (res >= 0) {
-                mount_release(mount);
                 if (levels >= 5)
                     return _ELOOP;
                 // readlink does not null terminate
@@ -84,7 +285,7 @@ static int __path_normalize(const char *at_path, const char *path, char *out, in
                 // if we should restart from the root, copy down
                 if (*c == '/')
                     memmove(out, c, strlen(c) + 1);
-                char *expanded_path = possible_symlink;
+                char expanded_path[MAX_PATH];
                 strcpy(expanded_path, out);
                 if (strcmp(p, "") != 0) {
                     strcat(expanded_path, "/");
@@ -93,21 +294,12 @@ static int __path_normalize(const char *at_path, const char *path, char *out, in
                 return __path_normalize(NULL, expanded_path, out, flags, levels + 1);
             }
 
-            // if there's a slash after this component, ensure that if it
-            // exists, it's a directory and that we have execute perms on it
-            if (*(p - 1) == '/') {
-                struct statbuf stat;
-                int err = mount->fs->stat(mount, possible_symlink, &stat);
-                mount_release(mount);
-                if (err >= 0) {
-                    if (!S_ISDIR(stat.mode))
-                        return _ENOTDIR;
-                    err = access_check(&stat, AC_X);
-                    if (err < 0)
-                        return err;
-                }
-            } else {
-                mount_release(mount);
+            if (check_dir && err >= 0) {
+                if (!S_ISDIR(stat.mode))
+                    return _ENOTDIR;
+                err = access_check(&stat, AC_X);
+                if (err < 0)
+                    return err;
             }
         }
     }
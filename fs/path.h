@@ -37,4 +37,13 @@ bool path_is_normalized(const char *path);
 // Otherwise, the end of the path has been reached.
 bool path_next_component(const char **path, char *component, int *err);
 
+// path_normalize caches what it finds out about each path it goes through.
+// Anything that changes whether a path is a symlink, what it points to, or
+// whether it's a searchable directory has to invalidate it: subtree for
+// renaming and removing directories, which takes everything under it too.
+// path is relative to the mount, like what fs_ops get.
+struct mount;
+void dentry_invalidate(struct mount *mount, const char *path, bool subtree);
+void dentry_invalidate_all(void);
+
 #endif
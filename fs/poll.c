@@ -5,6 +5,7 @@
 #include <limits.h>
 #include "misc.h"
 #include "util/list.h"
+#include "util/timer.h"
 #include "kernel/errno.h"
 #include "kernel/fs.h"
 #include "fs/fd.h"
@@ -37,6 +38,9 @@ static int real_poll_update(struct real_poll *real, int fd, int types, void *dat
 
 // lock order: fd, then poll
 
+// Everything in types that isn't a flag
+#define POLL_EVENTS (POLL_READ | POLL_PRI | POLL_WRITE | POLL_ERR | POLL_HUP | POLL_NVAL)
+
 struct poll *poll_create() {
     struct poll *poll = malloc(sizeof(struct poll));
     if (poll == NULL)
@@ -48,20 +52,27 @@ struct poll *poll_create() {
     poll->notify_pipe[0] = -1;
     poll->notify_pipe[1] = -1;
     list_init(&poll->poll_fds);
+    list_init(&poll->real_poll_fds);
+    list_init(&poll->ready);
     list_init(&poll->pollfd_freelist);
     lock_init(&poll->lock);
     return poll;
 }
 
+static inline bool fd_is_real(struct fd *fd) {
+    return fd->ops->poll == realfs_poll;
+}
 static inline bool poll_fd_is_real(struct poll_fd *pollfd) {
-    return pollfd->fd->ops->poll == realfs_poll;
+    return fd_is_real(pollfd->fd);
 }
 
-// does not do its own locking
+// Must be called with fd->poll_lock. This searches from the fd's side because
+// an fd is rarely in more than a couple polls, but a poll can have thousands
+// of fds.
 static struct poll_fd *poll_find_fd(struct poll *poll, struct fd *fd) {
-    struct poll_fd *poll_fd, *tmp;
-    list_for_each_entry_safe(&poll->poll_fds, poll_fd, tmp, fds) {
-        if (poll_fd->fd == fd)
+    struct poll_fd *poll_fd;
+    list_for_each_entry(&fd->poll_fds, poll_fd, polls) {
+        if (poll_fd->poll == poll)
             return poll_fd;
     }
     return NULL;
@@ -70,13 +81,29 @@ static struct poll_fd *poll_find_fd(struct poll *poll, struct fd *fd) {
 // See comment on pollfd_freelist for context
 static void poll_fd_free(struct poll_fd *poll_fd) {
     struct poll *poll = poll_fd->poll;
+    list_remove_safe(&poll_fd->ready);
     memset(poll_fd, 0xba, sizeof(*poll_fd));
     poll_fd->poll = NULL; // used to mark it as free
     list_add(&poll->pollfd_freelist, &poll_fd->fds);
 }
 
+// Must be called with poll->lock
+static void poll_notify(struct poll *poll) {
+    if (poll->notify_pipe[1] != -1)
+        write(poll->notify_pipe[1], "", 1);
+}
+
+// Must be called with poll->lock
+static void poll_fd_mark_ready(struct poll *poll, struct poll_fd *poll_fd) {
+    if (list_null(&poll_fd->ready))
+        list_add_tail(&poll->ready, &poll_fd->ready);
+}
+
 bool poll_has_fd(struct poll *poll, struct fd *fd) {
-    return poll_find_fd(poll, fd) != NULL;
+    lock(&fd->poll_lock);
+    bool has_fd = poll_find_fd(poll, fd) != NULL;
+    unlock(&fd->poll_lock);
+    return has_fd;
 }
 
 int poll_add_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info info) {
@@ -97,21 +124,27 @@ int poll_add_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info
     }
     poll_fd->fd = fd;
     poll_fd->poll = poll;
-    poll_fd->types = types;
+    // errors and hangups are always reported, like linux
+    poll_fd->types = types | POLL_ERR | POLL_HUP;
     poll_fd->info = info;
-    poll_fd->triggered_types = 0;
+    poll_fd->ready = (struct list) {NULL, NULL};
+    poll_fd->ready_types = 0;
 
     if (poll_fd_is_real(poll_fd)) {
-        err = real_poll_update(&poll->real, fd->real_fd, types, poll_fd);
+        err = real_poll_update(&poll->real, fd->real_fd, poll_fd->types, poll_fd);
         if (err < 0) {
-            free(poll_fd);
             err = errno_map();
+            free(poll_fd);
             goto out;
         }
+        list_add(&poll->real_poll_fds, &poll_fd->fds);
+    } else {
+        list_add(&poll->poll_fds, &poll_fd->fds);
+        // it might be ready already
+        poll_fd_mark_ready(poll, poll_fd);
+        poll_notify(poll);
     }
-
     list_add(&fd->poll_fds, &poll_fd->polls);
-    list_add(&poll->poll_fds, &poll_fd->fds);
 
     err = 0;
 out:
@@ -159,17 +192,24 @@ int poll_mod_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info
         goto out;
     }
 
+    types |= POLL_ERR | POLL_HUP;
     if (poll_fd_is_real(poll_fd)) {
+        // this also rearms it in the real poll if it was oneshot
         err = real_poll_update(&poll->real, fd->real_fd, types, poll_fd);
         if (err < 0) {
             err = errno_map();
             goto out;
         }
+        poll_fd->ready_types = 0;
     }
 
     poll_fd->types = types;
     poll_fd->info = info;
-    poll_fd->triggered_types &= types;
+    if (!poll_fd_is_real(poll_fd)) {
+        // it has to be checked again with the new types
+        poll_fd_mark_ready(poll, poll_fd);
+        poll_notify(poll);
+    }
 
     err = 0;
 out:
@@ -182,13 +222,14 @@ void poll_cleanup_fd(struct fd *fd) {
     lock(&fd->poll_lock);
     struct poll_fd *poll_fd, *tmp;
     list_for_each_entry_safe(&fd->poll_fds, poll_fd, tmp, polls) {
-        lock(&poll_fd->poll->lock);
+        struct poll *poll = poll_fd->poll;
+        lock(&poll->lock);
         if (poll_fd_is_real(poll_fd))
-            real_poll_update(&poll_fd->poll->real, fd->real_fd, 0, poll_fd);
+            real_poll_update(&poll->real, fd->real_fd, 0, poll_fd);
         list_remove(&poll_fd->polls);
         list_remove(&poll_fd->fds);
-        unlock(&poll_fd->poll->lock);
         poll_fd_free(poll_fd);
+        unlock(&poll->lock);
     }
     unlock(&fd->poll_lock);
 }
@@ -197,25 +238,113 @@ void poll_wakeup(struct fd *fd, int events) {
     struct poll_fd *poll_fd;
     lock(&fd->poll_lock);
     list_for_each_entry(&fd->poll_fds, poll_fd, polls) {
+        // real fds hear about their events from the real poll, and a
+        // disarmed oneshot fd has no types left
+        if (poll_fd_is_real(poll_fd) || !(poll_fd->types & events))
+            continue;
         struct poll *poll = poll_fd->poll;
         lock(&poll->lock);
-        if (poll_fd->types & POLL_EDGETRIGGERED)
-            poll_fd->triggered_types &= ~events;
-        if (poll->notify_pipe[1] != -1)
-            write(poll->notify_pipe[1], "", 1);
+        poll_fd_mark_ready(poll, poll_fd);
+        poll_notify(poll);
         unlock(&poll->lock);
-        // oneshot?
     }
     unlock(&fd->poll_lock);
 }
 
+// Puts the fds the real poll returned on the ready list. Must be called with
+// poll->lock.
+static void poll_add_real_events(struct poll *poll, struct real_poll_event *events, int count) {
+    for (int i = 0; i < count; i++) {
+        struct poll_fd *poll_fd = rpe_data(&events[i]);
+        if (poll_fd == NULL) {
+            // the notify pipe, empty it out
+            char buf[16];
+            while (read(poll->notify_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+            continue;
+        }
+        // it could have been freed after the real poll returned it, see
+        // pollfd_freelist
+        if (poll_fd->poll != poll)
+            continue;
+        poll_fd->ready_types |= rpe_events(&events[i]);
+        poll_fd_mark_ready(poll, poll_fd);
+    }
+}
+
+// Calls the callback for each fd on the ready list that actually has events.
+// Must be called with poll->lock.
+static int poll_report_ready(struct poll *poll, poll_callback_t callback, void *context) {
+    // Take the whole list first, so that level-triggered fds that go right
+    // back on it don't get seen twice.
+    struct list pending;
+    list_init(&pending);
+    if (!list_empty(&poll->ready)) {
+        list_add_after(&poll->ready, &pending);
+        list_remove(&poll->ready);
+        list_init(&poll->ready);
+    }
+
+    int res = 0;
+    bool full = false;
+    struct poll_fd *poll_fd, *tmp;
+    list_for_each_entry_safe(&pending, poll_fd, tmp, ready) {
+        list_remove(&poll_fd->ready);
+        if (full) {
+            list_add_tail(&poll->ready, &poll_fd->ready);
+            continue;
+        }
+
+        struct fd *fd = poll_fd->fd;
+        bool real = poll_fd_is_real(poll_fd);
+        int types = 0;
+        if (real) {
+            types = poll_fd->ready_types;
+            poll_fd->ready_types = 0;
+        } else if (fd->ops->poll) {
+            types = fd->ops->poll(fd);
+        }
+        types &= poll_fd->types & POLL_EVENTS;
+        if (types == 0)
+            continue;
+
+        int used = callback(context, types, poll_fd->info);
+        if (used < 0) {
+            // save it and everything after it for next time
+            if (real)
+                poll_fd->ready_types = types;
+            list_add_tail(&poll->ready, &poll_fd->ready);
+            full = true;
+            continue;
+        }
+        if (used == 0)
+            continue;
+        res++;
+
+        if (poll_fd->types & POLL_ONESHOT) {
+            // disarmed until poll_mod_fd, the real poll does the same
+            poll_fd->types &= ~POLL_EVENTS;
+        } else if (!(poll_fd->types & POLL_EDGETRIGGERED) && !real) {
+            // level-triggered, check it again next time. Real fds don't need
+            // this because the real poll is level-triggered too.
+            list_add_tail(&poll->ready, &poll_fd->ready);
+        }
+    }
+    return res;
+}
+
 int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struct timespec *timeout) {
+    struct timespec deadline;
+    if (timeout != NULL)
+        deadline = timespec_add(timespec_now(CLOCK_MONOTONIC), *timeout);
+
     lock(&poll_->lock);
 
     // acquire the pipe
     if (poll_->waiters++ == 0) {
         assert(poll_->notify_pipe[0] == -1 && poll_->notify_pipe[1] == -1);
         if (pipe(poll_->notify_pipe) < 0) {
+            poll_->waiters--;
             unlock(&poll_->lock);
             return errno_map();
         }
@@ -224,92 +353,54 @@ int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struc
         real_poll_update(&poll_->real, poll_->notify_pipe[0], POLL_READ, NULL);
     }
 
-    // TODO this is pretty broken with regards to timeouts
     int res = 0;
+    struct real_poll_event e[64];
     while (true) {
-        // check if any fds are ready
-        struct poll_fd *poll_fd, *tmp;
-        list_for_each_entry_safe(&poll_->poll_fds, poll_fd, tmp, fds) {
-            struct fd *fd = poll_fd->fd;
-            int poll_types = 0;
-            if (fd->ops->poll)
-                poll_types = fd->ops->poll(fd);
-            poll_types &= poll_fd->types | POLL_HUP | POLL_ERR;
-            if (poll_fd->types & POLL_EDGETRIGGERED) {
-                poll_types &= ~poll_fd->triggered_types;
-            }
-            if (poll_types) {
-                if (callback(context, poll_types, poll_fd->info) == 1)
-                    res++;
-
-                // The real poll does not actually get the FDs set as oneshot.
-                // But this loop is done while holding the lock, so only one
-                // thread can get each oneshot event. This doesn't solve the
-                // thundering herd problem at all, but at least the semantics
-                // are right. I'll just leave that as a TODO.
-                if (poll_fd->types & POLL_ONESHOT) {
-                    list_remove(&poll_fd->polls);
-                    list_remove(&poll_fd->fds);
-                    if (poll_fd_is_real(poll_fd)) {
-                        real_poll_update(&poll_->real, fd->real_fd, 0, NULL);
-                    }
-                    free(poll_fd);
-                }
-
-                if (poll_fd->types & POLL_EDGETRIGGERED) {
-                    poll_fd->triggered_types |= poll_types;
-                }
-            }
+        // Pick up whatever the real poll has without waiting, so real fds
+        // can't be starved by other fds that are always ready.
+        if (!list_empty(&poll_->real_poll_fds)) {
+            struct timespec zero = {0};
+            int count = real_poll_wait(&poll_->real, e, array_size(e), &zero);
+            if (count > 0)
+                poll_add_real_events(poll_, e, count);
         }
+
+        res = poll_report_ready(poll_, callback, context);
         if (res > 0)
             break;
 
-        lock(&current->sighand->lock);
-        bool signal_pending = !!(current->pending & ~current->blocked);
-        unlock(&current->sighand->lock);
-        if (signal_pending) {
+        if (signal_pending(current)) {
             res = _EINTR;
             break;
         }
 
+        struct timespec left;
+        if (timeout != NULL) {
+            left = timespec_subtract(deadline, timespec_now(CLOCK_MONOTONIC));
+            if (!timespec_positive(left))
+                break;
+        }
+
         // wait for a ready notification
-        list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
+        struct poll_fd *poll_fd;
+        list_for_each_entry(&poll_->real_poll_fds, poll_fd, fds) {
             sockrestart_begin_listen_wait(poll_fd->fd);
         }
         unlock(&poll_->lock);
-        int err;
-        struct real_poll_event e[4];
+        int count;
         do {
-            err = real_poll_wait(&poll_->real, e, sizeof(e)/sizeof(e[0]), timeout);
+            count = real_poll_wait(&poll_->real, e, array_size(e), timeout != NULL ? &left : NULL);
         } while (sockrestart_should_restart_listen_wait() && errno == EINTR);
         lock(&poll_->lock);
-        list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
+        list_for_each_entry(&poll_->real_poll_fds, poll_fd, fds) {
             sockrestart_end_listen_wait(poll_fd->fd);
         }
 
-        if (err < 0) {
-            res = errno_map();
-            break;
-        }
-        if (err == 0) {
-            // timed out and still nobody is ready
-            break;
-        }
-
-        // dead with any edge-triggered notifications
-        for (int i = 0; i < err; i++) {
-            struct poll_fd *triggered_poll_fd = rpe_data(&e[i]);
-            if (triggered_poll_fd != NULL && triggered_poll_fd->poll != NULL &&
-                    triggered_poll_fd->types & POLL_EDGETRIGGERED) {
-                triggered_poll_fd->triggered_types &= ~rpe_events(&e[i]);
-            }
-        }
-
-        char fuck;
-        if (read(poll_->notify_pipe[0], &fuck, 1) < 0 && errno != EAGAIN) {
+        if (count < 0) {
             res = errno_map();
             break;
         }
+        poll_add_real_events(poll_, e, count);
     }
 
     // release the pipe
@@ -327,12 +418,15 @@ int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struc
 void poll_destroy(struct poll *poll) {
     struct poll_fd *poll_fd;
     struct poll_fd *tmp;
-    list_for_each_entry_safe(&poll->poll_fds, poll_fd, tmp, fds) {
-        lock(&poll_fd->fd->poll_lock);
-        list_remove(&poll_fd->polls);
-        list_remove(&poll_fd->fds);
-        unlock(&poll_fd->fd->poll_lock);
-        free(poll_fd);
+    struct list *lists[] = {&poll->poll_fds, &poll->real_poll_fds};
+    for (unsigned i = 0; i < array_size(lists); i++) {
+        list_for_each_entry_safe(lists[i], poll_fd, tmp, fds) {
+            lock(&poll_fd->fd->poll_lock);
+            list_remove(&poll_fd->polls);
+            list_remove(&poll_fd->fds);
+            unlock(&poll_fd->fd->poll_lock);
+            free(poll_fd);
+        }
     }
 
     list_for_each_entry_safe(&poll->pollfd_freelist, poll_fd, tmp, fds) {
@@ -357,14 +451,16 @@ static int real_poll_init(struct real_poll *real) {
 
 static int real_poll_wait(struct real_poll *real, struct real_poll_event *events, int max, struct timespec *timeout) {
     int timeout_millis = -1;
+    // round up, or a timeout less than a millisecond would spin
     if (timeout != NULL)
-        timeout_millis = timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000;
+        timeout_millis = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
     return epoll_wait(real->fd, (struct epoll_event *) events, max, timeout_millis);
 }
 
 static int real_poll_update(struct real_poll *real, int fd, int types, void *data) {
-    types &= ~EPOLLONESHOT;
-    if (types == 0)
+    // oneshot and edge-triggered are the same bits as in linux, so they get
+    // passed straight through
+    if (!(types & POLL_EVENTS))
         return epoll_ctl(real->fd, EPOLL_CTL_DEL, fd, NULL);
     struct epoll_event epevent = {.events = types, .data.ptr = data};
     int err = epoll_ctl(real->fd, EPOLL_CTL_MOD, fd, &epevent);
@@ -406,6 +502,8 @@ static int real_poll_update(struct real_poll *real, int fd, int types, void *dat
         e[i].flags |= EV_RECEIPT;
         if (types & POLL_EDGETRIGGERED)
             e[i].flags |= EV_CLEAR;
+        if (types & POLL_ONESHOT)
+            e[i].flags |= EV_DISPATCH;
     }
 
     return kevent(real->fd, e, 3, e, 3, NULL);
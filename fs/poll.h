@@ -7,7 +7,12 @@ struct real_poll {
 };
 
 struct poll {
+    // fds that are polled by calling their poll op, and fds that are handed
+    // straight to the real poll
     struct list poll_fds;
+    struct list real_poll_fds;
+    // poll_fds that might have events, in the order they became ready
+    struct list ready;
     struct real_poll real;
     int notify_pipe[2];
     int waiters; // if nonzero, notify_pipe exists
@@ -40,10 +45,13 @@ struct poll_fd {
         int fd;
         uint64_t num;
     } info;
-    // Used to implement edge-triggered notifications. When an event is
-    // returned its bits are set here, and those bits are ignored on the next
-    // call to poll_wait. The bits are cleared by poll_wakeup.
-    int triggered_types;
+    // On the containing poll's ready list if it's been woken up since the
+    // last time it was checked. Level-triggered fds go back on the list after
+    // they're returned, edge-triggered ones wait for the next wakeup.
+    struct list ready;
+    // For real fds, the events the real poll said were ready, so they don't
+    // need to be polled again
+    int ready_types;
 
     // locked by containing struct fd
     struct poll *poll;
@@ -80,6 +88,8 @@ int poll_del_fd(struct poll *poll, struct fd *fd);
 // please do not call this while holding any locks you would acquire in your poll operation
 void poll_wakeup(struct fd *fd, int events);
 // Waits for events on the fds in this poll, and calls the callback for each one found.
+// The callback returns 1 if it used the event, 0 if it didn't, or -1 if it
+// can't take any more, which leaves the event pending for the next call.
 // Returns the number of times the callback returned 1, or negative for error.
 typedef int (*poll_callback_t)(void *context, int types, union poll_fd_info info);
 int poll_wait(struct poll *poll, poll_callback_t callback, void *context, struct timespec *timeout);
@@ -1,6 +1,7 @@
 #include "fs/proc.h"
 #include "fs/proc/ish.h"
 #include "kernel/errno.h"
+#include "kernel/ksm.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -160,10 +161,58 @@ static int proc_ish_show_version(struct proc_entry *UNUSED(entry), struct proc_d
     return 0;
 }
 
+static int proc_ish_show_ksm(struct proc_entry *entry, struct proc_data *buf) {
+    struct ksm_stats stats;
+    ksm_get_stats(&stats);
+    unsigned long value;
+    if (strcmp(entry->meta->name, "run") == 0)
+        value = stats.run;
+    else if (strcmp(entry->meta->name, "pages_to_scan") == 0)
+        value = stats.pages_to_scan;
+    else if (strcmp(entry->meta->name, "sleep_millisecs") == 0)
+        value = stats.sleep_millisecs;
+    else if (strcmp(entry->meta->name, "pages_shared") == 0)
+        value = stats.pages_shared;
+    else if (strcmp(entry->meta->name, "pages_sharing") == 0)
+        value = stats.pages_sharing;
+    else if (strcmp(entry->meta->name, "pages_unshared") == 0)
+        value = stats.pages_unshared;
+    else
+        value = stats.full_scans;
+    proc_printf(buf, "%lu\n", value);
+    return 0;
+}
+
+static int proc_ish_update_ksm(struct proc_entry *entry, struct proc_data *data) {
+    char str[16] = {};
+    memcpy(str, data->data, data->size < sizeof(str) - 1 ? data->size : sizeof(str) - 1);
+    char *end;
+    unsigned long value = strtoul(str, &end, 10);
+    if (end == str || (*end != '\0' && *end != '\n'))
+        return _EINVAL;
+    if (strcmp(entry->meta->name, "run") == 0)
+        return ksm_set_run(value);
+    if (strcmp(entry->meta->name, "pages_to_scan") == 0)
+        return ksm_set_pages_to_scan(value);
+    return ksm_set_sleep_millisecs(value);
+}
+
+// same files as /sys/kernel/mm/ksm on linux
+static struct proc_children proc_ish_ksm_children = PROC_CHILDREN({
+    {"full_scans", .show = proc_ish_show_ksm},
+    {"pages_shared", .show = proc_ish_show_ksm},
+    {"pages_sharing", .show = proc_ish_show_ksm},
+    {"pages_to_scan", 0644, .show = proc_ish_show_ksm, .update = proc_ish_update_ksm},
+    {"pages_unshared", .show = proc_ish_show_ksm},
+    {"run", 0644, .show = proc_ish_show_ksm, .update = proc_ish_update_ksm},
+    {"sleep_millisecs", 0644, .show = proc_ish_show_ksm, .update = proc_ish_update_ksm},
+});
+
 struct proc_children proc_ish_children = PROC_CHILDREN({
     {"colors", .show = proc_ish_show_colors},
     {".defaults", S_IFDIR, .readdir = proc_ish_underlying_defaults_readdir},
     {"defaults", S_IFDIR, .readdir = proc_ish_defaults_readdir},
     {"documents", .show = proc_ish_show_documents},
+    {"ksm", S_IFDIR, .children = &proc_ish_ksm_children},
     {"version", .show = proc_ish_show_version},
 });
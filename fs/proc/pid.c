@@ -219,7 +219,7 @@ void proc_maps_dump(struct task *task, struct proc_data *buf) {
                 start_pt->flags & P_WRITE ? 'w' : '-',
                 start_pt->flags & P_EXEC ? 'x' : '-',
                 start_pt->flags & P_SHARED ? '-' : 'p',
-                (unsigned long) data->file_offset, // offset
+                data->fd != NULL ? (unsigned long) (data->file_offset + start_pt->offset) : 0, // offset
                 0, // inode
                 path);
     }
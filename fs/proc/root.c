@@ -137,10 +137,10 @@ static bool proc_root_readdir(struct proc_entry *UNUSED(entry), unsigned long *i
     if (pid <= MAX_PID) {
         lock(&pids_lock);
         do {
-            pid++;
-        } while (pid <= MAX_PID && pid_get_task(pid) == NULL);
+            pid = pid_next(pid);
+        } while (pid != 0 && pid_get_task(pid) == NULL);
         unlock(&pids_lock);
-        if (pid > MAX_PID)
+        if (pid == 0)
             return false;
         *next_entry = (struct proc_entry) {&proc_pid, .pid = pid};
         *index = pid + PROC_ROOT_LEN;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,6 +11,12 @@
 #include <sys/file.h>
 #include <sys/statvfs.h>
 #include <poll.h>
+#if __linux__
+#include <sys/sendfile.h>
+#elif __APPLE__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
 
 #include "debug.h"
 #include "kernel/errno.h"
@@ -17,6 +24,7 @@
 #include "kernel/fs.h"
 #include "fs/dev.h"
 #include "fs/real.h"
+#include "fs/sock.h"
 #include "fs/tty.h"
 #include "util/fchdir.h"
 
@@ -260,6 +268,61 @@ int realfs_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off
     return pt_map(mem, start, pages, memory, correction, prot);
 }
 
+// fds whose reads or writes go straight to real_fd
+static bool realfs_plain_read(struct fd *fd) {
+    return fd->ops->read == realfs_read || fd->ops == &socket_fdops;
+}
+static bool realfs_plain_write(struct fd *fd) {
+    return fd->ops->write == realfs_write || fd->ops == &socket_fdops;
+}
+
+ssize_t realfs_copy(struct fd *in, off_t *in_off, struct fd *out, off_t *out_off, size_t count) {
+    if (!realfs_plain_read(in) || !realfs_plain_write(out))
+        return _ENOTSUP;
+    struct stat in_stat, out_stat;
+    if (fstat(in->real_fd, &in_stat) < 0 || fstat(out->real_fd, &out_stat) < 0)
+        return _ENOTSUP;
+
+    ssize_t res;
+#if __linux__
+    if ((S_ISFIFO(in_stat.st_mode) && in_off == NULL) || (S_ISFIFO(out_stat.st_mode) && out_off == NULL))
+        res = splice(in->real_fd, in_off, out->real_fd, out_off, count, 0);
+    else if (S_ISREG(in_stat.st_mode) && S_ISREG(out_stat.st_mode))
+        res = copy_file_range(in->real_fd, in_off, out->real_fd, out_off, count, 0);
+    else if (out_off == NULL)
+        res = sendfile(out->real_fd, in->real_fd, in_off, count);
+    else
+        return _ENOTSUP;
+#elif __APPLE__
+    // darwin can only do files to sockets
+    if (!S_ISREG(in_stat.st_mode) || !S_ISSOCK(out_stat.st_mode) || out_off != NULL)
+        return _ENOTSUP;
+    off_t off = in_off ? *in_off : lseek(in->real_fd, 0, SEEK_CUR);
+    off_t len = count;
+    res = sendfile(in->real_fd, out->real_fd, off, &len, NULL, 0);
+    // a nonblocking socket can return EAGAIN after sending some of it
+    if (res < 0 && len > 0)
+        res = 0;
+    if (res == 0) {
+        res = len;
+        if (in_off)
+            *in_off += len;
+        else
+            lseek(in->real_fd, off + len, SEEK_SET);
+    }
+#else
+    return _ENOTSUP;
+#endif
+    if (res < 0) {
+        // these mean the host can't do it this way, not that it can't be done
+        if (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                errno == EOPNOTSUPP || errno == EBADF)
+            return _ENOTSUP;
+        return errno_map();
+    }
+    return res;
+}
+
 ssize_t realfs_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
     ssize_t size = readlinkat(mount->root_fd, fix_path(path), buf, bufsize);
     if (size < 0)
@@ -32,6 +32,8 @@ int realfs_flock(struct fd *fd, int operation);
 int realfs_getpath(struct fd *fd, char *buf);
 ssize_t realfs_read(struct fd *fd, void *buf, size_t bufsize);
 ssize_t realfs_write(struct fd *fd, const void *buf, size_t bufsize);
+ssize_t realfs_pread(struct fd *fd, void *buf, size_t bufsize, off_t off);
+ssize_t realfs_pwrite(struct fd *fd, const void *buf, size_t bufsize, off_t off);
 
 int realfs_readdir(struct fd *fd, struct dir_entry *entry);
 unsigned long realfs_telldir(struct fd *fd);
@@ -41,6 +43,11 @@ off_t realfs_lseek(struct fd *fd, off_t offset, int whence);
 
 int realfs_poll(struct fd *fd);
 int realfs_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off_t offset, int prot, int flags);
+// Copy between two fds using host sendfile/splice/copy_file_range. Null
+// offsets mean use the file offsets. Returns _ENOTSUP if the fds aren't
+// plain host fds or the host can't do it, so the caller can fall back to
+// reading and writing.
+ssize_t realfs_copy(struct fd *in, off_t *in_off, struct fd *out, off_t *out_off, size_t count);
 int realfs_fsync(struct fd *fd);
 int realfs_getflags(struct fd *fd);
 int realfs_setflags(struct fd *fd, dword_t arg);
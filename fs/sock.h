@@ -9,6 +9,8 @@
 #include "misc.h"
 #include "debug.h"
 
+extern const struct fd_ops socket_fdops;
+
 int_t sys_socketcall(dword_t call_num, addr_t args_addr);
 
 int_t sys_socket(dword_t domain, dword_t type, dword_t protocol);
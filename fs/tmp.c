@@ -1,12 +1,140 @@
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <string.h>
+#include "kernel/calls.h"
 #include "kernel/task.h"
 #include "kernel/errno.h"
 #include "kernel/fs.h"
+#include "kernel/memory.h"
 #include "fs/path.h"
 #include "util/refcount.h"
+#include "util/timer.h"
 #include "debug.h"
 
+// =======================
+// ======== PAGES ========
+// =======================
+
+// File contents are kept in pages, in a radix tree indexed by page number.
+// Pages that have never been written aren't there, and read as zeroes. Each
+// page is a struct data so it can be mapped straight into guest memory: the
+// tree holds one reference, and each mapping holds another.
+
+#define TMP_RADIX_BITS 6
+#define TMP_RADIX_SIZE (1 << TMP_RADIX_BITS)
+
+struct tmp_radix_node {
+    void *slots[TMP_RADIX_SIZE]; // tmp_radix_node, or struct data at the bottom
+};
+
+struct tmp_pages {
+    // a tree of height h has pages 0 to TMP_RADIX_SIZE^h - 1, and a tree of
+    // height 0 is just page 0
+    void *root;
+    unsigned height;
+    uint64_t count; // how many pages are allocated
+};
+
+static bool tmp_pages_fit(struct tmp_pages *pages, uint64_t index) {
+    if (pages->height * TMP_RADIX_BITS >= sizeof(uint64_t) * 8)
+        return true;
+    return index >> (pages->height * TMP_RADIX_BITS) == 0;
+}
+
+static struct data *tmp_page_find(struct tmp_pages *pages, uint64_t index) {
+    if (!tmp_pages_fit(pages, index))
+        return NULL;
+    void *node = pages->root;
+    for (unsigned level = pages->height; level > 0 && node != NULL; level--) {
+        unsigned slot = (index >> ((level - 1) * TMP_RADIX_BITS)) & (TMP_RADIX_SIZE - 1);
+        node = ((struct tmp_radix_node *) node)->slots[slot];
+    }
+    return node;
+}
+
+// Returns the page, allocating a zeroed one if it's a hole
+static struct data *tmp_page_get(struct tmp_pages *pages, uint64_t index) {
+    while (!tmp_pages_fit(pages, index)) {
+        struct tmp_radix_node *new_root = calloc(1, sizeof(struct tmp_radix_node));
+        if (new_root == NULL)
+            return NULL;
+        new_root->slots[0] = pages->root;
+        pages->root = new_root;
+        pages->height++;
+    }
+
+    void **slot = &pages->root;
+    for (unsigned level = pages->height; level > 0; level--) {
+        if (*slot == NULL) {
+            *slot = calloc(1, sizeof(struct tmp_radix_node));
+            if (*slot == NULL)
+                return NULL;
+        }
+        unsigned i = (index >> ((level - 1) * TMP_RADIX_BITS)) & (TMP_RADIX_SIZE - 1);
+        slot = &((struct tmp_radix_node *) *slot)->slots[i];
+    }
+    if (*slot != NULL)
+        return *slot;
+
+    struct data *page = malloc(sizeof(struct data));
+    if (page == NULL)
+        return NULL;
+    void *memory = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        free(page);
+        return NULL;
+    }
+    *page = (struct data) {
+        .data = memory,
+        .size = PAGE_SIZE,
+        .refcount = 1,
+        .name = "[tmpfs]",
+    };
+    *slot = page;
+    pages->count++;
+    return page;
+}
+
+// Frees every page from start on, and any nodes left empty. Returns whether
+// the node is now empty.
+static bool tmp_pages_free_node(struct tmp_pages *pages, void **slot, unsigned level, uint64_t first, uint64_t start) {
+    if (*slot == NULL)
+        return true;
+    if (level == 0) {
+        if (first < start)
+            return false;
+        data_release(*slot);
+        *slot = NULL;
+        pages->count--;
+        return true;
+    }
+    struct tmp_radix_node *node = *slot;
+    unsigned shift = (level - 1) * TMP_RADIX_BITS;
+    bool empty = true;
+    for (unsigned i = 0; i < TMP_RADIX_SIZE; i++) {
+        uint64_t child_first = first + ((uint64_t) i << shift);
+        // skip children that are entirely before start
+        if (shift < sizeof(uint64_t) * 8 && child_first + ((uint64_t) 1 << shift) <= start) {
+            if (node->slots[i] != NULL)
+                empty = false;
+            continue;
+        }
+        if (!tmp_pages_free_node(pages, &node->slots[i], level - 1, child_first, start))
+            empty = false;
+    }
+    if (empty) {
+        free(node);
+        *slot = NULL;
+    }
+    return empty;
+}
+
+static void tmp_pages_truncate(struct tmp_pages *pages, uint64_t start) {
+    tmp_pages_free_node(pages, &pages->root, pages->height, 0, start);
+    if (pages->root == NULL)
+        pages->height = 0;
+}
+
 // ========================
 // ======== INODES ========
 // ========================
@@ -17,7 +145,7 @@ struct tmp_inode {
 
     struct statbuf stat;
     union {
-        void *file_data;
+        struct tmp_pages file_pages;
         //char *symlink_data;
     };
 };
@@ -36,21 +164,32 @@ static struct tmp_inode *tmp_inode_new(mode_t_ mode) {
     node->stat.mode = mode;
     node->stat.uid = current->euid;
     node->stat.gid = current->egid;
-    if (S_ISREG(mode)) {
-        node->file_data = malloc(0);
-        if (node->file_data == NULL) {
-            free(node);
-            return NULL;
-        }
-    }
+    node->stat.blksize = PAGE_SIZE;
+    struct timespec now = timespec_now(CLOCK_REALTIME);
+    node->stat.atime = node->stat.mtime = node->stat.ctime = now.tv_sec;
+    node->stat.atime_nsec = node->stat.mtime_nsec = node->stat.ctime_nsec = now.tv_nsec;
+    if (S_ISREG(mode))
+        node->file_pages = (struct tmp_pages) {};
     return node;
 }
 
 DEFINE_REFCOUNT_STATIC(tmp_inode)
 
+// Must call with the inode locked. exec caches binaries by their timestamps,
+// so they have to change whenever the contents do.
+static void tmp_inode_touch(struct tmp_inode *inode, bool modified) {
+    struct timespec now = timespec_now(CLOCK_REALTIME);
+    if (modified) {
+        inode->stat.mtime = now.tv_sec;
+        inode->stat.mtime_nsec = now.tv_nsec;
+    }
+    inode->stat.ctime = now.tv_sec;
+    inode->stat.ctime_nsec = now.tv_nsec;
+}
+
 static void tmp_inode_cleanup(struct tmp_inode *inode) {
     if (S_ISREG(inode->stat.mode)) {
-        free(inode->file_data);
+        tmp_pages_truncate(&inode->file_pages, 0);
     }
     free(inode);
 }
@@ -59,6 +198,10 @@ static void tmp_inode_cleanup(struct tmp_inode *inode) {
 // ======== DIRECTORY ENTRIES ========
 // ===================================
 
+// A directory's children are kept twice: in a list in the order they were
+// created, which is the order readdir returns them in and what telldir and
+// seekdir's indexes refer to, and in a hash table by name for lookups.
+
 struct tmp_dirent {
     char name[MAX_NAME + 1];
     struct tmp_inode *inode;
@@ -67,17 +210,30 @@ struct tmp_dirent {
     struct tmp_dirent *parent;
     struct list children;
     unsigned long next_index;
+    struct list *buckets; // NULL until there's a child
+    unsigned bucket_count;
+    unsigned child_count;
 
     struct refcount refcount;
     lock_t lock;
     struct list dir;
+    struct list hash; // in the parent's buckets
+    uint32_t name_hash;
 };
 
+#define TMP_DIR_MIN_BUCKETS 8
+// more children per bucket than this on average and the table is doubled
+#define TMP_DIR_LOAD 2
+
 DEFINE_REFCOUNT_STATIC(tmp_dirent)
 
 static void tmp_dirent_cleanup(struct tmp_dirent *dirent) {
     list_remove(&dirent->dir); // TODO locking thinking emoji
+    list_remove_safe(&dirent->hash);
+    if (dirent->parent != NULL)
+        dirent->parent->child_count--;
     tmp_inode_release(dirent->inode);
+    free(dirent->buckets);
     free(dirent);
 }
 
@@ -85,9 +241,41 @@ static void tmp_dirent_init(struct tmp_dirent *dirent) {
     refcount_init(dirent);
     list_init(&dirent->children);
     dirent->next_index = 0;
+    dirent->buckets = NULL;
+    dirent->bucket_count = 0;
+    dirent->child_count = 0;
+    list_init(&dirent->hash);
     lock_init(&dirent->lock);
 }
 
+static uint32_t tmp_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char) *c) * 16777619;
+    return hash;
+}
+
+// Makes room in dir's hash table for another child. Must call with dir locked.
+static int tmp_dir_grow(struct tmp_dirent *dir) {
+    if (dir->buckets != NULL && dir->child_count < dir->bucket_count * TMP_DIR_LOAD)
+        return 0;
+    unsigned new_count = dir->bucket_count ? dir->bucket_count * 2 : TMP_DIR_MIN_BUCKETS;
+    struct list *new_buckets = malloc(new_count * sizeof(struct list));
+    if (new_buckets == NULL)
+        return dir->buckets != NULL ? 0 : _ENOMEM; // a full table still works
+    for (unsigned i = 0; i < new_count; i++)
+        list_init(&new_buckets[i]);
+    struct tmp_dirent *child;
+    list_for_each_entry(&dir->children, child, dir) {
+        list_remove(&child->hash);
+        list_add(&new_buckets[child->name_hash & (new_count - 1)], &child->hash);
+    }
+    free(dir->buckets);
+    dir->buckets = new_buckets;
+    dir->bucket_count = new_count;
+    return 0;
+}
+
 // Frees the child inode on failure, so you don't need to! But be careful you don't free it yourself.
 // In other words: Takes ownership of `child`
 static int tmpfs_dir_link(struct tmp_dirent *dir, const char *name, struct tmp_inode *child, struct tmp_dirent **dirent_out) {
@@ -96,17 +284,21 @@ static int tmpfs_dir_link(struct tmp_dirent *dir, const char *name, struct tmp_i
         return _ENOTDIR;
     }
     struct tmp_dirent *new_dirent = malloc(sizeof(struct tmp_dirent));
-    if (new_dirent == NULL) {
+    if (new_dirent == NULL || tmp_dir_grow(dir) < 0) {
+        free(new_dirent);
         tmp_inode_release(child);
         return _ENOMEM;
     }
 
     tmp_dirent_init(new_dirent);
     strcpy(new_dirent->name, name);
+    new_dirent->name_hash = tmp_name_hash(name);
     new_dirent->inode = tmp_inode_retain(child);
     new_dirent->index = dir->next_index++;
     new_dirent->parent = tmp_dirent_retain(dir);
     list_add_tail(&dir->children, &new_dirent->dir);
+    list_add(&dir->buckets[new_dirent->name_hash & (dir->bucket_count - 1)], &new_dirent->hash);
+    dir->child_count++;
 
     if (dirent_out)
         *dirent_out = tmp_dirent_retain(new_dirent);
@@ -124,12 +316,15 @@ static void tmpfs_fd_seekdir(struct fd *fd, struct tmp_dirent *dirent) {
 static struct tmp_dirent *tmpfs_dir_lookup(struct tmp_dirent *dir, const char *name) {
     if (!S_ISDIR(dir->inode->stat.mode))
         return ERR_PTR(_ENOTDIR);
+    if (dir->buckets == NULL)
+        return ERR_PTR(_ENOENT);
+    uint32_t hash = tmp_name_hash(name);
     struct tmp_dirent *dirent = NULL;
     struct tmp_dirent *d;
-    list_for_each_entry(&dir->children, d, dir) {
+    list_for_each_entry(&dir->buckets[hash & (dir->bucket_count - 1)], d, hash) {
         if (d->inode == NULL)
             continue;
-        if (strcmp(d->name, name) == 0) {
+        if (d->name_hash == hash && strcmp(d->name, name) == 0) {
             dirent = d;
             break;
         }
@@ -186,15 +381,52 @@ static struct tmp_dirent *tmpfs_lookup_parent(struct mount *mount, const char *p
     return __tmpfs_lookup(mount, path, true, filename_out);
 }
 
+// Growing only changes the size, the new part is a hole until it's written.
+// Shrinking frees the pages past the end.
 static int tmpfs_file_resize(struct tmp_inode *file, size_t size) {
     assert(S_ISREG(file->stat.mode));
+    struct tmp_pages *pages = &file->file_pages;
     size_t old_size = file->stat.size;
-    void *new_data = realloc(file->file_data, size);
-    if (new_data == NULL)
-        return _ENOMEM;
-    file->file_data = new_data;
+    // the part of the last page past the end could have been written through
+    // a mapping, and it has to read as zeroes if it becomes part of the file
+    size_t tail = size < old_size ? size : old_size;
+    if (PGOFFSET(tail) != 0) {
+        struct data *page = tmp_page_find(pages, PAGE(tail));
+        if (page != NULL)
+            memset((char *) page->data + PGOFFSET(tail), 0, PAGE_SIZE - PGOFFSET(tail));
+    }
+    if (size < old_size)
+        tmp_pages_truncate(pages, PAGE_ROUND_UP(size));
     file->stat.size = size;
-    memset((char *) file->file_data + old_size, 0, file->stat.size - old_size);
+    file->stat.blocks = pages->count * (PAGE_SIZE / 512);
+    return 0;
+}
+
+// Copies between buf and the file, which must already be big enough to write
+static int tmpfs_file_copy(struct tmp_inode *file, void *buf, size_t size, off_t_ off, bool write) {
+    while (size > 0) {
+        size_t chunk = PAGE_SIZE - PGOFFSET(off);
+        if (chunk > size)
+            chunk = size;
+        struct data *page;
+        if (write)
+            page = tmp_page_get(&file->file_pages, PAGE(off));
+        else
+            page = tmp_page_find(&file->file_pages, PAGE(off));
+        if (write && page == NULL)
+            return _ENOMEM;
+        if (write)
+            memcpy((char *) page->data + PGOFFSET(off), buf, chunk);
+        else if (page != NULL)
+            memcpy(buf, (char *) page->data + PGOFFSET(off), chunk);
+        else
+            memset(buf, 0, chunk);
+        buf = (char *) buf + chunk;
+        off += chunk;
+        size -= chunk;
+    }
+    if (write)
+        file->stat.blocks = file->file_pages.count * (PAGE_SIZE / 512);
     return 0;
 }
 
@@ -369,6 +601,7 @@ static int tmpfs_getpath(struct fd *fd, char *buf) {
             return _ENAMETOOLONG;
         p[0] = '/';
         memcpy(&p[1], dirent->name, name_len);
+        dirent = dirent->parent;
     }
     memmove(buf, p, strlen(p) + 1);
     return 0;
@@ -396,7 +629,7 @@ static ssize_t tmpfs_read(struct fd *fd, void *buf, size_t bufsize) {
         if (fd->offset >= inode->stat.size)
             bufsize = 0;
     }
-    memcpy(buf, inode->file_data + fd->offset, bufsize);
+    tmpfs_file_copy(inode, buf, bufsize, fd->offset, false);
     fd->offset += bufsize;
     res = bufsize;
 
@@ -419,15 +652,80 @@ static ssize_t tmpfs_write(struct fd *fd, const void *buf, size_t bufsize) {
         if (res < 0)
             goto out;
     }
-    memcpy(inode->file_data + fd->offset, buf, bufsize);
+    res = tmpfs_file_copy(inode, (void *) buf, bufsize, fd->offset, true);
+    if (res < 0)
+        goto out;
     fd->offset += bufsize;
     res = bufsize;
+    tmp_inode_touch(inode, true);
 
 out:
     unlock(&inode->lock);
     return res;
 }
 
+// Maps the file's own pages, so shared mappings see writes and each other.
+// Private mappings get them copy-on-write.
+static int tmpfs_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off_t offset, int prot, int flags) {
+    if (PGOFFSET(offset) != 0)
+        return _EINVAL;
+    struct tmp_inode *inode = tmpfs_fd_inode(fd);
+    if (!S_ISREG(inode->stat.mode))
+        return _ENODEV;
+    if (!(flags & MMAP_SHARED))
+        prot |= P_COW;
+
+    int err = 0;
+    lock(&inode->lock);
+    uint64_t end = PAGE_ROUND_UP(inode->stat.size);
+    for (pages_t i = 0; i < pages; i++) {
+        uint64_t index = PAGE(offset) + i;
+        if (index >= end) {
+            // past the end of the file, there's nothing to share
+            err = pt_map_nothing(mem, start + i, pages - i, prot & ~P_COW);
+            break;
+        }
+        struct data *page = tmp_page_get(&inode->file_pages, index);
+        if (page == NULL) {
+            err = _ENOMEM;
+            break;
+        }
+        pt_map_data(mem, start + i, 1, page, prot);
+    }
+    inode->stat.blocks = inode->file_pages.count * (PAGE_SIZE / 512);
+    unlock(&inode->lock);
+    return err;
+}
+
+static int tmpfs_fsetattr(struct fd *fd, struct attr attr) {
+    struct tmp_inode *inode = tmpfs_fd_inode(fd);
+    int err = 0;
+    lock(&inode->lock);
+    switch (attr.type) {
+        case attr_uid:
+            inode->stat.uid = attr.uid;
+            break;
+        case attr_gid:
+            inode->stat.gid = attr.gid;
+            break;
+        case attr_mode:
+            inode->stat.mode = (inode->stat.mode & S_IFMT) | (attr.mode & ~S_IFMT);
+            break;
+        case attr_size:
+            if (S_ISDIR(inode->stat.mode))
+                err = _EISDIR;
+            else if (attr.size < 0)
+                err = _EINVAL;
+            else
+                err = tmpfs_file_resize(inode, attr.size);
+            break;
+    }
+    if (err >= 0)
+        tmp_inode_touch(inode, attr.type == attr_size);
+    unlock(&inode->lock);
+    return err;
+}
+
 static off_t_ tmpfs_lseek(struct fd *fd, off_t_ off, int whence) {
     qword_t size = 0;
     if (whence == LSEEK_END) {
@@ -502,6 +800,7 @@ const struct fs_ops tmpfs = {
     .stat = tmpfs_stat,
     .fstat = tmpfs_fstat,
     .getpath = tmpfs_getpath,
+    .fsetattr = tmpfs_fsetattr,
     .mkdir = tmpfs_mkdir,
 };
 
@@ -509,6 +808,7 @@ const struct fd_ops tmpfs_fdops = {
     .read = tmpfs_read,
     .write = tmpfs_write,
     .lseek = tmpfs_lseek,
+    .mmap = tmpfs_mmap,
     .readdir = tmpfs_readdir,
     .telldir = tmpfs_telldir,
     .seekdir = tmpfs_seekdir,
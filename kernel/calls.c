@@ -48,7 +48,7 @@ syscall_t syscall_table[] = {
     [29]  = (syscall_t) sys_pause,
     [30]  = (syscall_t) sys_utime,
     [33]  = (syscall_t) sys_access,
-    [36]  = (syscall_t) syscall_success_stub, // sync
+    [36]  = (syscall_t) sys_sync,
     [37]  = (syscall_t) sys_kill,
     [38]  = (syscall_t) sys_rename,
     [39]  = (syscall_t) sys_mkdir,
@@ -229,6 +229,7 @@ syscall_t syscall_table[] = {
     [352] = (syscall_t) syscall_stub, // sched_getattr
     [353] = (syscall_t) sys_renameat2,
     [355] = (syscall_t) sys_getrandom,
+    [356] = (syscall_t) sys_memfd_create,
     [359] = (syscall_t) sys_socket,
     [360] = (syscall_t) sys_socketpair,
     [361] = (syscall_t) sys_bind,
@@ -248,6 +249,16 @@ syscall_t syscall_table[] = {
     [377] = (syscall_t) sys_copy_file_range,
     [383] = (syscall_t) sys_statx,
     [384] = (syscall_t) sys_arch_prctl,
+    [393] = (syscall_t) sys_semget,
+    [394] = (syscall_t) sys_semctl,
+    [395] = (syscall_t) sys_shmget,
+    [396] = (syscall_t) sys_shmctl,
+    [397] = (syscall_t) sys_shmat,
+    [398] = (syscall_t) sys_shmdt,
+    [399] = (syscall_t) sys_msgget,
+    [400] = (syscall_t) sys_msgsnd,
+    [401] = (syscall_t) sys_msgrcv,
+    [402] = (syscall_t) sys_msgctl,
     [422] = (syscall_t) syscall_silent_stub, // futex_time64
     [439] = (syscall_t) syscall_silent_stub, // faccessat2
 };
@@ -322,10 +333,13 @@ void handle_interrupt(int interrupt) {
 
     receive_signals();
     struct tgroup *group = current->group;
-    lock(&group->lock);
-    while (group->stopped)
-        wait_for_ignore_signals(&group->stopped_cond, &group->lock, NULL);
-    unlock(&group->lock);
+    // only worth taking the lock if the group looks stopped
+    if (__atomic_load_n(&group->stopped, __ATOMIC_RELAXED)) {
+        lock(&group->lock);
+        while (group->stopped)
+            wait_for_ignore_signals(&group->stopped_cond, &group->lock, NULL);
+        unlock(&group->lock);
+    }
 }
 
 void dump_maps(void) {
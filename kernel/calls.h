@@ -105,6 +105,8 @@ int_t sys_epoll_pwait(fd_t epoll_f, addr_t events_addr, int_t max_events, int_t
 int_t sys_eventfd2(uint_t initval, int_t flags);
 int_t sys_eventfd(uint_t initval);
 
+fd_t sys_memfd_create(addr_t name_addr, uint_t flags);
+
 // file management
 fd_t sys_open(addr_t path_addr, dword_t flags, mode_t_ mode);
 fd_t sys_openat(fd_t at, addr_t path_addr, dword_t flags, mode_t_ mode);
@@ -152,7 +154,7 @@ dword_t sys_umask(dword_t mask);
 dword_t sys_sendfile(fd_t out_fd, fd_t in_fd, addr_t offset_addr, dword_t count);
 dword_t sys_sendfile64(fd_t out_fd, fd_t in_fd, addr_t offset_addr, dword_t count);
 dword_t sys_splice(fd_t in_fd, addr_t in_off_addr, fd_t out_fd, addr_t out_off_addr, dword_t count, dword_t flags);
-dword_t sys_copy_file_range(fd_t in_fd, addr_t in_off, fd_t out_fd, addr_t out_off, dword_t len, uint_t flags);
+dword_t sys_copy_file_range(fd_t in_fd, addr_t in_off_addr, fd_t out_fd, addr_t out_off_addr, dword_t len, uint_t flags);
 
 dword_t sys_statfs(addr_t path_addr, addr_t buf_addr);
 dword_t sys_statfs64(addr_t path_addr, dword_t buf_size, addr_t buf_addr);
@@ -167,6 +169,7 @@ dword_t sys_statx(fd_t at_f, addr_t path_addr, int_t flags, uint_t mask, addr_t
 #define MS_SILENT_ (1 << 15)
 dword_t sys_mount(addr_t source_addr, addr_t target_addr, addr_t type_addr, dword_t flags, addr_t data_addr);
 dword_t sys_umount2(addr_t target_addr, dword_t flags);
+dword_t sys_sync(void);
 
 dword_t sys_xattr_stub(addr_t path_addr, addr_t name_addr, addr_t value_addr, dword_t size, dword_t flags);
 
@@ -253,7 +256,21 @@ int_t sys_get_robust_list(pid_t_ pid, addr_t robust_list_ptr, addr_t len_ptr);
 // misc
 dword_t sys_getrandom(addr_t buf_addr, dword_t len, dword_t flags);
 int_t sys_syslog(int_t type, addr_t buf_addr, int_t len);
+
+// sysv ipc
 int_t sys_ipc(uint_t call, int_t first, int_t second, int_t third, addr_t ptr, int_t fifth);
+int_t sys_shmget(int_t key, uint_t size, int_t flags);
+addr_t sys_shmat(int_t id, addr_t addr, int_t flags);
+int_t sys_shmdt(addr_t addr);
+int_t sys_shmctl(int_t id, int_t cmd, addr_t buf_addr);
+int_t sys_semget(int_t key, int_t nsems, int_t flags);
+int_t sys_semop(int_t id, addr_t sops_addr, uint_t nsops);
+int_t sys_semtimedop(int_t id, addr_t sops_addr, uint_t nsops, addr_t timeout_addr);
+int_t sys_semctl(int_t id, int_t num, int_t cmd, dword_t arg);
+int_t sys_msgget(int_t key, int_t flags);
+int_t sys_msgsnd(int_t id, addr_t msg_addr, uint_t size, int_t flags);
+int_t sys_msgrcv(int_t id, addr_t msg_addr, uint_t size, int_t type, int_t flags);
+int_t sys_msgctl(int_t id, int_t cmd, addr_t buf_addr);
 
 typedef int (*syscall_t)(dword_t, dword_t, dword_t, dword_t, dword_t, dword_t);
 
@@ -42,6 +42,8 @@ int_t sys_epoll_ctl(fd_t epoll_f, int_t op, fd_t f, addr_t event_addr) {
     struct fd *fd = f_get(f);
     if (fd == NULL)
         return _EBADF;
+    if (fd == epoll)
+        return _EINVAL;
 
     if (op == EPOLL_CTL_DEL_)
         return poll_del_fd(epoll->epollfd.poll, fd);
@@ -51,6 +53,8 @@ int_t sys_epoll_ctl(fd_t epoll_f, int_t op, fd_t f, addr_t event_addr) {
         return _EFAULT;
     STRACE(" {events: %#x, data: %#x}", event.events, event.data);
 
+    if (op != EPOLL_CTL_ADD_ && op != EPOLL_CTL_MOD_)
+        return _EINVAL;
     if (op == EPOLL_CTL_ADD_) {
         if (poll_has_fd(epoll->epollfd.poll, fd))
             return _EEXIST;
@@ -68,8 +72,9 @@ struct epoll_context {
 
 static int epoll_callback(void *context, int types, union poll_fd_info info) {
     struct epoll_context *c = context;
+    // leave the rest for the next epoll_wait
     if (c->n >= c->max_events)
-        return 0;
+        return -1;
     c->events[c->n++] = (struct epoll_event_) {.events = types, .data = info.num};
     return 1;
 }
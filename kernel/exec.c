@@ -13,6 +13,7 @@
 #include "kernel/calls.h"
 #include "kernel/random.h"
 #include "kernel/errno.h"
+#include "kernel/futex.h"
 #include "fs/fd.h"
 #include "kernel/elf.h"
 #include "kernel/vdso.h"
@@ -74,6 +75,164 @@ static int read_prg_headers(struct fd *fd, struct elf_header header, struct prg_
     return 0;
 }
 
+// Parsed headers of recently executed files, so running the same binary over
+// and over (which is most of what a shell script does) skips reading and
+// checking the headers and looking for the interpreter. Entries are keyed by
+// the file's identity plus its size and times, so a file that's been changed
+// since it was parsed gets parsed again.
+struct elf_image_key {
+    struct mount *mount;
+    qword_t dev;
+    qword_t inode;
+    qword_t size;
+    dword_t mtime, mtime_nsec;
+    dword_t ctime, ctime_nsec;
+};
+
+struct elf_image {
+    struct elf_image_key key;
+    bool cached;
+    unsigned refcount; // protected by elf_cache_lock
+    struct list lru;
+
+    struct elf_header header;
+    struct prg_header *ph;
+    char *interp_name; // NULL if there's no PT_INTERP
+    // pages from the start of the first PT_LOAD to the end of the last
+    pages_t load_size;
+};
+
+#define ELF_CACHE_MAX 16
+static lock_t elf_cache_lock = LOCK_INITIALIZER;
+static struct list elf_cache = LIST_INITIALIZER(elf_cache);
+static unsigned elf_cache_count;
+
+static bool elf_image_key_equal(struct elf_image_key *a, struct elf_image_key *b) {
+    return a->mount == b->mount && a->dev == b->dev && a->inode == b->inode
+        && a->size == b->size
+        && a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec
+        && a->ctime == b->ctime && a->ctime_nsec == b->ctime_nsec;
+}
+
+static void elf_image_free(struct elf_image *image) {
+    free(image->ph);
+    free(image->interp_name);
+    free(image);
+}
+
+static void elf_image_release(struct elf_image *image) {
+    lock(&elf_cache_lock);
+    bool last = --image->refcount == 0;
+    unlock(&elf_cache_lock);
+    if (last)
+        elf_image_free(image);
+}
+
+static int elf_image_parse(struct fd *fd, struct elf_image *image) {
+    int err;
+    if ((err = read_header(fd, &image->header)) < 0)
+        return err;
+    if ((err = read_prg_headers(fd, image->header, &image->ph)) < 0)
+        return err;
+
+    struct prg_header *ph = image->ph;
+    struct prg_header *first = NULL, *last = NULL;
+    for (unsigned i = 0; i < image->header.phent_count; i++) {
+        if (ph[i].type == PT_LOAD) {
+            if (first == NULL)
+                first = &ph[i];
+            last = &ph[i];
+        }
+        if (ph[i].type != PT_INTERP)
+            continue;
+        if (image->interp_name) {
+            // can't have two interpreters
+            return _EINVAL;
+        }
+
+        image->interp_name = malloc(ph[i].filesize + 1);
+        if (image->interp_name == NULL)
+            return _ENOMEM;
+        image->interp_name[ph[i].filesize] = '\0';
+
+        // read the interpreter name out of the file
+        if (fd->ops->lseek(fd, ph[i].offset, SEEK_SET) < 0)
+            return _EIO;
+        if (fd->ops->read(fd, image->interp_name, ph[i].filesize) != ph[i].filesize)
+            return _EIO;
+    }
+
+    image->load_size = 0;
+    if (first != NULL)
+        image->load_size = PAGE_ROUND_UP(last->vaddr + last->memsize) - PAGE(first->vaddr);
+    return 0;
+}
+
+// Returns the parsed headers of the file, from the cache if they're there.
+// Release them with elf_image_release.
+static int elf_image_get(struct fd *fd, struct elf_image **image_out) {
+    struct statbuf stat;
+    bool cacheable = fd->mount->fs->fstat(fd, &stat) >= 0
+        && (stat.mode & S_IFMT) == S_IFREG && stat.inode != 0;
+    struct elf_image_key key = {
+        .mount = fd->mount,
+        .dev = stat.dev,
+        .inode = stat.inode,
+        .size = stat.size,
+        .mtime = stat.mtime, .mtime_nsec = stat.mtime_nsec,
+        .ctime = stat.ctime, .ctime_nsec = stat.ctime_nsec,
+    };
+
+    struct elf_image *image;
+    if (cacheable) {
+        lock(&elf_cache_lock);
+        list_for_each_entry(&elf_cache, image, lru) {
+            if (elf_image_key_equal(&image->key, &key)) {
+                image->refcount++;
+                list_remove(&image->lru);
+                list_add(&elf_cache, &image->lru);
+                unlock(&elf_cache_lock);
+                *image_out = image;
+                return 0;
+            }
+        }
+        unlock(&elf_cache_lock);
+    }
+
+    image = calloc(1, sizeof(struct elf_image));
+    if (image == NULL)
+        return _ENOMEM;
+    int err = elf_image_parse(fd, image);
+    if (err < 0) {
+        elf_image_free(image);
+        return err;
+    }
+    image->key = key;
+    image->refcount = 1;
+
+    if (cacheable) {
+        lock(&elf_cache_lock);
+        // the cache holds a reference too
+        image->refcount++;
+        image->cached = true;
+        list_add(&elf_cache, &image->lru);
+        struct elf_image *old = NULL;
+        if (++elf_cache_count > ELF_CACHE_MAX) {
+            old = list_entry(elf_cache.prev, struct elf_image, lru);
+            list_remove(&old->lru);
+            old->cached = false;
+            elf_cache_count--;
+            if (--old->refcount != 0)
+                old = NULL;
+        }
+        unlock(&elf_cache_lock);
+        if (old != NULL)
+            elf_image_free(old);
+    }
+    *image_out = image;
+    return 0;
+}
+
 static int load_entry(struct prg_header ph, addr_t bias, struct fd *fd) {
     int err;
 
@@ -89,9 +248,7 @@ static int load_entry(struct prg_header ph, addr_t bias, struct fd *fd) {
                     PAGE_ROUND_UP(filesize + PGOFFSET(addr)),
                     offset - PGOFFSET(addr), flags, MMAP_PRIVATE)) < 0)
         return err;
-    // TODO find a better place for these to avoid code duplication
-    mem_pt(current->mem, PAGE(addr))->data->fd = fd_retain(fd);
-    mem_pt(current->mem, PAGE(addr))->data->file_offset = offset - PGOFFSET(addr);
+    pt_set_file(current->mem, PAGE(addr), fd, offset - PGOFFSET(addr));
 
     if (memsize > filesize) {
         // put zeroes between addr + filesize and addr + memsize, call that bss
@@ -124,77 +281,35 @@ static int load_entry(struct prg_header ph, addr_t bias, struct fd *fd) {
     return 0;
 }
 
-static addr_t find_hole_for_elf(struct elf_header *header, struct prg_header *ph) {
-    struct prg_header *first = NULL, *last = NULL;
-    for (int i = 0; i < header->phent_count; i++) {
-        if (ph[i].type == PT_LOAD) {
-            if (first == NULL)
-                first = &ph[i];
-            last = &ph[i];
-        }
-    }
-    pages_t size = 0;
-    if (first != NULL) {
-        pages_t a = PAGE_ROUND_UP(last->vaddr + last->memsize);
-        pages_t b = PAGE(first->vaddr);
-        size = a - b;
-    }
-    return pt_find_hole(current->mem, size) << PAGE_BITS;
-}
-
 static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, struct exec_args envp) {
     int err = 0;
 
     // read the headers
-    struct elf_header header;
-    if ((err = read_header(fd, &header)) < 0)
-        return err;
-    struct prg_header *ph;
-    if ((err = read_prg_headers(fd, header, &ph)) < 0)
+    struct elf_image *image;
+    if ((err = elf_image_get(fd, &image)) < 0)
         return err;
+    struct elf_header header = image->header;
+    struct prg_header *ph = image->ph;
 
-    // look for an interpreter
-    char *interp_name = NULL;
+    // open the interpreter and read its headers
+    const char *interp_name = image->interp_name;
     struct fd *interp_fd = NULL;
-    struct elf_header interp_header;
-    struct prg_header *interp_ph = NULL;
-    for (unsigned i = 0; i < header.phent_count; i++) {
-        if (ph[i].type != PT_INTERP)
-            continue;
-        if (interp_name) {
-            // can't have two interpreters
-            err = _EINVAL;
-            goto out_free_interp;
-        }
-
-        interp_name = malloc(ph[i].filesize);
-        err = _ENOMEM;
-        if (interp_name == NULL)
-            goto out_free_ph;
-
-        // read the interpreter name out of the file
-        err = _EIO;
-        if (fd->ops->lseek(fd, ph[i].offset, SEEK_SET) < 0)
-            goto out_free_interp;
-        if (fd->ops->read(fd, interp_name, ph[i].filesize) != ph[i].filesize)
-            goto out_free_interp;
-
-        // open interpreter and read headers
+    struct elf_image *interp = NULL;
+    if (interp_name) {
         interp_fd = generic_open(interp_name, O_RDONLY, 0);
         if (IS_ERR(interp_fd)) {
             err = PTR_ERR(interp_fd);
             goto out_free_interp;
         }
-        if ((err = read_header(interp_fd, &interp_header)) < 0) {
-            if (err == _ENOEXEC) err = _ELIBBAD;
-            goto out_free_interp;
-        }
-        if ((err = read_prg_headers(interp_fd, interp_header, &interp_ph)) < 0) {
+        if ((err = elf_image_get(interp_fd, &interp)) < 0) {
             if (err == _ENOEXEC) err = _ELIBBAD;
             goto out_free_interp;
         }
     }
 
+    // the robust futexes are in the memory that's about to go away
+    futex_exit_robust_list();
+
     // free the process's memory.
     // from this point on, if any error occurs the process will have to be
     // killed before it even starts. please don't be too sad about it, it's
@@ -225,7 +340,7 @@ static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, stru
             if (interp_name)
                 bias = 0x56555000; // I have no idea how this number was arrived at
             else
-                bias = find_hole_for_elf(&header, ph);
+                bias = pt_find_hole(current->mem, image->load_size) << PAGE_BITS;
         }
 
         if ((err = load_entry(ph[i], bias, fd)) < 0)
@@ -248,40 +363,35 @@ static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, stru
 
     if (interp_name) {
         // map dat shit! interpreter edition
-        interp_base = find_hole_for_elf(&interp_header, interp_ph);
-        for (int i = interp_header.phent_count - 1; i >= 0; i--) {
-            if (interp_ph[i].type != PT_LOAD)
+        interp_base = pt_find_hole(current->mem, interp->load_size) << PAGE_BITS;
+        for (int i = interp->header.phent_count - 1; i >= 0; i--) {
+            if (interp->ph[i].type != PT_LOAD)
                 continue;
-            if ((err = load_entry(interp_ph[i], interp_base, interp_fd)) < 0)
+            if ((err = load_entry(interp->ph[i], interp_base, interp_fd)) < 0)
                 goto beyond_hope;
         }
-        entry = interp_base + interp_header.entry_point;
+        entry = interp_base + interp->header.entry_point;
     }
 
-    // map vdso
+    // map vdso, and the vvar pages right before it where the vdso looks for them
     err = _ENOMEM;
     pages_t vdso_pages = sizeof(vdso_data) >> PAGE_BITS;
     // FIXME disgusting hack: musl's dynamic linker has a one-page hole, and
     // I'd rather not put the vdso in that hole. so find a two-page hole and
     // add one.
-    page_t vdso_page = pt_find_hole(current->mem, vdso_pages + 1);
-    if (vdso_page == BAD_PAGE)
+    page_t vvar_page = pt_find_hole(current->mem, VVAR_PAGES + vdso_pages + 1);
+    if (vvar_page == BAD_PAGE)
+        goto beyond_hope;
+    vvar_page += 1;
+    if ((err = vvar_map(current->mem, vvar_page)) < 0)
         goto beyond_hope;
-    vdso_page += 1;
+    page_t vdso_page = vvar_page + VVAR_PAGES;
     if ((err = pt_map(current->mem, vdso_page, vdso_pages, (void *) vdso_data, 0, 0)) < 0)
         goto beyond_hope;
     mem_pt(current->mem, vdso_page)->data->name = "[vdso]";
     current->mm->vdso = vdso_page << PAGE_BITS;
     addr_t vdso_entry = current->mm->vdso + ((struct elf_header *) vdso_data)->entry_point;
 
-    // map 3 empty "vvar" pages to satisfy ptraceomatic
-    page_t vvar_page = pt_find_hole(current->mem, VVAR_PAGES);
-    if (vvar_page == BAD_PAGE)
-        goto beyond_hope;
-    if ((err = pt_map_nothing(current->mem, vvar_page, VVAR_PAGES, 0)) < 0)
-        goto beyond_hope;
-    mem_pt(current->mem, vvar_page)->data->name = "[vvar]";
-
     // STACK TIME!
 
     // allocate 1 page of stack at 0xffffd, and let it grow down
@@ -299,26 +409,26 @@ static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, stru
     // filename, argc, argv
     addr_t file_addr = sp = copy_string(sp, file);
     if (sp == 0)
-        goto beyond_hope;
+        goto beyond_hope_unlocked;
     addr_t envp_addr = sp = args_copy(sp, envp);
     if (sp == 0)
-        goto beyond_hope;
+        goto beyond_hope_unlocked;
     current->mm->argv_end = sp;
     addr_t argv_addr = sp = args_copy(sp, argv);
     if (sp == 0)
-        goto beyond_hope;
+        goto beyond_hope_unlocked;
     current->mm->argv_start = sp;
     sp = align_stack(sp);
 
     addr_t platform_addr = sp = copy_string(sp, "i686");
     if (sp == 0)
-        goto beyond_hope;
+        goto beyond_hope_unlocked;
     // 16 random bytes so no system call is needed to seed a userspace RNG
     char random[16] = {};
     get_random(random, sizeof(random)); // if this fails, eh, no one's really using it
     addr_t random_addr = sp -= sizeof(random);
     if (user_put(sp, random))
-        goto beyond_hope;
+        goto beyond_hope_unlocked;
 
     // the way linux aligns the stack at this point is kinda funky
     // calculate how much space is needed for argv, envp, and auxv, subtract
@@ -357,14 +467,14 @@ static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, stru
 
     // argc
     if (user_put(p, argv.count))
-        return _EFAULT;
+        goto beyond_hope_unlocked;
     p += sizeof(dword_t);
 
     // argv
     size_t argc = argv.count;
     while (argc-- > 0) {
         if (user_put(p, argv_addr))
-            return _EFAULT;
+            goto beyond_hope_unlocked;
         argv_addr += user_strlen(argv_addr) + 1;
         p += sizeof(dword_t); // null terminator
     }
@@ -374,7 +484,7 @@ static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, stru
     size_t envc = envp.count;
     while (envc-- > 0) {
         if (user_put(p, envp_addr))
-            return _EFAULT;
+            goto beyond_hope_unlocked;
         envp_addr += user_strlen(envp_addr) + 1;
         p += sizeof(dword_t);
     }
@@ -383,7 +493,7 @@ static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, stru
     // copy auxv
     current->mm->auxv_start = p;
     if (user_put(p, aux))
-        goto beyond_hope;
+        goto beyond_hope_unlocked;
     p += sizeof(aux);
     current->mm->auxv_end = p;
 
@@ -408,19 +518,17 @@ static int elf_exec(struct fd *fd, const char *file, struct exec_args argv, stru
 
     err = 0;
 out_free_interp:
-    if (interp_name != NULL)
-        free(interp_name);
+    if (interp != NULL)
+        elf_image_release(interp);
     if (interp_fd != NULL && !IS_ERR(interp_fd))
         fd_close(interp_fd);
-    if (interp_ph != NULL)
-        free(interp_ph);
-out_free_ph:
-    free(ph);
+    elf_image_release(image);
     return err;
 
 beyond_hope:
-    // TODO force sigsegv
     write_wrunlock(&current->mem->lock);
+beyond_hope_unlocked:
+    // TODO force sigsegv
     goto out_free_interp;
 }
 
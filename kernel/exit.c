@@ -21,7 +21,7 @@ static bool exit_tgroup(struct task *task) {
         if (group->itimer)
             timer_free(group->itimer);
 
-        // The group will be removed from its group and session by reap_if_zombie,
+        // The group will be removed from its group and session by release_zombie,
         // because fish tries to set the pgid to that of an exited but not reaped
         // task.
         // https://github.com/Microsoft/WSL/issues/2786
@@ -34,14 +34,45 @@ void (*exit_hook)(struct task *task, int code) = NULL;
 static struct task *find_new_parent(struct task *task) {
     struct task *new_parent;
     list_for_each_entry(&task->group->threads, new_parent, group_links) {
-        if (!new_parent->exiting)
+        if (new_parent != task && !new_parent->exiting)
             return new_parent;
     }
     return pid_get_task(1);
 }
 
+// Gives the task's children to another thread in its group, or to init if
+// there isn't one. Must be called with pids_lock.
+static void reparent_children(struct task *task) {
+    struct task *new_parent = find_new_parent(task);
+    struct tgroup *group = task->group;
+    struct tgroup *new_group = new_parent->group;
+    lock(&group->children_lock);
+    if (new_group != group)
+        lock(&new_group->children_lock);
+
+    bool zombies = false;
+    struct task *child, *tmp;
+    list_for_each_entry_safe(&group->children, child, tmp, siblings) {
+        if (child->parent != task)
+            continue;
+        child->parent = new_parent;
+        if (new_group != group) {
+            list_remove(&child->siblings);
+            list_add(&new_group->children, &child->siblings);
+        }
+        zombies |= child->zombie;
+    }
+    if (zombies && new_group != group)
+        notify(&new_group->child_exit);
+
+    if (new_group != group)
+        unlock(&new_group->children_lock);
+    unlock(&group->children_lock);
+}
+
 noreturn void do_exit(int status) {
-    // has to happen before mm_release
+    // these have to happen before mm_release
+    futex_exit_robust_list();
     addr_t clear_tid = current->clear_tid;
     if (clear_tid) {
         pid_t_ zero = 0;
@@ -50,8 +81,11 @@ noreturn void do_exit(int status) {
     }
 
     // release all our resources
+    // general_lock protects current->mm, see the comment in exec
+    lock(&current->general_lock);
     mm_release(current->mm);
     current->mm = NULL;
+    unlock(&current->general_lock);
     fdtable_release(current->files);
     current->files = NULL;
     fs_info_release(current->fs);
@@ -59,8 +93,9 @@ noreturn void do_exit(int status) {
     // sighand must be released below so it can be protected by pids_lock
     // since it can be accessed by other threads
 
-    // save things that our parent might be interested in
-    current->exit_code = status; // FIXME locking
+    // save things that our parent might be interested in, nobody looks at
+    // exit_code until zombie is set
+    current->exit_code = status;
     struct rusage_ rusage = rusage_get_current();
     lock(&current->group->lock);
     rusage_add(&current->group->rusage, &rusage);
@@ -69,36 +104,34 @@ noreturn void do_exit(int status) {
 
     // the actual freeing needs pids_lock
     lock(&pids_lock);
+    // this has to come before releasing the sighand, since children that
+    // have locked us with task_lock_parent might still send us SIGCHLD
+    reparent_children(current);
     current->exiting = true;
     // release the sighand
     sighand_release(current->sighand);
     current->sighand = NULL;
-    struct sigqueue *sigqueue, *sigqueue_tmp;
-    list_for_each_entry_safe(&current->queue, sigqueue, sigqueue_tmp, queue) {
-        list_remove(&sigqueue->queue);
-        free(sigqueue);
-    }
+    // the queue is all in the task
+    list_init(&current->queue);
     struct task *leader = current->group->leader;
+    if (current != leader)
+        task_leave_parent(current);
 
-    // reparent children
-    struct task *new_parent = find_new_parent(current);
-    struct task *child, *tmp;
-    list_for_each_entry_safe(&current->children, child, tmp, siblings) {
-        child->parent = new_parent;
-        list_remove(&child->siblings);
-        list_add(&new_parent->children, &child->siblings);
-    }
-
+    struct task *parent = NULL;
+    struct siginfo_ info;
     if (exit_tgroup(current)) {
         // notify parent that we died
-        struct task *parent = leader->parent;
+        parent = leader->parent;
         if (parent == NULL) {
             // init died
             halt_system();
         } else {
+            // keeping this locked until the signal is sent means the parent
+            // can't exit in between
+            lock(&parent->group->children_lock);
             leader->zombie = true;
             notify(&parent->group->child_exit);
-            struct siginfo_ info = {
+            info = (struct siginfo_) {
                 .code = SI_KERNEL_,
                 .child.pid = current->pid,
                 .child.uid = current->uid,
@@ -106,8 +139,6 @@ noreturn void do_exit(int status) {
                 .child.utime = clock_from_timeval(group_rusage.utime),
                 .child.stime = clock_from_timeval(group_rusage.stime),
             };
-            if (leader->exit_signal != 0)
-                send_signal(parent, leader->exit_signal, info);
         }
 
         if (exit_hook != NULL)
@@ -119,6 +150,13 @@ noreturn void do_exit(int status) {
         task_destroy(current);
     unlock(&pids_lock);
 
+    if (parent != NULL) {
+        // the leader can't be reaped until this is unlocked either
+        if (leader->exit_signal != 0)
+            send_signal(parent, leader->exit_signal, info);
+        unlock(&parent->group->children_lock);
+    }
+
     pthread_exit(NULL);
 }
 
@@ -150,7 +188,7 @@ noreturn void do_exit_group(int status) {
 static void halt_system(void) {
     for (int state = 0; state < 3; state++) {
         int tasks_found = 0;
-        for (int i = 2; i < MAX_PID; i++) {
+        for (dword_t i = pid_next(1); i != 0; i = pid_next(i)) {
             struct task *task = pid_get_task(i);
             if (task != NULL) {
                 tasks_found++;
@@ -202,8 +240,11 @@ dword_t sys_exit_group(dword_t status) {
 #define P_PID_ 1
 #define P_PGID_ 2
 
-// returns false if the task cannot be reaped and true if the task was reaped
-static bool reap_if_zombie(struct task *task, struct siginfo_ *info_out, struct rusage_ *rusage_out, int options) {
+// returns false if the task cannot be reaped and true if the task was reaped.
+// Must be called with current->group->children_lock. A reaped task is taken
+// off the children list and returned in reaped_out, the rest of the teardown
+// is done by release_zombie once that lock is dropped.
+static bool reap_if_zombie(struct task *task, struct siginfo_ *info_out, struct rusage_ *rusage_out, int options, struct task **reaped_out) {
     if (!task->zombie)
         return false;
     lock(&task->group->lock);
@@ -228,6 +269,14 @@ static bool reap_if_zombie(struct task *task, struct siginfo_ *info_out, struct
     if (options & WNOWAIT_)
         return true;
 
+    // nobody else can find it to wait for it now
+    list_remove(&task->siblings);
+    *reaped_out = task;
+    return true;
+}
+
+static void release_zombie(struct task *task) {
+    lock(&pids_lock);
     // tear down group
     cond_destroy(&task->group->child_exit);
     task_leave_session(task);
@@ -235,7 +284,7 @@ static bool reap_if_zombie(struct task *task, struct siginfo_ *info_out, struct
     free(task->group);
 
     task_destroy(task);
-    return true;
+    unlock(&pids_lock);
 }
 
 static bool notify_if_stopped(struct task *task, struct siginfo_ *info_out) {
@@ -250,10 +299,10 @@ static bool notify_if_stopped(struct task *task, struct siginfo_ *info_out) {
     return true;
 }
 
-static bool reap_if_needed(struct task *task, struct siginfo_ *info_out, struct rusage_ *rusage_out, int options) {
+static bool reap_if_needed(struct task *task, struct siginfo_ *info_out, struct rusage_ *rusage_out, int options, struct task **reaped_out) {
     assert(task_is_leader(task));
     if ((options & WUNTRACED_ && notify_if_stopped(task, info_out)) ||
-        (options & WEXITED_ && reap_if_zombie(task, info_out, rusage_out, options))) {
+        (options & WEXITED_ && reap_if_zombie(task, info_out, rusage_out, options, reaped_out))) {
         info_out->sig = SIGCHLD_;
         return true;
     }
@@ -277,42 +326,33 @@ int do_wait(int idtype, pid_t_ id, struct siginfo_ *info, struct rusage_ *rusage
     if (options & ~(WNOHANG_|WUNTRACED_|WEXITED_|WCONTINUED_|WNOWAIT_|__WALL_))
         return _EINVAL;
 
-    lock(&pids_lock);
+    struct tgroup *group = current->group;
+    lock(&group->children_lock);
     int err;
     bool got_signal = false;
+    struct task *reaped = NULL;
 
-retry:
-    if (idtype != P_PID_) {
-        // look for a zombie child
-        bool no_children = true;
-        struct task *parent;
-        list_for_each_entry(&current->group->threads, parent, group_links) {
-            struct task *task;
-            list_for_each_entry(&current->children, task, siblings) {
-                if (!task_is_leader(task))
-                    continue;
-                if (idtype == P_PGID_ && task->group->pgid != id)
-                    continue;
-                no_children = false;
-                info->child.pid = task->pid;
-                if (reap_if_needed(task, info, rusage, options))
-                    goto found_something;
-            }
-        }
-        err = _ECHILD;
-        if (no_children)
-            goto error;
-    } else {
-        // check if this child is a zombie
-        struct task *task = pid_get_task_zombie(id);
-        err = _ECHILD;
-        if (task == NULL || task->parent == NULL || task->parent->group != current->group)
-            goto error;
-        task = task->group->leader;
-        info->child.pid = id;
-        if (reap_if_needed(task, info, rusage, options))
+retry:;
+    // look for a child with something to report
+    bool no_children = true;
+    struct task *task;
+    list_for_each_entry(&group->children, task, siblings) {
+        if (!task_is_leader(task))
+            continue;
+        if (idtype == P_PID_ && task->pid != id)
+            continue;
+        // pgid is really locked by pids_lock, but a racing setpgid could
+        // just as well have happened before or after the wait
+        if (idtype == P_PGID_ && task->group->pgid != id)
+            continue;
+        no_children = false;
+        info->child.pid = task->pid;
+        if (reap_if_needed(task, info, rusage, options, &reaped))
             goto found_something;
     }
+    err = _ECHILD;
+    if (no_children)
+        goto error;
 
     // WNOHANG leaves the info in an implementation-defined state. set the pid
     // to 0 so wait4 can pass that along correctly.
@@ -327,7 +367,7 @@ retry:
         goto error;
 
     // no matching zombie found, wait for one
-    if (wait_for(&current->group->child_exit, &pids_lock, NULL)) {
+    if (wait_for(&group->child_exit, &group->children_lock, NULL)) {
         // maybe we got a SIGCHLD! go through the loop one more time to make
         // sure the newly exited process is returned in that case.
         got_signal = true;
@@ -335,13 +375,14 @@ retry:
     }
     goto retry;
 
-    info->sig = SIGCHLD_;
 found_something:
-    unlock(&pids_lock);
+    unlock(&group->children_lock);
+    if (reaped != NULL)
+        release_zombie(reaped);
     return 0;
 
 error:
-    unlock(&pids_lock);
+    unlock(&group->children_lock);
     return err;
 }
 
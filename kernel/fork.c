@@ -47,6 +47,8 @@ static struct tgroup *tgroup_copy(struct tgroup *old_group) {
     group->itimer = NULL;
     group->doing_group_exit = false;
     group->children_rusage = (struct rusage_) {};
+    list_init(&group->children);
+    lock_init(&group->children_lock);
     cond_init(&group->child_exit);
     cond_init(&group->stopped_cond);
     lock_init(&group->lock);
@@ -157,6 +159,7 @@ dword_t sys_clone(dword_t flags, addr_t stack, addr_t ptid, addr_t tls, addr_t c
         // FIXME: task_destroy doesn't free all aspects of the task, which
         // could cause leaks
         lock(&pids_lock);
+        task_leave_parent(task);
         task_destroy(task);
         unlock(&pids_lock);
         return err;
@@ -8,6 +8,8 @@
 #include "fs/fd.h"
 #include "fs/path.h"
 #include "fs/dev.h"
+#include "fs/poll.h"
+#include "fs/real.h"
 
 static struct fd *at_fd(fd_t f) {
     if (f == AT_FDCWD_)
@@ -209,10 +211,7 @@ dword_t sys_mknod(addr_t path_addr, mode_t_ mode, dev_t_ dev) {
     return sys_mknodat(AT_FDCWD_, path_addr, mode, dev);
 }
 
-static ssize_t sys_read_buf(fd_t fd_no, void *buf, size_t size) {
-    struct fd *fd = f_get(fd_no);
-    if (fd == NULL)
-        return _EBADF;
+static ssize_t fd_read(struct fd *fd, void *buf, size_t size) {
     if (S_ISDIR(fd->type))
         return _EISDIR;
 
@@ -227,7 +226,15 @@ static ssize_t sys_read_buf(fd_t fd_no, void *buf, size_t size) {
     } else {
         return _EBADF;
     }
+    return res;
+}
+
+static ssize_t sys_read_buf(fd_t fd_no, void *buf, size_t size) {
+    struct fd *fd = f_get(fd_no);
+    if (fd == NULL)
+        return _EBADF;
 
+    ssize_t res = fd_read(fd, buf, size);
     if (res >= 0) {
         size_t print_size = res;
         if (print_size > 100) print_size = 100;
@@ -250,11 +257,7 @@ dword_t sys_read(fd_t fd_no, addr_t buf_addr, dword_t size) {
     return res;
 }
 
-static ssize_t sys_write_buf(fd_t fd_no, void *buf, size_t size) {
-    struct fd *fd = f_get(fd_no);
-    if (fd == NULL)
-        return _EBADF;
-
+static ssize_t fd_write(struct fd *fd, const void *buf, size_t size) {
     ssize_t res;
     if (fd->ops->write) {
         res = fd->ops->write(fd, buf, size);
@@ -269,6 +272,13 @@ static ssize_t sys_write_buf(fd_t fd_no, void *buf, size_t size) {
     return res;
 }
 
+static ssize_t sys_write_buf(fd_t fd_no, void *buf, size_t size) {
+    struct fd *fd = f_get(fd_no);
+    if (fd == NULL)
+        return _EBADF;
+    return fd_write(fd, buf, size);
+}
+
 dword_t sys_write(fd_t fd_no, addr_t buf_addr, dword_t size) {
     // FIXME this is a DOS vector, should ideally use vectorized I/O
     char *buf = malloc(size);
@@ -414,14 +424,7 @@ dword_t sys_lseek(fd_t f, dword_t off, dword_t whence) {
     return res;
 }
 
-dword_t sys_pread(fd_t f, addr_t buf_addr, dword_t size, off_t_ off) {
-    STRACE("pread(%d, 0x%x, %d, %d)", f, buf_addr, size, off);
-    struct fd *fd = f_get(f);
-    if (fd == NULL)
-        return _EBADF;
-    char *buf = malloc(size+1);
-    if (buf == NULL)
-        return _ENOMEM;
+static ssize_t fd_pread(struct fd *fd, void *buf, size_t size, off_t_ off) {
     lock(&fd->lock);
     ssize_t res;
     if (fd->ops->pread) {
@@ -439,28 +442,12 @@ dword_t sys_pread(fd_t f, addr_t buf_addr, dword_t size, off_t_ off) {
         off_t_ lseek_res = fd->ops->lseek(fd, saved_off, LSEEK_SET);
         assert(lseek_res >= 0);
     }
-    if (res >= 0) {
-        buf[res] = '\0';
-        STRACE(" \"%.99s\"", buf);
-        if (user_write(buf_addr, buf, res))
-            res = _EFAULT;
-    }
 out:
     unlock(&fd->lock);
-    free(buf);
     return res;
 }
 
-dword_t sys_pwrite(fd_t f, addr_t buf_addr, dword_t size, off_t_ off) {
-    STRACE("pwrite(%d, 0x%x, %d, %d)", f, buf_addr, size, off);
-    struct fd *fd = f_get(f);
-    if (fd == NULL)
-        return _EBADF;
-    char *buf = malloc(size+1);
-    if (buf == NULL)
-        return _ENOMEM;
-    if (user_read(buf_addr, buf, size))
-        return _EFAULT;
+static ssize_t fd_pwrite(struct fd *fd, const void *buf, size_t size, off_t_ off) {
     lock(&fd->lock);
     ssize_t res;
     if (fd->ops->pwrite) {
@@ -469,15 +456,45 @@ dword_t sys_pwrite(fd_t f, addr_t buf_addr, dword_t size, off_t_ off) {
         off_t_ saved_off = fd->ops->lseek(fd, 0, LSEEK_CUR);
         if ((res = fd->ops->lseek(fd, off, LSEEK_SET)) >= 0) {
             res = fd->ops->write(fd, buf, size);
-            // This really shouldn't fail. The lseek man page lists these reasons:
-            // EBADF, ESPIPE: can't happen because the last lseek wouldn't have succeeded.
-            // EOVERFLOW: can't happen for LSEEK_SET.
-            // EINVAL: can't happen other than typoing LSEEK_SET, because we know saved_off is not negative.
+            // This really shouldn't fail, see fd_pread.
             off_t_ lseek_res = fd->ops->lseek(fd, saved_off, LSEEK_SET);
             assert(lseek_res >= 0);
         }
     }
     unlock(&fd->lock);
+    return res;
+}
+
+dword_t sys_pread(fd_t f, addr_t buf_addr, dword_t size, off_t_ off) {
+    STRACE("pread(%d, 0x%x, %d, %d)", f, buf_addr, size, off);
+    struct fd *fd = f_get(f);
+    if (fd == NULL)
+        return _EBADF;
+    char *buf = malloc(size+1);
+    if (buf == NULL)
+        return _ENOMEM;
+    ssize_t res = fd_pread(fd, buf, size, off);
+    if (res >= 0) {
+        buf[res] = '\0';
+        STRACE(" \"%.99s\"", buf);
+        if (user_write(buf_addr, buf, res))
+            res = _EFAULT;
+    }
+    free(buf);
+    return res;
+}
+
+dword_t sys_pwrite(fd_t f, addr_t buf_addr, dword_t size, off_t_ off) {
+    STRACE("pwrite(%d, 0x%x, %d, %d)", f, buf_addr, size, off);
+    struct fd *fd = f_get(f);
+    if (fd == NULL)
+        return _EBADF;
+    char *buf = malloc(size+1);
+    if (buf == NULL)
+        return _ENOMEM;
+    ssize_t res = _EFAULT;
+    if (user_read(buf_addr, buf, size) == 0)
+        res = fd_pwrite(fd, buf, size, off);
     free(buf);
     return res;
 }
@@ -525,11 +542,9 @@ dword_t sys_ioctl(fd_t f, dword_t cmd, dword_t arg) {
         case FIONBIO_:
             return set_nonblock(fd, arg);
         case FIOCLEX_:
-            bit_set(f, current->files->cloexec);
-            return 0;
+            return f_set_cloexec(f, true);
         case FIONCLEX_:
-            bit_clear(f, current->files->cloexec);
-            return 0;
+            return f_set_cloexec(f, false);
     }
     return fd_ioctl(fd, cmd, arg);
 }
@@ -800,7 +815,14 @@ dword_t sys_utime(addr_t path_addr, addr_t times_addr) {
 static int generic_fsetattr(struct fd *fd, struct attr attr) {
     if (fd->mount->fs->fsetattr == NULL)
         return _EPERM;
-    return fd->mount->fs->fsetattr(fd, attr);
+    int err = fd->mount->fs->fsetattr(fd, attr);
+    // path_normalize may have cached the old permissions
+    char path[MAX_PATH];
+    if (fd->mount->fs->getpath && fd->mount->fs->getpath(fd, path) >= 0)
+        dentry_invalidate(fd->mount, path, false);
+    else
+        dentry_invalidate_all();
+    return err;
 }
 
 dword_t sys_fchmod(fd_t f, dword_t mode) {
@@ -944,19 +966,185 @@ dword_t sys_fsync(fd_t f) {
     return err;
 }
 
-// a few stubs
-dword_t sys_sendfile(fd_t UNUSED(out_fd), fd_t UNUSED(in_fd), addr_t UNUSED(offset_addr), dword_t UNUSED(count)) {
-    return _EINVAL;
+static mode_t_ fd_mode(struct fd *fd) {
+    struct statbuf stat;
+    if (fd->mount->fs->fstat(fd, &stat) < 0)
+        return 0;
+    return stat.mode;
+}
+
+#define COPY_CHUNK_SIZE (1 << 16)
+// a write this size to a writable pipe goes in whole or not at all
+#define PIPE_BUF_ 4096
+
+// Copies up to count bytes from in to out. A null offset means to use and
+// update the fd's file offset. This tries to get the host to do the whole
+// thing without the data ever coming through here, and only falls back to
+// reading and writing through a buffer when it can't.
+static ssize_t fd_copy(struct fd *in, off_t_ *in_off, struct fd *out, off_t_ *out_off, size_t count) {
+    if (count == 0)
+        return 0;
+    off_t real_in_off = in_off ? *in_off : 0;
+    off_t real_out_off = out_off ? *out_off : 0;
+    ssize_t res = realfs_copy(in, in_off ? &real_in_off : NULL,
+            out, out_off ? &real_out_off : NULL, count);
+    if (res != _ENOTSUP) {
+        if (res >= 0) {
+            if (in_off) *in_off = real_in_off;
+            if (out_off) *out_off = real_out_off;
+        }
+        return res;
+    }
+
+    // Whatever the output doesn't take has to be put back by seeking the
+    // input backwards. If the input is a pipe or socket that can't be done,
+    // so only read as much as a writable output is sure to take.
+    bool can_rewind = in_off != NULL ||
+        (in->ops->lseek != NULL && in->ops->lseek(in, 0, LSEEK_CUR) >= 0);
+    bool out_nonblock = fd_getflags(out) & O_NONBLOCK_;
+
+    char *buf = malloc(count < COPY_CHUNK_SIZE ? count : COPY_CHUNK_SIZE);
+    if (buf == NULL)
+        return _ENOMEM;
+    size_t copied = 0;
+    res = 0;
+    while (copied < count) {
+        size_t chunk = count - copied;
+        if (chunk > COPY_CHUNK_SIZE)
+            chunk = COPY_CHUNK_SIZE;
+        if (!can_rewind) {
+            if (chunk > PIPE_BUF_)
+                chunk = PIPE_BUF_;
+            if (out_nonblock && out->ops->poll != NULL &&
+                    !(out->ops->poll(out) & POLL_WRITE)) {
+                res = _EAGAIN;
+                break;
+            }
+        }
+        ssize_t read = in_off ? fd_pread(in, buf, chunk, *in_off) : fd_read(in, buf, chunk);
+        if (read <= 0) {
+            res = read;
+            break;
+        }
+        ssize_t written = out_off ? fd_pwrite(out, buf, read, *out_off) : fd_write(out, buf, read);
+        if (written < read) {
+            // don't lose the data that was read but not written
+            if (in_off == NULL && can_rewind)
+                in->ops->lseek(in, (written > 0 ? written : 0) - read, LSEEK_CUR);
+            if (written < 0) {
+                res = written;
+                break;
+            }
+        }
+        if (in_off) *in_off += written;
+        if (out_off) *out_off += written;
+        copied += written;
+        if (written < read || (size_t) read < chunk)
+            break;
+    }
+    free(buf);
+    if (copied > 0)
+        return copied;
+    return res;
 }
-dword_t sys_sendfile64(fd_t UNUSED(out_fd), fd_t UNUSED(in_fd), addr_t UNUSED(offset_addr), dword_t UNUSED(count)) {
-    return _EINVAL;
+
+static dword_t sendfile_common(fd_t out_f, fd_t in_f, addr_t offset_addr, dword_t count, bool offset64) {
+    struct fd *in = f_get(in_f);
+    struct fd *out = f_get(out_f);
+    if (in == NULL || out == NULL)
+        return _EBADF;
+    if (S_ISDIR(fd_mode(in)))
+        return _EISDIR;
+
+    off_t_ off;
+    if (offset_addr != 0) {
+        if (offset64) {
+            if (user_get(offset_addr, off))
+                return _EFAULT;
+        } else {
+            sdword_t off32;
+            if (user_get(offset_addr, off32))
+                return _EFAULT;
+            off = off32;
+        }
+        if (off < 0)
+            return _EINVAL;
+    }
+
+    ssize_t res = fd_copy(in, offset_addr ? &off : NULL, out, NULL, count);
+    if (res >= 0 && offset_addr != 0) {
+        if (offset64) {
+            if (user_put(offset_addr, off))
+                return _EFAULT;
+        } else {
+            sdword_t off32 = off;
+            if (user_put(offset_addr, off32))
+                return _EFAULT;
+        }
+    }
+    return res;
+}
+
+dword_t sys_sendfile(fd_t out_fd, fd_t in_fd, addr_t offset_addr, dword_t count) {
+    STRACE("sendfile(%d, %d, %#x, %u)", out_fd, in_fd, offset_addr, count);
+    return sendfile_common(out_fd, in_fd, offset_addr, count, false);
 }
-dword_t sys_splice(fd_t UNUSED(in_fd), addr_t UNUSED(in_off_addr), fd_t UNUSED(out_fd), addr_t UNUSED(out_off_addr), dword_t UNUSED(count), dword_t UNUSED(flags)) {
-    return _EINVAL;
+dword_t sys_sendfile64(fd_t out_fd, fd_t in_fd, addr_t offset_addr, dword_t count) {
+    STRACE("sendfile64(%d, %d, %#x, %u)", out_fd, in_fd, offset_addr, count);
+    return sendfile_common(out_fd, in_fd, offset_addr, count, true);
 }
-dword_t sys_copy_file_range(fd_t UNUSED(in_fd), addr_t UNUSED(in_off), fd_t UNUSED(out_fd),
-        addr_t UNUSED(out_off), dword_t UNUSED(len), uint_t UNUSED(flags)) {
-    return _EPERM; // good enough for ruby
+
+// for splice and copy_file_range, which both take nullable 64-bit offsets
+static dword_t copy_with_offsets(struct fd *in, addr_t in_off_addr, struct fd *out, addr_t out_off_addr, dword_t count) {
+    off_t_ in_off, out_off;
+    if (in_off_addr != 0 && user_get(in_off_addr, in_off))
+        return _EFAULT;
+    if (out_off_addr != 0 && user_get(out_off_addr, out_off))
+        return _EFAULT;
+    if ((in_off_addr != 0 && in_off < 0) || (out_off_addr != 0 && out_off < 0))
+        return _EINVAL;
+
+    ssize_t res = fd_copy(in, in_off_addr ? &in_off : NULL, out, out_off_addr ? &out_off : NULL, count);
+    if (res >= 0) {
+        if (in_off_addr != 0 && user_put(in_off_addr, in_off))
+            return _EFAULT;
+        if (out_off_addr != 0 && user_put(out_off_addr, out_off))
+            return _EFAULT;
+    }
+    return res;
+}
+
+dword_t sys_splice(fd_t in_fd, addr_t in_off_addr, fd_t out_fd, addr_t out_off_addr, dword_t count, dword_t flags) {
+    STRACE("splice(%d, %#x, %d, %#x, %u, %#x)", in_fd, in_off_addr, out_fd, out_off_addr, count, flags);
+    struct fd *in = f_get(in_fd);
+    struct fd *out = f_get(out_fd);
+    if (in == NULL || out == NULL)
+        return _EBADF;
+    bool in_pipe = S_ISFIFO(fd_mode(in));
+    bool out_pipe = S_ISFIFO(fd_mode(out));
+    if (!in_pipe && !out_pipe)
+        return _EINVAL;
+    if ((in_pipe && in_off_addr != 0) || (out_pipe && out_off_addr != 0))
+        return _ESPIPE;
+    // FIXME: SPLICE_F_NONBLOCK is ignored, the fds' own O_NONBLOCK still applies
+    return copy_with_offsets(in, in_off_addr, out, out_off_addr, count);
+}
+
+dword_t sys_copy_file_range(fd_t in_fd, addr_t in_off_addr, fd_t out_fd, addr_t out_off_addr, dword_t len, uint_t flags) {
+    STRACE("copy_file_range(%d, %#x, %d, %#x, %u, %#x)", in_fd, in_off_addr, out_fd, out_off_addr, len, flags);
+    if (flags != 0)
+        return _EINVAL;
+    struct fd *in = f_get(in_fd);
+    struct fd *out = f_get(out_fd);
+    if (in == NULL || out == NULL)
+        return _EBADF;
+    mode_t_ in_mode = fd_mode(in);
+    mode_t_ out_mode = fd_mode(out);
+    if (S_ISDIR(in_mode) || S_ISDIR(out_mode))
+        return _EISDIR;
+    if (!S_ISREG(in_mode) || !S_ISREG(out_mode))
+        return _EINVAL;
+    return copy_with_offsets(in, in_off_addr, out, out_off_addr, len);
 }
 
 dword_t sys_xattr_stub(addr_t UNUSED(path_addr), addr_t UNUSED(name_addr),
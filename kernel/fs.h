@@ -114,6 +114,13 @@ bool mount_param_flag(const char *info, const char *flag);
 #define O_DIRECTORY_ (1 << 16)
 #define O_CLOEXEC_ (1 << 19)
 
+// memfd seals
+#define F_SEAL_SEAL_ 0x1
+#define F_SEAL_SHRINK_ 0x2
+#define F_SEAL_GROW_ 0x4
+#define F_SEAL_WRITE_ 0x8
+#define F_SEAL_FUTURE_WRITE_ 0x10
+
 // generic ioctls
 #define FIONREAD_ 0x541b
 #define FIONBIO_ 0x5421
@@ -127,6 +134,8 @@ struct fs_ops {
 
     int (*mount)(struct mount *mount);
     int (*umount)(struct mount *mount);
+    // Makes anything the filesystem is holding back durable
+    int (*sync)(struct mount *mount);
     int (*statfs)(struct mount *mount, struct statfsbuf *stat);
 
     struct fd *(*open)(struct mount *mount, const char *path, int flags, int mode); // required
@@ -169,6 +178,10 @@ struct fd *adhoc_fd_create(const struct fd_ops *ops);
 // this is for the "wtf is apple smoking" section
 bool is_adhoc_fd(struct fd *fd);
 
+// memfd, return _EINVAL for other kinds of fd
+int memfd_add_seals(struct fd *fd, unsigned seals);
+int memfd_get_seals(struct fd *fd);
+
 // filesystems
 extern const struct fs_ops procfs;
 extern const struct fs_ops fakefs;
@@ -3,86 +3,141 @@
 #define FUTEX_WAIT_ 0
 #define FUTEX_WAKE_ 1
 #define FUTEX_REQUEUE_ 3
+#define FUTEX_CMP_REQUEUE_ 4
+#define FUTEX_WAKE_OP_ 5
+#define FUTEX_LOCK_PI_ 6
+#define FUTEX_UNLOCK_PI_ 7
+#define FUTEX_TRYLOCK_PI_ 8
+#define FUTEX_WAIT_BITSET_ 9
+#define FUTEX_WAKE_BITSET_ 10
 #define FUTEX_PRIVATE_FLAG_ 128
-#define FUTEX_CMD_MASK_ ~(FUTEX_PRIVATE_FLAG_)
+#define FUTEX_CLOCK_REALTIME_ 256
+#define FUTEX_CMD_MASK_ ~(FUTEX_PRIVATE_FLAG_|FUTEX_CLOCK_REALTIME_)
 
-struct futex {
-    atomic_uint refcount;
-    struct mem *mem;
-    addr_t addr;
-    struct list queue;
-    struct list chain; // locked by futex_hash_lock
+#define FUTEX_BITSET_MATCH_ANY_ 0xffffffff
+
+// the value of a PI or robust futex
+#define FUTEX_WAITERS_ 0x80000000
+#define FUTEX_OWNER_DIED_ 0x40000000
+#define FUTEX_TID_MASK_ 0x3fffffff
+
+#define FUTEX_OP_SET_ 0
+#define FUTEX_OP_ADD_ 1
+#define FUTEX_OP_OR_ 2
+#define FUTEX_OP_ANDN_ 3
+#define FUTEX_OP_XOR_ 4
+#define FUTEX_OP_OPARG_SHIFT_ 8
+#define FUTEX_OP_CMP_EQ_ 0
+#define FUTEX_OP_CMP_NE_ 1
+#define FUTEX_OP_CMP_LT_ 2
+#define FUTEX_OP_CMP_LE_ 3
+#define FUTEX_OP_CMP_GT_ 4
+#define FUTEX_OP_CMP_GE_ 5
+
+// A futex is identified by the memory it's in. A private futex, or any futex
+// in a private mapping, can only be seen from one address space, so that and
+// the address are enough. Memory in a shared mapping can be mapped by other
+// processes at other addresses, so what identifies it is what's behind the
+// mapping: the file (its inode if it has one) and the position in it, or for
+// memory that isn't from a file, the struct data and the offset in that.
+// Nothing keeps these alive, because if one goes away while something's still
+// waiting on it, the worst a new one at the same address can do is cause
+// spurious wakeups.
+struct futex_key {
+    const void *object;
+    uint64_t offset;
+};
+
+// Waiters are hashed by key into buckets that each have their own lock, so
+// threads using unrelated futexes don't contend with each other. Nothing is
+// allocated: a waiter is on the waiting thread's stack for as long as it's in
+// a bucket.
+struct futex_bucket {
+    lock_t lock;
+    struct list waiters;
 };
 
 struct futex_wait {
     cond_t cond;
-    struct futex *futex; // will be changed by a requeue
+    struct futex_key key; // will be changed by a requeue
+    dword_t bitset;
+    struct futex_bucket *bucket; // will be changed by a requeue
+    bool woken;
     struct list queue;
 };
 
 #define FUTEX_HASH_BITS 12
 #define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
-static lock_t futex_lock = LOCK_INITIALIZER;
-static struct list futex_hash[FUTEX_HASH_SIZE];
+static struct futex_bucket futex_hash[FUTEX_HASH_SIZE];
 
 static void __attribute__((constructor)) init_futex_hash() {
-    for (int i = 0; i < FUTEX_HASH_SIZE; i++)
-        list_init(&futex_hash[i]);
-}
-
-static struct futex *futex_get_unlocked(addr_t addr) {
-    int hash = (addr ^ (unsigned long) current->mem) % FUTEX_HASH_SIZE;
-    struct list *bucket = &futex_hash[hash];
-    struct futex *futex;
-    list_for_each_entry(bucket, futex, chain) {
-        if (futex->addr == addr && futex->mem == current->mem) {
-            futex->refcount++;
-            return futex;
-        }
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        lock_init(&futex_hash[i].lock);
+        list_init(&futex_hash[i].waiters);
     }
+}
 
-    futex = malloc(sizeof(struct futex));
-    if (futex == NULL) {
-        unlock(&futex_lock);
-        return NULL;
+static int futex_key(addr_t addr, bool private, struct futex_key *key) {
+    struct mem *mem = current->mem;
+    *key = (struct futex_key) {.object = mem, .offset = addr};
+    if (private)
+        return 0;
+    read_wrlock(&mem->lock);
+    struct pt_entry *pt = mem_pt(mem, PAGE(addr));
+    if (pt == NULL) {
+        read_wrunlock(&mem->lock);
+        return _EFAULT;
+    }
+    if (pt->flags & P_SHARED) {
+        struct data *data = pt->data;
+        key->offset = pt->offset + PGOFFSET(addr);
+        if (data->fd != NULL) {
+            if (data->fd->inode != NULL)
+                key->object = data->fd->inode;
+            else
+                key->object = data->fd;
+            key->offset += data->file_offset;
+        } else {
+            key->object = data;
+        }
     }
-    futex->refcount = 1;
-    futex->mem = current->mem;
-    futex->addr = addr;
-    list_init(&futex->queue);
-    list_add(bucket, &futex->chain);
-    return futex;
+    read_wrunlock(&mem->lock);
+    return 0;
 }
 
-// Returns the futex for the current process at the given addr, and locks it
-// Unlocked variant is available for times when you need to get two futexes at once
-static struct futex *futex_get(addr_t addr) {
-    lock(&futex_lock);
-    struct futex *futex = futex_get_unlocked(addr);
-    if (futex == NULL)
-        unlock(&futex_lock);
-    return futex;
+static bool futex_key_equal(struct futex_key a, struct futex_key b) {
+    return a.object == b.object && a.offset == b.offset;
 }
 
-static void futex_put_unlocked(struct futex *futex) {
-    if (--futex->refcount == 0) {
-        assert(list_empty(&futex->queue));
-        list_remove(&futex->chain);
-        free(futex);
+static struct futex_bucket *futex_bucket(struct futex_key key) {
+    // the low bits of the offset are always zero
+    uint32_t hash = (uint32_t) (key.offset >> 2) ^ (uint32_t) (key.offset >> 32) ^
+        (uint32_t) ((uintptr_t) key.object >> 4);
+    return &futex_hash[(hash * 0x9e3779b1) >> (32 - FUTEX_HASH_BITS)];
+}
+
+// For operations on two futexes. Always locks in the same order, so two
+// threads doing this at once can't deadlock.
+static void futex_lock_two(struct futex_bucket *a, struct futex_bucket *b) {
+    if (a > b) {
+        struct futex_bucket *tmp = a;
+        a = b;
+        b = tmp;
     }
+    lock(&a->lock);
+    if (a != b)
+        lock(&b->lock);
 }
 
-// Must be called on the result of futex_get when you're done with it
-// Also has an unlocked version, for releasing the result of futex_get_unlocked
-static void futex_put(struct futex *futex) {
-    futex_put_unlocked(futex);
-    unlock(&futex_lock);
+static void futex_unlock_two(struct futex_bucket *a, struct futex_bucket *b) {
+    unlock(&a->lock);
+    if (a != b)
+        unlock(&b->lock);
 }
 
-static int futex_load(struct futex *futex, dword_t *out) {
-    assert(futex->mem == current->mem);
+static int futex_load(addr_t addr, dword_t *out) {
     read_wrlock(&current->mem->lock);
-    dword_t *ptr = mem_ptr(current->mem, futex->addr, MEM_READ);
+    dword_t *ptr = mem_ptr(current->mem, addr, MEM_READ);
     read_wrunlock(&current->mem->lock);
     if (ptr == NULL)
         return 1;
@@ -90,90 +145,424 @@ static int futex_load(struct futex *futex, dword_t *out) {
     return 0;
 }
 
-static int futex_wait(addr_t uaddr, dword_t val, struct timespec *timeout) {
-    struct futex *futex = futex_get(uaddr);
+static bool timespec_before(struct timespec a, struct timespec b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// wait_for wants a relative timeout, this gives what's left until deadline,
+// or false if it's passed
+static bool futex_time_left(clockid_t clock, struct timespec deadline, struct timespec *left) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    if (!timespec_before(now, deadline))
+        return false;
+    left->tv_sec = deadline.tv_sec - now.tv_sec;
+    left->tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0) {
+        left->tv_sec--;
+        left->tv_nsec += 1000000000;
+    }
+    return true;
+}
+
+// Queues the waiter on its bucket and sleeps until it's woken, times out, or
+// gets a signal. Must be called with the bucket locked, and returns with the
+// waiter's bucket locked, which isn't the same one if it was requeued.
+static int futex_sleep(struct futex_wait *wait, clockid_t clock, struct timespec *deadline) {
+    struct futex_bucket *bucket = wait->bucket;
+    list_add_tail(&bucket->waiters, &wait->queue);
     int err = 0;
+    while (true) {
+        struct timespec left;
+        if (deadline != NULL && !futex_time_left(clock, *deadline, &left))
+            err = _ETIMEDOUT;
+        if (err == 0)
+            err = wait_for(&wait->cond, &bucket->lock, deadline != NULL ? &left : NULL);
+        // A requeue moves the waiter to another bucket, and the lock that
+        // matters is that bucket's. It's safe to look while holding either,
+        // since whoever moved it was holding both.
+        while (wait->bucket != bucket) {
+            unlock(&bucket->lock);
+            bucket = wait->bucket;
+            lock(&bucket->lock);
+        }
+        // a wakeup beats a timeout or signal that happened at the same time
+        if (wait->woken)
+            return 0;
+        if (err < 0) {
+            list_remove(&wait->queue);
+            return err;
+        }
+    }
+}
+
+static int futex_wait(addr_t uaddr, bool private, dword_t val, dword_t bitset, clockid_t clock, struct timespec *deadline) {
+    struct futex_wait wait = {
+        .bitset = bitset,
+    };
+    if (futex_key(uaddr, private, &wait.key))
+        return _EFAULT;
+    wait.bucket = futex_bucket(wait.key);
+    // cond_init makes timeouts use the monotonic clock, COND_INITIALIZER doesn't
+    cond_init(&wait.cond);
+    lock(&wait.bucket->lock);
+    int err;
     dword_t tmp;
-    if (futex_load(futex, &tmp))
+    if (futex_load(uaddr, &tmp))
         err = _EFAULT;
     else if (tmp != val)
         err = _EAGAIN;
-    else {
-        struct futex_wait wait;
-        wait.cond = COND_INITIALIZER;
-        wait.futex = futex;
-        list_add_tail(&futex->queue, &wait.queue);
-        err = wait_for(&wait.cond, &futex_lock, timeout);
-        futex = wait.futex;
-        list_remove_safe(&wait.queue);
-    }
-    futex_put(futex);
+    else
+        err = futex_sleep(&wait, clock, deadline);
+    unlock(&wait.bucket->lock);
+    cond_destroy(&wait.cond);
     STRACE("%d end futex(FUTEX_WAIT)", current->pid);
     return err;
 }
 
-static int futex_wakelike(int op, addr_t uaddr, dword_t wake_max, dword_t requeue_max, addr_t requeue_addr) {
-    struct futex *futex = futex_get(uaddr);
-
+// Wakes up to wake_max waiters on key whose bitset matches. Must be called
+// with the bucket for key locked.
+static unsigned futex_wake_locked(struct futex_bucket *bucket, struct futex_key key, dword_t wake_max, dword_t bitset) {
     struct futex_wait *wait, *tmp;
     unsigned woken = 0;
-    list_for_each_entry_safe(&futex->queue, wait, tmp, queue) {
+    list_for_each_entry_safe(&bucket->waiters, wait, tmp, queue) {
         if (woken >= wake_max)
             break;
-        notify(&wait->cond);
+        if (!futex_key_equal(wait->key, key) || !(wait->bitset & bitset))
+            continue;
         list_remove(&wait->queue);
+        wait->woken = true;
+        notify(&wait->cond);
         woken++;
     }
+    return woken;
+}
 
-    if (op == FUTEX_REQUEUE_) {
-        struct futex *futex2 = futex_get_unlocked(requeue_addr);
-        unsigned requeued = 0;
-        list_for_each_entry_safe(&futex->queue, wait, tmp, queue) {
-            if (requeued >= requeue_max)
-                break;
-            // sketchy as hell
+// Moves up to requeue_max waiters from key to key2. Must be called with both
+// buckets locked.
+static unsigned futex_requeue_locked(struct futex_bucket *bucket, struct futex_key key,
+        struct futex_bucket *bucket2, struct futex_key key2, dword_t requeue_max) {
+    struct futex_wait *wait, *tmp;
+    unsigned requeued = 0;
+    list_for_each_entry_safe(&bucket->waiters, wait, tmp, queue) {
+        if (requeued >= requeue_max)
+            break;
+        if (!futex_key_equal(wait->key, key))
+            continue;
+        if (bucket2 != bucket) {
             list_remove(&wait->queue);
-            list_add_tail(&futex2->queue, &wait->queue);
-            assert(futex->refcount > 1); // should be true because this function keeps a reference
-            futex->refcount--;
-            futex2->refcount++;
-            wait->futex = futex2;
-            requeued++;
+            list_add_tail(&bucket2->waiters, &wait->queue);
+            wait->bucket = bucket2;
         }
-        futex_put_unlocked(futex2);
-        woken += requeued;
+        wait->key = key2;
+        requeued++;
     }
+    return requeued;
+}
 
-    futex_put(futex);
+static int futex_wakelike(addr_t uaddr, bool private, dword_t wake_max, dword_t bitset) {
+    struct futex_key key;
+    if (futex_key(uaddr, private, &key))
+        return _EFAULT;
+    struct futex_bucket *bucket = futex_bucket(key);
+    lock(&bucket->lock);
+    unsigned woken = futex_wake_locked(bucket, key, wake_max, bitset);
+    unlock(&bucket->lock);
     return woken;
 }
 
+static int futex_requeue(addr_t uaddr, bool private, dword_t wake_max, dword_t requeue_max, addr_t uaddr2, bool cmp, dword_t cmpval) {
+    struct futex_key key, key2;
+    if (futex_key(uaddr, private, &key) || futex_key(uaddr2, private, &key2))
+        return _EFAULT;
+    struct futex_bucket *bucket = futex_bucket(key);
+    struct futex_bucket *bucket2 = futex_bucket(key2);
+    futex_lock_two(bucket, bucket2);
+    int res;
+    dword_t val;
+    if (cmp && futex_load(uaddr, &val)) {
+        res = _EFAULT;
+    } else if (cmp && val != cmpval) {
+        res = _EAGAIN;
+    } else {
+        res = futex_wake_locked(bucket, key, wake_max, FUTEX_BITSET_MATCH_ANY_);
+        res += futex_requeue_locked(bucket, key, bucket2, key2, requeue_max);
+    }
+    futex_unlock_two(bucket, bucket2);
+    return res;
+}
+
+static int32_t sign_extend_12(dword_t val) {
+    return (int32_t) (val << 20) >> 20;
+}
+
+// Does the operation encoded in the FUTEX_WAKE_OP argument on the word at
+// addr, atomically, and returns what was there before in old.
+static int futex_atomic_op(addr_t addr, dword_t encoded_op, dword_t *old) {
+    int op = (encoded_op >> 28) & 7;
+    int32_t oparg = sign_extend_12(encoded_op >> 12);
+    if ((encoded_op >> 28) & FUTEX_OP_OPARG_SHIFT_) {
+        if (oparg < 0 || oparg > 31)
+            return _EINVAL;
+        oparg = 1u << oparg;
+    }
+    if (op > FUTEX_OP_XOR_)
+        return _ENOSYS;
+
+    read_wrlock(&current->mem->lock);
+    dword_t *ptr = mem_ptr(current->mem, addr, MEM_WRITE);
+    if (ptr == NULL) {
+        read_wrunlock(&current->mem->lock);
+        return _EFAULT;
+    }
+    dword_t val = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+    dword_t new;
+    do {
+        switch (op) {
+            case FUTEX_OP_SET_: new = oparg; break;
+            case FUTEX_OP_ADD_: new = val + oparg; break;
+            case FUTEX_OP_OR_: new = val | oparg; break;
+            case FUTEX_OP_ANDN_: new = val & ~oparg; break;
+            case FUTEX_OP_XOR_: new = val ^ oparg; break;
+        }
+    } while (!__atomic_compare_exchange_n(ptr, &val, new, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    read_wrunlock(&current->mem->lock);
+    *old = val;
+    return 0;
+}
+
+static int futex_cmp(dword_t encoded_op, int32_t val) {
+    int32_t cmparg = sign_extend_12(encoded_op);
+    switch ((encoded_op >> 24) & 15) {
+        case FUTEX_OP_CMP_EQ_: return val == cmparg;
+        case FUTEX_OP_CMP_NE_: return val != cmparg;
+        case FUTEX_OP_CMP_LT_: return val < cmparg;
+        case FUTEX_OP_CMP_LE_: return val <= cmparg;
+        case FUTEX_OP_CMP_GT_: return val > cmparg;
+        case FUTEX_OP_CMP_GE_: return val >= cmparg;
+    }
+    return _ENOSYS;
+}
+
+static int futex_wake_op(addr_t uaddr, bool private, dword_t wake_max, addr_t uaddr2, dword_t wake2_max, dword_t encoded_op) {
+    struct futex_key key, key2;
+    if (futex_key(uaddr, private, &key) || futex_key(uaddr2, private, &key2))
+        return _EFAULT;
+    struct futex_bucket *bucket = futex_bucket(key);
+    struct futex_bucket *bucket2 = futex_bucket(key2);
+    futex_lock_two(bucket, bucket2);
+    dword_t old;
+    int res = futex_atomic_op(uaddr2, encoded_op, &old);
+    if (res == 0) {
+        int cmp = futex_cmp(encoded_op, old);
+        if (cmp < 0) {
+            res = cmp;
+        } else {
+            res = futex_wake_locked(bucket, key, wake_max, FUTEX_BITSET_MATCH_ANY_);
+            if (cmp)
+                res += futex_wake_locked(bucket2, key2, wake2_max, FUTEX_BITSET_MATCH_ANY_);
+        }
+    }
+    futex_unlock_two(bucket, bucket2);
+    return res;
+}
+
+// Compare and swap on the word at addr. Returns 0 and sets *old to what was
+// there, whether or not it matched.
+static int futex_cmpxchg(addr_t addr, dword_t expected, dword_t new, dword_t *old) {
+    read_wrlock(&current->mem->lock);
+    dword_t *ptr = mem_ptr(current->mem, addr, MEM_WRITE);
+    if (ptr == NULL) {
+        read_wrunlock(&current->mem->lock);
+        return _EFAULT;
+    }
+    __atomic_compare_exchange_n(ptr, &expected, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    read_wrunlock(&current->mem->lock);
+    *old = expected;
+    return 0;
+}
+
+static bool futex_has_waiters(struct futex_bucket *bucket, struct futex_key key) {
+    struct futex_wait *wait;
+    list_for_each_entry(&bucket->waiters, wait, queue) {
+        if (futex_key_equal(wait->key, key))
+            return true;
+    }
+    return false;
+}
+
+// PI futexes hold the owner's tid, plus FUTEX_WAITERS if anyone is waiting in
+// the kernel, which makes the owner call FUTEX_UNLOCK_PI instead of just
+// zeroing it. There are no priorities to inherit here, so all that's left is
+// the locking protocol.
+//
+// Tries to take the lock. Returns 0 if it did, 1 if the caller has to wait
+// (after setting FUTEX_WAITERS), or an error. Must be called with the bucket
+// locked.
+static int futex_lock_pi_atomic(struct futex_bucket *bucket, struct futex_key key, addr_t uaddr) {
+    dword_t val;
+    if (futex_load(uaddr, &val))
+        return _EFAULT;
+    while (true) {
+        dword_t new;
+        if ((val & FUTEX_TID_MASK_) == 0) {
+            // a previous owner may have died, they get to find out from FUTEX_OWNER_DIED
+            new = (val & FUTEX_OWNER_DIED_) | current->pid;
+            if (futex_has_waiters(bucket, key))
+                new |= FUTEX_WAITERS_;
+        } else if ((val & FUTEX_TID_MASK_) == (dword_t) current->pid) {
+            return _EDEADLK;
+        } else if (val & FUTEX_WAITERS_) {
+            return 1;
+        } else {
+            new = val | FUTEX_WAITERS_;
+        }
+        dword_t old;
+        if (futex_cmpxchg(uaddr, val, new, &old))
+            return _EFAULT;
+        if (old == val)
+            return (new & FUTEX_TID_MASK_) == (dword_t) current->pid ? 0 : 1;
+        val = old;
+    }
+}
+
+static int futex_lock_pi(addr_t uaddr, bool private, bool try, struct timespec *deadline) {
+    struct futex_wait wait = {
+        .bitset = FUTEX_BITSET_MATCH_ANY_,
+    };
+    if (futex_key(uaddr, private, &wait.key))
+        return _EFAULT;
+    wait.bucket = futex_bucket(wait.key);
+    // cond_init makes timeouts use the monotonic clock, COND_INITIALIZER doesn't
+    cond_init(&wait.cond);
+    lock(&wait.bucket->lock);
+    int err;
+    while ((err = futex_lock_pi_atomic(wait.bucket, wait.key, uaddr)) == 1) {
+        if (try) {
+            err = _EAGAIN;
+            break;
+        }
+        // The unlock will only wake us up, it doesn't hand the lock over, so
+        // try again. Nothing can requeue a PI waiter so the bucket stays the same.
+        wait.woken = false;
+        if ((err = futex_sleep(&wait, CLOCK_REALTIME, deadline)) < 0)
+            break;
+    }
+    unlock(&wait.bucket->lock);
+    cond_destroy(&wait.cond);
+    return err;
+}
+
+static int futex_unlock_pi(addr_t uaddr, bool private) {
+    struct futex_key key;
+    if (futex_key(uaddr, private, &key))
+        return _EFAULT;
+    struct futex_bucket *bucket = futex_bucket(key);
+    lock(&bucket->lock);
+    int err = 0;
+    dword_t val;
+    if (futex_load(uaddr, &val)) {
+        err = _EFAULT;
+        goto out;
+    }
+    while (true) {
+        if ((val & FUTEX_TID_MASK_) != (dword_t) current->pid) {
+            err = _EPERM;
+            goto out;
+        }
+        dword_t old;
+        if (futex_cmpxchg(uaddr, val, 0, &old)) {
+            err = _EFAULT;
+            goto out;
+        }
+        if (old == val)
+            break;
+        val = old;
+    }
+    // whoever wakes up puts FUTEX_WAITERS back if there are more
+    futex_wake_locked(bucket, key, 1, FUTEX_BITSET_MATCH_ANY_);
+out:
+    unlock(&bucket->lock);
+    return err;
+}
+
+// Not private, since the futex could be in memory shared with other processes.
 int futex_wake(addr_t uaddr, dword_t wake_max) {
-    return futex_wakelike(FUTEX_WAKE_, uaddr, wake_max, 0, 0);
+    return futex_wakelike(uaddr, false, wake_max, FUTEX_BITSET_MATCH_ANY_);
 }
 
 dword_t sys_futex(addr_t uaddr, dword_t op, dword_t val, addr_t timeout_or_val2, addr_t uaddr2, dword_t val3) {
-    if (!(op & FUTEX_PRIVATE_FLAG_)) {
+    bool private = op & FUTEX_PRIVATE_FLAG_;
+    if (!private) {
         STRACE("!FUTEX_PRIVATE ");
     }
-    struct timespec timeout = {0};
-    if ((op & FUTEX_CMD_MASK_) == FUTEX_WAIT_ && timeout_or_val2) {
-        struct timespec_ timeout_;
+    int cmd = op & FUTEX_CMD_MASK_;
+    if (op & FUTEX_CLOCK_REALTIME_ && cmd != FUTEX_WAIT_ && cmd != FUTEX_WAIT_BITSET_)
+        return _ENOSYS;
+    if (uaddr % sizeof(dword_t) != 0)
+        return _EINVAL;
+
+    // waits keep an absolute deadline, so spurious wakeups don't restart the timeout
+    clockid_t clock = CLOCK_MONOTONIC;
+    struct timespec deadline = {0};
+    struct timespec_ timeout_ = {0};
+    if ((cmd == FUTEX_WAIT_ || cmd == FUTEX_WAIT_BITSET_ || cmd == FUTEX_LOCK_PI_) && timeout_or_val2) {
         if (user_get(timeout_or_val2, timeout_))
             return _EFAULT;
-        timeout.tv_sec = timeout_.sec;
-        timeout.tv_nsec = timeout_.nsec;
+        if (timeout_.nsec >= 1000000000)
+            return _EINVAL;
+        deadline.tv_sec = timeout_.sec;
+        deadline.tv_nsec = timeout_.nsec;
+        if (cmd == FUTEX_WAIT_) {
+            // relative
+            struct timespec now;
+            clock_gettime(clock, &now);
+            deadline.tv_sec += now.tv_sec;
+            deadline.tv_nsec += now.tv_nsec;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+        } else if (op & FUTEX_CLOCK_REALTIME_ || cmd == FUTEX_LOCK_PI_) {
+            clock = CLOCK_REALTIME;
+        }
     }
-    switch (op & FUTEX_CMD_MASK_) {
+    if ((cmd == FUTEX_WAIT_BITSET_ || cmd == FUTEX_WAKE_BITSET_) && val3 == 0)
+        return _EINVAL;
+
+    switch (cmd) {
         case FUTEX_WAIT_:
-            STRACE("futex(FUTEX_WAIT, %#x, %d, 0x%x {%ds %dns}) = ...\n", uaddr, val, timeout_or_val2, timeout.tv_sec, timeout.tv_nsec);
-            return futex_wait(uaddr, val, timeout_or_val2 ? &timeout : NULL);
+            STRACE("futex(FUTEX_WAIT, %#x, %d, 0x%x {%ds %dns}) = ...\n", uaddr, val, timeout_or_val2, timeout_.sec, timeout_.nsec);
+            return futex_wait(uaddr, private, val, FUTEX_BITSET_MATCH_ANY_, clock, timeout_or_val2 ? &deadline : NULL);
+        case FUTEX_WAIT_BITSET_:
+            STRACE("futex(FUTEX_WAIT_BITSET, %#x, %d, 0x%x {%ds %dns}, %#x) = ...\n", uaddr, val, timeout_or_val2, timeout_.sec, timeout_.nsec, val3);
+            return futex_wait(uaddr, private, val, val3, clock, timeout_or_val2 ? &deadline : NULL);
         case FUTEX_WAKE_:
             STRACE("futex(FUTEX_WAKE, %#x, %d)", uaddr, val);
-            return futex_wakelike(op & FUTEX_CMD_MASK_, uaddr, val, 0, 0);
+            return futex_wakelike(uaddr, private, val, FUTEX_BITSET_MATCH_ANY_);
+        case FUTEX_WAKE_BITSET_:
+            STRACE("futex(FUTEX_WAKE_BITSET, %#x, %d, %#x)", uaddr, val, val3);
+            return futex_wakelike(uaddr, private, val, val3);
         case FUTEX_REQUEUE_:
             STRACE("futex(FUTEX_REQUEUE, %#x, %d, %#x)", uaddr, val, uaddr2);
-            return futex_wakelike(op & FUTEX_CMD_MASK_, uaddr, val, timeout_or_val2, uaddr2);
+            return futex_requeue(uaddr, private, val, timeout_or_val2, uaddr2, false, 0);
+        case FUTEX_CMP_REQUEUE_:
+            STRACE("futex(FUTEX_CMP_REQUEUE, %#x, %d, %d, %#x, %d)", uaddr, val, timeout_or_val2, uaddr2, val3);
+            return futex_requeue(uaddr, private, val, timeout_or_val2, uaddr2, true, val3);
+        case FUTEX_WAKE_OP_:
+            STRACE("futex(FUTEX_WAKE_OP, %#x, %d, %d, %#x, %#x)", uaddr, val, timeout_or_val2, uaddr2, val3);
+            if (uaddr2 % sizeof(dword_t) != 0)
+                return _EINVAL;
+            return futex_wake_op(uaddr, private, val, uaddr2, timeout_or_val2, val3);
+        case FUTEX_LOCK_PI_:
+            STRACE("futex(FUTEX_LOCK_PI, %#x, %#x {%ds %dns}) = ...\n", uaddr, timeout_or_val2, timeout_.sec, timeout_.nsec);
+            return futex_lock_pi(uaddr, private, false, timeout_or_val2 ? &deadline : NULL);
+        case FUTEX_TRYLOCK_PI_:
+            STRACE("futex(FUTEX_TRYLOCK_PI, %#x)", uaddr);
+            return futex_lock_pi(uaddr, private, true, NULL);
+        case FUTEX_UNLOCK_PI_:
+            STRACE("futex(FUTEX_UNLOCK_PI, %#x)", uaddr);
+            return futex_unlock_pi(uaddr, private);
     }
     STRACE("futex(%#x, %d, %d, timeout=%#x, %#x, %d) ", uaddr, op, val, timeout_or_val2, uaddr2, val3);
     FIXME("unsupported futex operation %d", op);
@@ -209,3 +598,62 @@ int_t sys_get_robust_list(pid_t_ pid, addr_t robust_list_ptr, addr_t len_ptr) {
         return _EFAULT;
     return 0;
 }
+
+// Called when the owner of a robust futex dies holding it. Sets
+// FUTEX_OWNER_DIED so the next owner knows the data it protects might be
+// inconsistent, and wakes someone up to take it. The wakeup isn't private,
+// since the waiter could be another process sharing the memory.
+static int futex_owner_died(addr_t uaddr, bool pending) {
+    dword_t val;
+    if (futex_load(uaddr, &val))
+        return _EFAULT;
+    while (true) {
+        if ((val & FUTEX_TID_MASK_) != (dword_t) current->pid) {
+            // If we died between unlocking and waking, someone could be
+            // waiting for a wakeup that's never going to come.
+            if (pending && val == 0)
+                futex_wake(uaddr, 1);
+            return 0;
+        }
+        dword_t new = (val & FUTEX_WAITERS_) | FUTEX_OWNER_DIED_;
+        dword_t old;
+        if (futex_cmpxchg(uaddr, val, new, &old))
+            return _EFAULT;
+        if (old == val)
+            break;
+        val = old;
+    }
+    if (val & FUTEX_WAITERS_)
+        futex_wake(uaddr, 1);
+    return 0;
+}
+
+// Entry pointers have the low bit set if the futex is a PI futex. PI waiters
+// are woken the same way as everyone else, so it doesn't matter here.
+#define ROBUST_LIST_PI_ 1
+// so a circular list can't keep an exiting task going forever
+#define ROBUST_LIST_LIMIT 2048
+
+void futex_exit_robust_list() {
+    addr_t head_addr = current->robust_list;
+    if (head_addr == 0)
+        return;
+    current->robust_list = 0;
+    struct robust_list_head_ head;
+    if (user_get(head_addr, head))
+        return;
+    addr_t pending = head.list_op_pending & ~ROBUST_LIST_PI_;
+
+    addr_t entry = head.list & ~ROBUST_LIST_PI_;
+    for (int i = 0; entry != head_addr && i < ROBUST_LIST_LIMIT; i++) {
+        // get the next one first, since waking up a waiter lets it free this one
+        addr_t next;
+        if (user_get(entry, next))
+            return;
+        if (entry != pending)
+            futex_owner_died(entry + (sdword_t) head.offset, false);
+        entry = next & ~ROBUST_LIST_PI_;
+    }
+    if (pending != 0)
+        futex_owner_died(pending + (sdword_t) head.offset, true);
+}
@@ -2,5 +2,8 @@
 #define KERNEL_FUTEX_H
 
 int futex_wake(addr_t uaddr, dword_t val);
+// Marks the robust futexes the current task is holding as having lost their
+// owner. Called on exit, while the task still has its memory.
+void futex_exit_robust_list(void);
 
 #endif
@@ -9,11 +9,11 @@
 #include "kernel/init.h"
 #include "kernel/personality.h"
 
-int mount_root(const struct fs_ops *fs, const char *source) {
+int mount_root(const struct fs_ops *fs, const char *source, const char *info) {
     char source_realpath[MAX_PATH + 1];
     if (realpath(source, source_realpath) == NULL)
         return errno_map();
-    int err = do_mount(fs, source_realpath, "", "", 0);
+    int err = do_mount(fs, source_realpath, "", info, 0);
     if (err < 0)
         return err;
     return 0;
@@ -58,6 +58,8 @@ static struct task *construct_task(struct task *parent) {
     *group = (struct tgroup) {};
     list_init(&group->threads);
     lock_init(&group->lock);
+    list_init(&group->children);
+    lock_init(&group->children_lock);
     cond_init(&group->child_exit);
     cond_init(&group->stopped_cond);
     memcpy(group->limits, init_rlimits, sizeof(init_rlimits));
@@ -4,7 +4,7 @@
 #include "fs/tty.h"
 
 // Incredibly sloppy. Please do not reference as an example of good API design.
-int mount_root(const struct fs_ops *fs, const char *source);
+int mount_root(const struct fs_ops *fs, const char *source, const char *info);
 void set_console_device(int major, int minor);
 int become_first_process(void);
 int become_new_init_child(void);
@@ -1,6 +1,1292 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "debug.h"
 #include "kernel/calls.h"
+#include "kernel/mm.h"
+#include "fs/fd.h"
+#include "platform/platform.h"
+
+#define IPC_PRIVATE_ 0
+#define IPC_CREAT_ 01000
+#define IPC_EXCL_ 02000
+#define IPC_NOWAIT_ 04000
+
+#define IPC_RMID_ 0
+#define IPC_SET_ 1
+#define IPC_STAT_ 2
+#define IPC_INFO_ 3
+// Asks for the 64-bit versions of the ctl structs. Those are the only ones
+// supported, musl always sets this.
+#define IPC_64_ 0x100
+
+// Maximum number of objects of each type. Linux calls this IPCMNI.
+#define IPC_MAX 1024
+
+struct ipc64_perm_ {
+    int_t key;
+    uid_t_ uid;
+    uid_t_ gid;
+    uid_t_ cuid;
+    uid_t_ cgid;
+    word_t mode;
+    word_t pad1;
+    word_t seq;
+    word_t pad2;
+    dword_t unused1;
+    dword_t unused2;
+};
+
+struct ipc_object {
+    int_t key;
+    int_t id;
+    uid_t_ uid, gid;
+    uid_t_ cuid, cgid;
+    mode_t_ mode;
+    dword_t ctime;
+
+    // Tasks sleeping in semop or msgsnd/msgrcv. The object is freed by the
+    // last one to leave if it was removed in the meantime.
+    cond_t cond;
+    unsigned waiters;
+    bool removed;
+    void (*free)(struct ipc_object *obj);
+};
+
+struct ipc_ids {
+    struct ipc_object *objects[IPC_MAX];
+    unsigned seq;
+    unsigned in_use;
+};
+
+// Protects all of the id tables and everything in the objects not marked
+// immutable. Taken after mem->lock when both are needed.
+static lock_t ipc_lock = LOCK_INITIALIZER;
+
+static dword_t ipc_now(void) {
+    return timespec_now(CLOCK_REALTIME).tv_sec;
+}
+
+static struct ipc_object *ipc_lookup(struct ipc_ids *ids, int_t id) {
+    if (id < 0)
+        return NULL;
+    struct ipc_object *obj = ids->objects[id % IPC_MAX];
+    if (obj == NULL || obj->id != id)
+        return NULL;
+    return obj;
+}
+
+static struct ipc_object *ipc_find_key(struct ipc_ids *ids, int_t key) {
+    for (unsigned i = 0; i < IPC_MAX; i++) {
+        if (ids->objects[i] != NULL && ids->objects[i]->key == key)
+            return ids->objects[i];
+    }
+    return NULL;
+}
+
+static int ipc_insert(struct ipc_ids *ids, struct ipc_object *obj, int_t key, int_t flags) {
+    unsigned index;
+    for (index = 0; index < IPC_MAX; index++) {
+        if (ids->objects[index] == NULL)
+            break;
+    }
+    if (index >= IPC_MAX)
+        return _ENOSPC;
+    if (++ids->seq >= INT32_MAX / IPC_MAX)
+        ids->seq = 0;
+
+    obj->key = key;
+    obj->id = ids->seq * IPC_MAX + index;
+    obj->uid = obj->cuid = current->euid;
+    obj->gid = obj->cgid = current->egid;
+    obj->mode = flags & 0777;
+    obj->ctime = ipc_now();
+    cond_init(&obj->cond);
+    obj->waiters = 0;
+    obj->removed = false;
+    ids->objects[index] = obj;
+    ids->in_use++;
+    return obj->id;
+}
+
+// Takes the object out of its table. It's freed right away unless someone is
+// sleeping on it, in which case they'll get EIDRM and the last one frees it.
+static void ipc_remove(struct ipc_ids *ids, struct ipc_object *obj) {
+    ids->objects[obj->id % IPC_MAX] = NULL;
+    ids->in_use--;
+    obj->removed = true;
+    notify(&obj->cond);
+    if (obj->waiters == 0)
+        obj->free(obj);
+}
+
+static int ipc_check_perm(struct ipc_object *obj, int access) {
+    if (superuser())
+        return 0;
+    mode_t_ mode = obj->mode;
+    if (current->euid == obj->uid || current->euid == obj->cuid)
+        mode >>= 6;
+    else if (current->egid == obj->gid || current->egid == obj->cgid)
+        mode >>= 3;
+    if ((mode & access) != access)
+        return _EACCES;
+    return 0;
+}
+
+static bool ipc_is_owner(struct ipc_object *obj) {
+    return superuser() || current->euid == obj->uid || current->euid == obj->cuid;
+}
+
+// Common part of shmget/semget/msgget. Returns the existing object matching
+// key in *obj_out, or NULL if a new one should be created.
+static int ipc_get_existing(struct ipc_ids *ids, int_t key, int_t flags, struct ipc_object **obj_out) {
+    *obj_out = NULL;
+    if (key == IPC_PRIVATE_)
+        return 0;
+    struct ipc_object *obj = ipc_find_key(ids, key);
+    if (obj == NULL)
+        return flags & IPC_CREAT_ ? 0 : _ENOENT;
+    if ((flags & IPC_CREAT_) && (flags & IPC_EXCL_))
+        return _EEXIST;
+    int err = ipc_check_perm(obj, (flags >> 6) & 07);
+    if (err < 0)
+        return err;
+    *obj_out = obj;
+    return 0;
+}
+
+// Sleeps on the object, called with ipc_lock held. Returns _EIDRM if the
+// object was removed in the meantime, in which case it must not be touched.
+static int ipc_wait(struct ipc_object *obj, struct timespec *deadline) {
+    struct timespec timeout;
+    if (deadline != NULL) {
+        timeout = timespec_subtract(*deadline, timespec_now(CLOCK_MONOTONIC));
+        if (!timespec_positive(timeout))
+            return _EAGAIN;
+    }
+    obj->waiters++;
+    int err = wait_for(&obj->cond, &ipc_lock, deadline ? &timeout : NULL);
+    obj->waiters--;
+    if (obj->removed) {
+        if (obj->waiters == 0)
+            obj->free(obj);
+        return _EIDRM;
+    }
+    if (err == _ETIMEDOUT)
+        return _EAGAIN;
+    return err;
+}
+
+static void ipc_perm_to_user(struct ipc_object *obj, struct ipc64_perm_ *perm) {
+    *perm = (struct ipc64_perm_) {
+        .key = obj->key,
+        .uid = obj->uid,
+        .gid = obj->gid,
+        .cuid = obj->cuid,
+        .cgid = obj->cgid,
+        .mode = obj->mode,
+        .seq = obj->id / IPC_MAX,
+    };
+}
+
+static int ipc_set_perm(struct ipc_object *obj, struct ipc64_perm_ *perm) {
+    if (!ipc_is_owner(obj))
+        return _EPERM;
+    obj->uid = perm->uid;
+    obj->gid = perm->gid;
+    obj->mode = (obj->mode & ~0777) | (perm->mode & 0777);
+    obj->ctime = ipc_now();
+    return 0;
+}
+
+// Handles the parts of IPC_STAT/IPC_SET/IPC_RMID that are the same for every
+// type. *STAT commands take an index instead of an id.
+static struct ipc_object *ipc_ctl_lookup(struct ipc_ids *ids, int_t id, bool by_index) {
+    if (by_index) {
+        if (id < 0 || id >= IPC_MAX)
+            return NULL;
+        return ids->objects[id];
+    }
+    return ipc_lookup(ids, id);
+}
+
+// shared memory
+
+#define SHM_RDONLY_ 010000
+#define SHM_RND_ 020000
+#define SHM_REMAP_ 040000
+#define SHM_EXEC_ 0100000
+
+#define SHM_LOCK_ 11
+#define SHM_UNLOCK_ 12
+#define SHM_STAT_ 13
+#define SHM_INFO_ 14
+
+#define SHMMIN_ 1
+#define SHMMAX_ 0x40000000
+#define SHMALL_ (SHMMAX_ / PAGE_SIZE)
+
+struct shmid64_ds_ {
+    struct ipc64_perm_ perm;
+    dword_t segsz;
+    dword_t atime;
+    dword_t atime_high;
+    dword_t dtime;
+    dword_t dtime_high;
+    dword_t ctime;
+    dword_t ctime_high;
+    pid_t_ cpid;
+    pid_t_ lpid;
+    dword_t nattch;
+    dword_t unused4;
+    dword_t unused5;
+};
+
+struct shminfo64_ {
+    dword_t shmmax;
+    dword_t shmmin;
+    dword_t shmmni;
+    dword_t shmseg;
+    dword_t shmall;
+    dword_t unused[4];
+};
+
+struct shm_info_ {
+    int_t used_ids;
+    dword_t shm_tot;
+    dword_t shm_rss;
+    dword_t shm_swp;
+    dword_t swap_attempts;
+    dword_t swap_successes;
+};
+
+// The segment is owned by an adhoc fd. The id table holds one reference and
+// every attached mapping holds one through its struct data, so the segment
+// (and its host memory) goes away once it's removed and the last mapping is
+// unmapped, whether by shmdt, munmap, exec, or exit. A forked child shares
+// its parent's struct data, so like a lot of things nattch is approximate.
+struct shm {
+    struct ipc_object ipc;
+    dword_t size; // immutable
+    int host_fd; // immutable
+    struct fd *fd;
+    pid_t_ cpid, lpid;
+    dword_t atime, dtime;
+    char name[24]; // for /proc/pid/maps
+};
+
+static struct ipc_ids shm_ids;
+static const struct fd_ops shm_fd_ops;
+
+static void shm_free(struct ipc_object *obj) {
+    struct shm *shm = (struct shm *) obj;
+    fd_close(shm->fd);
+}
+
+static int shm_fd_close(struct fd *fd) {
+    struct shm *shm = fd->data;
+    close(shm->host_fd);
+    cond_destroy(&shm->ipc.cond);
+    free(shm);
+    return 0;
+}
+
+static const struct fd_ops shm_fd_ops = {
+    .close = shm_fd_close,
+};
+
+static struct shm *shm_lookup(int_t id) {
+    return (struct shm *) ipc_lookup(&shm_ids, id);
+}
+
+static dword_t shm_nattch(struct shm *shm) {
+    return shm->fd->refcount - 1;
+}
+
+int_t sys_shmget(int_t key, uint_t size, int_t flags) {
+    STRACE("shmget(%#x, %#x, %#o)", key, size, flags);
+    lock(&ipc_lock);
+    struct ipc_object *obj;
+    int err = ipc_get_existing(&shm_ids, key, flags, &obj);
+    if (err < 0)
+        goto out;
+    if (obj != NULL) {
+        err = size > ((struct shm *) obj)->size ? _EINVAL : obj->id;
+        goto out;
+    }
+
+    err = _EINVAL;
+    if (size < SHMMIN_ || size > SHMMAX_)
+        goto out;
+    err = _ENOMEM;
+    struct shm *shm = malloc(sizeof(struct shm));
+    if (shm == NULL)
+        goto out;
+    shm->host_fd = create_shared_memory(BYTES_ROUND_UP(size));
+    if (shm->host_fd < 0) {
+        err = errno_map();
+        free(shm);
+        goto out;
+    }
+    shm->fd = adhoc_fd_create(&shm_fd_ops);
+    if (shm->fd == NULL) {
+        close(shm->host_fd);
+        free(shm);
+        goto out;
+    }
+    shm->fd->data = shm;
+    shm->size = size;
+    shm->cpid = current->pid;
+    shm->lpid = 0;
+    shm->atime = shm->dtime = 0;
+    shm->ipc.free = shm_free;
+    err = ipc_insert(&shm_ids, &shm->ipc, key, flags);
+    if (err < 0) {
+        fd_close(shm->fd);
+        goto out;
+    }
+    snprintf(shm->name, sizeof(shm->name), "/SYSV%08x", (unsigned) key);
+out:
+    unlock(&ipc_lock);
+    return err;
+}
+
+static int do_shmat(int_t id, addr_t addr, int_t flags, addr_t *addr_out) {
+    lock(&ipc_lock);
+    struct shm *shm = shm_lookup(id);
+    if (shm == NULL) {
+        unlock(&ipc_lock);
+        return _EINVAL;
+    }
+    int err = ipc_check_perm(&shm->ipc, flags & SHM_RDONLY_ ? AC_R : AC_R | AC_W);
+    if (err < 0) {
+        unlock(&ipc_lock);
+        return err;
+    }
+    // this reference is given to the mapping
+    struct fd *fd = fd_retain(shm->fd);
+    shm->atime = ipc_now();
+    shm->lpid = current->pid;
+    unlock(&ipc_lock);
+
+    unsigned prot = P_READ | P_SHARED;
+    int host_prot = PROT_READ;
+    if (!(flags & SHM_RDONLY_)) {
+        prot |= P_WRITE;
+        host_prot |= PROT_WRITE;
+    }
+    if (flags & SHM_EXEC_)
+        prot |= P_EXEC;
+    pages_t pages = PAGE_ROUND_UP(shm->size);
+
+    write_wrlock(&current->mem->lock);
+    page_t page;
+    if (addr != 0) {
+        if (flags & SHM_RND_)
+            addr = BYTES_ROUND_DOWN(addr);
+        err = _EINVAL;
+        if (PGOFFSET(addr) != 0)
+            goto out_unlock;
+        page = PAGE(addr);
+        if (!(flags & SHM_REMAP_) && !pt_is_hole(current->mem, page, pages))
+            goto out_unlock;
+    } else {
+        err = _EINVAL;
+        if (flags & SHM_REMAP_)
+            goto out_unlock;
+        err = _ENOMEM;
+        page = pt_find_hole(current->mem, pages);
+        if (page == BAD_PAGE)
+            goto out_unlock;
+    }
+
+    void *memory = mmap(NULL, pages * PAGE_SIZE, host_prot, MAP_SHARED, shm->host_fd, 0);
+    err = _ENOMEM;
+    if (memory == MAP_FAILED)
+        goto out_unlock;
+    err = pt_map(current->mem, page, pages, memory, 0, prot);
+    if (err < 0) {
+        munmap(memory, pages * PAGE_SIZE);
+        goto out_unlock;
+    }
+    struct data *data = mem_pt(current->mem, page)->data;
+    data->fd = fd;
+    data->name = shm->name;
+    write_wrunlock(&current->mem->lock);
+    *addr_out = page << PAGE_BITS;
+    return 0;
+
+out_unlock:
+    write_wrunlock(&current->mem->lock);
+    fd_close(fd);
+    return err;
+}
+
+addr_t sys_shmat(int_t id, addr_t addr, int_t flags) {
+    STRACE("shmat(%d, %#x, %#o)", id, addr, flags);
+    int err = do_shmat(id, addr, flags, &addr);
+    if (err < 0)
+        return err;
+    return addr;
+}
+
+int_t sys_shmdt(addr_t addr) {
+    STRACE("shmdt(%#x)", addr);
+    if (PGOFFSET(addr) != 0)
+        return _EINVAL;
+    write_wrlock(&current->mem->lock);
+    struct pt_entry *entry = mem_pt(current->mem, PAGE(addr));
+    if (entry == NULL || entry->offset != 0 ||
+            entry->data->fd == NULL || entry->data->fd->ops != &shm_fd_ops) {
+        write_wrunlock(&current->mem->lock);
+        return _EINVAL;
+    }
+    struct data *data = entry->data;
+    struct shm *shm = data->fd->data;
+    lock(&ipc_lock);
+    shm->dtime = ipc_now();
+    shm->lpid = current->pid;
+    unlock(&ipc_lock);
+
+    // Only unmap what's left of this particular attachment. The data (and
+    // maybe the segment) is freed when the last page goes, after which no
+    // page table entry can point to it anymore.
+    page_t end = PAGE(addr) + PAGE_ROUND_UP(shm->size);
+    for (page_t page = PAGE(addr); page < end; page++) {
+        entry = mem_pt(current->mem, page);
+        if (entry != NULL && entry->data == data)
+            pt_unmap_always(current->mem, page, 1);
+    }
+    write_wrunlock(&current->mem->lock);
+    return 0;
+}
+
+int_t sys_shmctl(int_t id, int_t cmd, addr_t buf_addr) {
+    STRACE("shmctl(%d, %d, %#x)", id, cmd, buf_addr);
+    cmd &= ~IPC_64_;
+    if (cmd == IPC_INFO_) {
+        struct shminfo64_ info = {
+            .shmmax = SHMMAX_,
+            .shmmin = SHMMIN_,
+            .shmmni = IPC_MAX,
+            .shmseg = IPC_MAX,
+            .shmall = SHMALL_,
+        };
+        if (user_put(buf_addr, info))
+            return _EFAULT;
+        return IPC_MAX - 1;
+    }
+
+    lock(&ipc_lock);
+    int err;
+    if (cmd == SHM_INFO_) {
+        struct shm_info_ info = {.used_ids = shm_ids.in_use};
+        for (unsigned i = 0; i < IPC_MAX; i++) {
+            struct shm *shm = (struct shm *) shm_ids.objects[i];
+            if (shm != NULL)
+                info.shm_tot += PAGE_ROUND_UP(shm->size);
+        }
+        info.shm_rss = info.shm_tot;
+        unlock(&ipc_lock);
+        if (user_put(buf_addr, info))
+            return _EFAULT;
+        return IPC_MAX - 1;
+    }
+
+    struct shm *shm = (struct shm *) ipc_ctl_lookup(&shm_ids, id, cmd == SHM_STAT_);
+    err = _EINVAL;
+    if (shm == NULL)
+        goto out;
+
+    struct shmid64_ds_ ds;
+    switch (cmd) {
+        case IPC_STAT_:
+        case SHM_STAT_:
+            if ((err = ipc_check_perm(&shm->ipc, AC_R)) < 0)
+                break;
+            ds = (struct shmid64_ds_) {
+                .segsz = shm->size,
+                .atime = shm->atime,
+                .dtime = shm->dtime,
+                .ctime = shm->ipc.ctime,
+                .cpid = shm->cpid,
+                .lpid = shm->lpid,
+                .nattch = shm_nattch(shm),
+            };
+            ipc_perm_to_user(&shm->ipc, &ds.perm);
+            unlock(&ipc_lock);
+            if (user_put(buf_addr, ds))
+                return _EFAULT;
+            return cmd == SHM_STAT_ ? shm->ipc.id : 0;
+
+        case IPC_SET_:
+            err = _EFAULT;
+            if (user_get(buf_addr, ds))
+                break;
+            err = ipc_set_perm(&shm->ipc, &ds.perm);
+            break;
+
+        case IPC_RMID_:
+            err = _EPERM;
+            if (!ipc_is_owner(&shm->ipc))
+                break;
+            ipc_remove(&shm_ids, &shm->ipc);
+            err = 0;
+            break;
+
+        case SHM_LOCK_:
+        case SHM_UNLOCK_:
+            // there's no swap to be locked out of
+            err = 0;
+            break;
+
+        default:
+            err = _EINVAL;
+    }
+out:
+    unlock(&ipc_lock);
+    return err;
+}
+
+// semaphores
+
+#define SEM_UNDO_ 0x1000
+
+#define GETPID_ 11
+#define GETVAL_ 12
+#define GETALL_ 13
+#define GETNCNT_ 14
+#define GETZCNT_ 15
+#define SETVAL_ 16
+#define SETALL_ 17
+#define SEM_STAT_ 18
+#define SEM_INFO_ 19
+
+#define SEMMSL_ 32000
+#define SEMOPM_ 500
+#define SEMVMX_ 32767
+
+struct semid64_ds_ {
+    struct ipc64_perm_ perm;
+    dword_t otime;
+    dword_t otime_high;
+    dword_t ctime;
+    dword_t ctime_high;
+    dword_t nsems;
+    dword_t unused3;
+    dword_t unused4;
+};
+
+struct seminfo_ {
+    int_t semmap;
+    int_t semmni;
+    int_t semmns;
+    int_t semmnu;
+    int_t semmsl;
+    int_t semopm;
+    int_t semume;
+    int_t semusz;
+    int_t semvmx;
+    int_t semaem;
+};
+
+struct sembuf_ {
+    word_t num;
+    int16_t op;
+    int16_t flg;
+};
+
+struct sem {
+    word_t val;
+    pid_t_ pid;
+    unsigned ncnt; // waiting for val to increase
+    unsigned zcnt; // waiting for val to become zero
+};
+
+struct sem_set {
+    struct ipc_object ipc;
+    dword_t otime;
+    unsigned nsems; // immutable
+    struct sem sems[];
+};
+
+static struct ipc_ids sem_ids;
+
+static void sem_set_free(struct ipc_object *obj) {
+    cond_destroy(&obj->cond);
+    free(obj);
+}
+
+static struct sem_set *sem_lookup(int_t id) {
+    return (struct sem_set *) ipc_lookup(&sem_ids, id);
+}
+
+int_t sys_semget(int_t key, int_t nsems, int_t flags) {
+    STRACE("semget(%#x, %d, %#o)", key, nsems, flags);
+    lock(&ipc_lock);
+    struct ipc_object *obj;
+    int err = ipc_get_existing(&sem_ids, key, flags, &obj);
+    if (err < 0)
+        goto out;
+    if (obj != NULL) {
+        err = (unsigned) nsems > ((struct sem_set *) obj)->nsems ? _EINVAL : obj->id;
+        goto out;
+    }
+
+    err = _EINVAL;
+    if (nsems <= 0 || nsems > SEMMSL_)
+        goto out;
+    err = _ENOMEM;
+    struct sem_set *set = calloc(1, sizeof(struct sem_set) + nsems * sizeof(struct sem));
+    if (set == NULL)
+        goto out;
+    set->nsems = nsems;
+    set->ipc.free = sem_set_free;
+    err = ipc_insert(&sem_ids, &set->ipc, key, flags);
+    if (err < 0)
+        free(set);
+out:
+    unlock(&ipc_lock);
+    return err;
+}
+
+// Tries to apply all of the operations atomically. Returns the index of the
+// operation that would block, or -1 if everything was applied.
+static int sem_try_ops(struct sem_set *set, struct sembuf_ *sops, unsigned nsops, int *err) {
+    *err = 0;
+    unsigned i;
+    for (i = 0; i < nsops; i++) {
+        struct sem *sem = &set->sems[sops[i].num];
+        int val = sem->val + sops[i].op;
+        if (sops[i].op == 0 ? sem->val != 0 : val < 0)
+            break;
+        if (val > SEMVMX_) {
+            *err = _ERANGE;
+            break;
+        }
+        sem->val = val;
+    }
+    if (i == nsops) {
+        for (i = 0; i < nsops; i++)
+            set->sems[sops[i].num].pid = current->tgid;
+        return -1;
+    }
+    // roll back what was done so far
+    for (unsigned j = 0; j < i; j++)
+        set->sems[sops[j].num].val -= sops[j].op;
+    return i;
+}
+
+static int do_semtimedop(int_t id, addr_t sops_addr, uint_t nsops, struct timespec *timeout) {
+    if (nsops < 1)
+        return _EINVAL;
+    if (nsops > SEMOPM_)
+        return _E2BIG;
+    struct sembuf_ *sops = malloc(nsops * sizeof(struct sembuf_));
+    if (sops == NULL)
+        return _ENOMEM;
+    int err = _EFAULT;
+    if (user_read(sops_addr, sops, nsops * sizeof(struct sembuf_)))
+        goto out_free;
+
+    struct timespec deadline;
+    if (timeout != NULL)
+        deadline = timespec_add(timespec_now(CLOCK_MONOTONIC), *timeout);
+
+    lock(&ipc_lock);
+    struct sem_set *set = sem_lookup(id);
+    err = _EINVAL;
+    if (set == NULL)
+        goto out_unlock;
+    bool alter = false;
+    for (unsigned i = 0; i < nsops; i++) {
+        err = _EFBIG;
+        if (sops[i].num >= set->nsems)
+            goto out_unlock;
+        if (sops[i].op != 0)
+            alter = true;
+        if (sops[i].flg & SEM_UNDO_)
+            // FIXME: adjustments aren't recorded, so they won't be undone at exit
+            TRACE("semop: SEM_UNDO is ignored");
+    }
+    if ((err = ipc_check_perm(&set->ipc, alter ? AC_W : AC_R)) < 0)
+        goto out_unlock;
+
+    while (true) {
+        int blocked = sem_try_ops(set, sops, nsops, &err);
+        if (err < 0)
+            break;
+        if (blocked < 0) {
+            set->otime = ipc_now();
+            notify(&set->ipc.cond);
+            err = 0;
+            break;
+        }
+        err = _EAGAIN;
+        if (sops[blocked].flg & IPC_NOWAIT_)
+            break;
+        struct sem *sem = &set->sems[sops[blocked].num];
+        bool zero = sops[blocked].op == 0;
+        if (zero)
+            sem->zcnt++;
+        else
+            sem->ncnt++;
+        err = ipc_wait(&set->ipc, timeout ? &deadline : NULL);
+        if (err == _EIDRM)
+            goto out_unlock;
+        if (zero)
+            sem->zcnt--;
+        else
+            sem->ncnt--;
+        if (err < 0)
+            break;
+    }
+out_unlock:
+    unlock(&ipc_lock);
+out_free:
+    free(sops);
+    return err;
+}
+
+int_t sys_semtimedop(int_t id, addr_t sops_addr, uint_t nsops, addr_t timeout_addr) {
+    STRACE("semtimedop(%d, %#x, %u, %#x)", id, sops_addr, nsops, timeout_addr);
+    struct timespec timeout;
+    if (timeout_addr != 0) {
+        struct timespec_ timeout_;
+        if (user_get(timeout_addr, timeout_))
+            return _EFAULT;
+        timeout = convert_timespec(timeout_);
+    }
+    return do_semtimedop(id, sops_addr, nsops, timeout_addr ? &timeout : NULL);
+}
+
+int_t sys_semop(int_t id, addr_t sops_addr, uint_t nsops) {
+    return sys_semtimedop(id, sops_addr, nsops, 0);
+}
+
+int_t sys_semctl(int_t id, int_t num, int_t cmd, dword_t arg) {
+    STRACE("semctl(%d, %d, %d, %#x)", id, num, cmd, arg);
+    cmd &= ~IPC_64_;
+    if (cmd == IPC_INFO_ || cmd == SEM_INFO_) {
+        struct seminfo_ info = {
+            .semmap = IPC_MAX * SEMMSL_,
+            .semmni = IPC_MAX,
+            .semmns = IPC_MAX * SEMMSL_,
+            .semmnu = IPC_MAX * SEMMSL_,
+            .semmsl = SEMMSL_,
+            .semopm = SEMOPM_,
+            .semume = SEMOPM_,
+            .semusz = 20,
+            .semvmx = SEMVMX_,
+            .semaem = SEMVMX_,
+        };
+        if (cmd == SEM_INFO_) {
+            lock(&ipc_lock);
+            info.semusz = sem_ids.in_use;
+            info.semaem = 0;
+            for (unsigned i = 0; i < IPC_MAX; i++) {
+                struct sem_set *set = (struct sem_set *) sem_ids.objects[i];
+                if (set != NULL)
+                    info.semaem += set->nsems;
+            }
+            unlock(&ipc_lock);
+        }
+        if (user_put(arg, info))
+            return _EFAULT;
+        return IPC_MAX - 1;
+    }
+
+    lock(&ipc_lock);
+    struct sem_set *set = (struct sem_set *) ipc_ctl_lookup(&sem_ids, id, cmd == SEM_STAT_);
+    int err = _EINVAL;
+    if (set == NULL)
+        goto out;
+    switch (cmd) {
+        case GETPID_:
+        case GETVAL_:
+        case GETNCNT_:
+        case GETZCNT_:
+        case SETVAL_:
+            err = _EINVAL;
+            if (num < 0 || (unsigned) num >= set->nsems)
+                goto out;
+    }
+
+    struct semid64_ds_ ds;
+    word_t *vals;
+    switch (cmd) {
+        case IPC_STAT_:
+        case SEM_STAT_:
+            if ((err = ipc_check_perm(&set->ipc, AC_R)) < 0)
+                break;
+            ds = (struct semid64_ds_) {
+                .otime = set->otime,
+                .ctime = set->ipc.ctime,
+                .nsems = set->nsems,
+            };
+            ipc_perm_to_user(&set->ipc, &ds.perm);
+            err = cmd == SEM_STAT_ ? set->ipc.id : 0;
+            unlock(&ipc_lock);
+            if (user_put(arg, ds))
+                return _EFAULT;
+            return err;
+
+        case IPC_SET_:
+            err = _EFAULT;
+            if (user_get(arg, ds))
+                break;
+            err = ipc_set_perm(&set->ipc, &ds.perm);
+            break;
+
+        case IPC_RMID_:
+            err = _EPERM;
+            if (!ipc_is_owner(&set->ipc))
+                break;
+            ipc_remove(&sem_ids, &set->ipc);
+            err = 0;
+            break;
+
+        case GETPID_:
+        case GETVAL_:
+        case GETNCNT_:
+        case GETZCNT_:
+            if ((err = ipc_check_perm(&set->ipc, AC_R)) < 0)
+                break;
+            struct sem *sem = &set->sems[num];
+            err = cmd == GETPID_ ? sem->pid :
+                cmd == GETVAL_ ? sem->val :
+                cmd == GETNCNT_ ? (int_t) sem->ncnt : (int_t) sem->zcnt;
+            break;
+
+        case SETVAL_:
+            if ((err = ipc_check_perm(&set->ipc, AC_W)) < 0)
+                break;
+            err = _ERANGE;
+            if ((int_t) arg < 0 || (int_t) arg > SEMVMX_)
+                break;
+            set->sems[num].val = arg;
+            set->sems[num].pid = current->tgid;
+            set->ipc.ctime = ipc_now();
+            notify(&set->ipc.cond);
+            err = 0;
+            break;
+
+        case GETALL_:
+        case SETALL_:
+            if ((err = ipc_check_perm(&set->ipc, cmd == GETALL_ ? AC_R : AC_W)) < 0)
+                break;
+            err = _ENOMEM;
+            vals = malloc(set->nsems * sizeof(word_t));
+            if (vals == NULL)
+                break;
+            if (cmd == GETALL_) {
+                for (unsigned i = 0; i < set->nsems; i++)
+                    vals[i] = set->sems[i].val;
+                err = user_write(arg, vals, set->nsems * sizeof(word_t)) ? _EFAULT : 0;
+                free(vals);
+                break;
+            }
+            err = _EFAULT;
+            if (user_read(arg, vals, set->nsems * sizeof(word_t)) == 0) {
+                err = 0;
+                for (unsigned i = 0; i < set->nsems; i++)
+                    if (vals[i] > SEMVMX_)
+                        err = _ERANGE;
+            }
+            if (err == 0) {
+                for (unsigned i = 0; i < set->nsems; i++) {
+                    set->sems[i].val = vals[i];
+                    set->sems[i].pid = current->tgid;
+                }
+                set->ipc.ctime = ipc_now();
+                notify(&set->ipc.cond);
+            }
+            free(vals);
+            break;
+
+        default:
+            err = _EINVAL;
+    }
+out:
+    unlock(&ipc_lock);
+    return err;
+}
+
+// message queues
+
+#define MSG_NOERROR_ 010000
+#define MSG_EXCEPT_ 020000
+#define MSG_COPY_ 040000
+
+#define MSG_STAT_ 11
+#define MSG_INFO_ 12
+
+#define MSGMAX_ 8192
+#define MSGMNB_ 16384
+
+struct msqid64_ds_ {
+    struct ipc64_perm_ perm;
+    dword_t stime;
+    dword_t stime_high;
+    dword_t rtime;
+    dword_t rtime_high;
+    dword_t ctime;
+    dword_t ctime_high;
+    dword_t cbytes;
+    dword_t qnum;
+    dword_t qbytes;
+    pid_t_ lspid;
+    pid_t_ lrpid;
+    dword_t unused4;
+    dword_t unused5;
+};
+
+struct msginfo_ {
+    int_t msgpool;
+    int_t msgmap;
+    int_t msgmax;
+    int_t msgmnb;
+    int_t msgmni;
+    int_t msgssz;
+    int_t msgtql;
+    word_t msgseg;
+};
+
+struct msg {
+    struct list queue;
+    int_t type;
+    uint_t size;
+    char text[];
+};
+
+struct msg_queue {
+    struct ipc_object ipc;
+    struct list messages;
+    dword_t cbytes;
+    dword_t qnum;
+    dword_t qbytes;
+    pid_t_ lspid, lrpid;
+    dword_t stime, rtime;
+};
+
+static struct ipc_ids msg_ids;
+
+static void msg_queue_free(struct ipc_object *obj) {
+    struct msg_queue *queue = (struct msg_queue *) obj;
+    struct msg *msg, *tmp;
+    list_for_each_entry_safe(&queue->messages, msg, tmp, queue) {
+        list_remove(&msg->queue);
+        free(msg);
+    }
+    cond_destroy(&obj->cond);
+    free(queue);
+}
+
+static struct msg_queue *msg_lookup(int_t id) {
+    return (struct msg_queue *) ipc_lookup(&msg_ids, id);
+}
+
+int_t sys_msgget(int_t key, int_t flags) {
+    STRACE("msgget(%#x, %#o)", key, flags);
+    lock(&ipc_lock);
+    struct ipc_object *obj;
+    int err = ipc_get_existing(&msg_ids, key, flags, &obj);
+    if (err < 0)
+        goto out;
+    if (obj != NULL) {
+        err = obj->id;
+        goto out;
+    }
+
+    err = _ENOMEM;
+    struct msg_queue *queue = malloc(sizeof(struct msg_queue));
+    if (queue == NULL)
+        goto out;
+    list_init(&queue->messages);
+    queue->cbytes = queue->qnum = 0;
+    queue->qbytes = MSGMNB_;
+    queue->lspid = queue->lrpid = 0;
+    queue->stime = queue->rtime = 0;
+    queue->ipc.free = msg_queue_free;
+    err = ipc_insert(&msg_ids, &queue->ipc, key, flags);
+    if (err < 0)
+        free(queue);
+out:
+    unlock(&ipc_lock);
+    return err;
+}
+
+int_t sys_msgsnd(int_t id, addr_t msg_addr, uint_t size, int_t flags) {
+    STRACE("msgsnd(%d, %#x, %u, %#o)", id, msg_addr, size, flags);
+    if (size > MSGMAX_)
+        return _EINVAL;
+    struct msg *msg = malloc(sizeof(struct msg) + size);
+    if (msg == NULL)
+        return _ENOMEM;
+    int err = _EFAULT;
+    if (user_get(msg_addr, msg->type) ||
+            user_read(msg_addr + sizeof(int_t), msg->text, size))
+        goto out_free;
+    err = _EINVAL;
+    if (msg->type < 1)
+        goto out_free;
+    msg->size = size;
+
+    lock(&ipc_lock);
+    struct msg_queue *queue = msg_lookup(id);
+    err = _EINVAL;
+    if (queue == NULL)
+        goto out_unlock;
+    if ((err = ipc_check_perm(&queue->ipc, AC_W)) < 0)
+        goto out_unlock;
+    while (queue->cbytes + size > queue->qbytes || queue->qnum + 1 > queue->qbytes) {
+        err = _EAGAIN;
+        if (flags & IPC_NOWAIT_)
+            goto out_unlock;
+        err = ipc_wait(&queue->ipc, NULL);
+        if (err < 0)
+            goto out_unlock;
+    }
+    list_add_tail(&queue->messages, &msg->queue);
+    queue->cbytes += size;
+    queue->qnum++;
+    queue->lspid = current->tgid;
+    queue->stime = ipc_now();
+    notify(&queue->ipc.cond);
+    unlock(&ipc_lock);
+    return 0;
+
+out_unlock:
+    unlock(&ipc_lock);
+out_free:
+    free(msg);
+    return err;
+}
+
+static struct msg *msg_find(struct msg_queue *queue, int_t type, int_t flags) {
+    struct msg *msg, *found = NULL;
+    list_for_each_entry(&queue->messages, msg, queue) {
+        if (type == 0)
+            return msg;
+        if (type > 0) {
+            if ((msg->type == type) != !!(flags & MSG_EXCEPT_))
+                return msg;
+        } else if (msg->type <= -type && (found == NULL || msg->type < found->type)) {
+            found = msg;
+        }
+    }
+    return found;
+}
+
+int_t sys_msgrcv(int_t id, addr_t msg_addr, uint_t size, int_t type, int_t flags) {
+    STRACE("msgrcv(%d, %#x, %u, %d, %#o)", id, msg_addr, size, type, flags);
+    if ((int_t) size < 0)
+        return _EINVAL;
+    if (flags & MSG_COPY_)
+        return _ENOSYS;
+
+    lock(&ipc_lock);
+    struct msg_queue *queue = msg_lookup(id);
+    int err = _EINVAL;
+    if (queue == NULL)
+        goto out_unlock;
+    if ((err = ipc_check_perm(&queue->ipc, AC_R)) < 0)
+        goto out_unlock;
+    struct msg *msg;
+    while ((msg = msg_find(queue, type, flags)) == NULL) {
+        err = _ENOMSG;
+        if (flags & IPC_NOWAIT_)
+            goto out_unlock;
+        err = ipc_wait(&queue->ipc, NULL);
+        if (err < 0)
+            goto out_unlock;
+    }
+    err = _E2BIG;
+    if (msg->size > size && !(flags & MSG_NOERROR_))
+        goto out_unlock;
+    list_remove(&msg->queue);
+    queue->cbytes -= msg->size;
+    queue->qnum--;
+    queue->lrpid = current->tgid;
+    queue->rtime = ipc_now();
+    notify(&queue->ipc.cond);
+    unlock(&ipc_lock);
+
+    // like linux, the message is lost if it can't be copied out
+    if (msg->size < size)
+        size = msg->size;
+    err = size;
+    if (user_put(msg_addr, msg->type) ||
+            user_write(msg_addr + sizeof(int_t), msg->text, size))
+        err = _EFAULT;
+    free(msg);
+    return err;
+
+out_unlock:
+    unlock(&ipc_lock);
+    return err;
+}
+
+int_t sys_msgctl(int_t id, int_t cmd, addr_t buf_addr) {
+    STRACE("msgctl(%d, %d, %#x)", id, cmd, buf_addr);
+    cmd &= ~IPC_64_;
+    if (cmd == IPC_INFO_ || cmd == MSG_INFO_) {
+        struct msginfo_ info = {
+            .msgpool = IPC_MAX * MSGMNB_ / 1024,
+            .msgmap = MSGMNB_,
+            .msgmax = MSGMAX_,
+            .msgmnb = MSGMNB_,
+            .msgmni = IPC_MAX,
+            .msgssz = 16,
+            .msgtql = MSGMNB_,
+            .msgseg = 0xffff,
+        };
+        if (cmd == MSG_INFO_) {
+            lock(&ipc_lock);
+            info.msgpool = msg_ids.in_use;
+            info.msgmap = info.msgtql = 0;
+            for (unsigned i = 0; i < IPC_MAX; i++) {
+                struct msg_queue *queue = (struct msg_queue *) msg_ids.objects[i];
+                if (queue == NULL)
+                    continue;
+                info.msgmap += queue->qnum;
+                info.msgtql += queue->cbytes;
+            }
+            unlock(&ipc_lock);
+        }
+        if (user_put(buf_addr, info))
+            return _EFAULT;
+        return IPC_MAX - 1;
+    }
+
+    lock(&ipc_lock);
+    struct msg_queue *queue = (struct msg_queue *) ipc_ctl_lookup(&msg_ids, id, cmd == MSG_STAT_);
+    int err = _EINVAL;
+    if (queue == NULL)
+        goto out;
+
+    struct msqid64_ds_ ds;
+    switch (cmd) {
+        case IPC_STAT_:
+        case MSG_STAT_:
+            if ((err = ipc_check_perm(&queue->ipc, AC_R)) < 0)
+                break;
+            ds = (struct msqid64_ds_) {
+                .stime = queue->stime,
+                .rtime = queue->rtime,
+                .ctime = queue->ipc.ctime,
+                .cbytes = queue->cbytes,
+                .qnum = queue->qnum,
+                .qbytes = queue->qbytes,
+                .lspid = queue->lspid,
+                .lrpid = queue->lrpid,
+            };
+            ipc_perm_to_user(&queue->ipc, &ds.perm);
+            err = cmd == MSG_STAT_ ? queue->ipc.id : 0;
+            unlock(&ipc_lock);
+            if (user_put(buf_addr, ds))
+                return _EFAULT;
+            return err;
+
+        case IPC_SET_:
+            err = _EFAULT;
+            if (user_get(buf_addr, ds))
+                break;
+            err = _EPERM;
+            if (ds.qbytes > MSGMNB_ && !superuser())
+                break;
+            if ((err = ipc_set_perm(&queue->ipc, &ds.perm)) < 0)
+                break;
+            queue->qbytes = ds.qbytes;
+            notify(&queue->ipc.cond);
+            break;
+
+        case IPC_RMID_:
+            err = _EPERM;
+            if (!ipc_is_owner(&queue->ipc))
+                break;
+            ipc_remove(&msg_ids, &queue->ipc);
+            err = 0;
+            break;
+
+        default:
+            err = _EINVAL;
+    }
+out:
+    unlock(&ipc_lock);
+    return err;
+}
+
+// the multiplexer, which is what musl uses on i386
+
+#define SEMOP 1
+#define SEMGET 2
+#define SEMCTL 3
+#define SEMTIMEDOP 4
+#define MSGSND 11
+#define MSGRCV 12
+#define MSGGET 13
+#define MSGCTL 14
+#define SHMAT 21
+#define SHMDT 22
+#define SHMGET 23
+#define SHMCTL 24
+
+struct ipc_kludge_ {
+    addr_t msgp;
+    int_t msgtyp;
+};
 
 int_t sys_ipc(uint_t call, int_t first, int_t second, int_t third, addr_t ptr, int_t fifth) {
     STRACE("ipc(%u, %d, %d, %d, %#x, %d)", call, first, second, third, ptr, fifth);
+    uint_t version = call >> 16;
+    switch (call & 0xffff) {
+        case SEMOP:
+            return sys_semtimedop(first, ptr, second, 0);
+        case SEMTIMEDOP:
+            return sys_semtimedop(first, ptr, second, fifth);
+        case SEMGET:
+            return sys_semget(first, second, third);
+        case SEMCTL: {
+            dword_t arg;
+            if (user_get(ptr, arg))
+                return _EFAULT;
+            return sys_semctl(first, second, third, arg);
+        }
+
+        case MSGSND:
+            return sys_msgsnd(first, ptr, second, third);
+        case MSGRCV:
+            if (version == 0) {
+                struct ipc_kludge_ kludge;
+                if (user_get(ptr, kludge))
+                    return _EFAULT;
+                return sys_msgrcv(first, kludge.msgp, second, kludge.msgtyp, third);
+            }
+            return sys_msgrcv(first, ptr, second, fifth, third);
+        case MSGGET:
+            return sys_msgget(first, second);
+        case MSGCTL:
+            return sys_msgctl(first, second, ptr);
+
+        case SHMAT: {
+            if (version == 1)
+                return _EINVAL;
+            STRACE("shmat(%d, %#x, %#o)", first, ptr, second);
+            addr_t addr;
+            int err = do_shmat(first, ptr, second, &addr);
+            if (err < 0)
+                return err;
+            if (user_put(third, addr))
+                return _EFAULT;
+            return 0;
+        }
+        case SHMDT:
+            return sys_shmdt(ptr);
+        case SHMGET:
+            return sys_shmget(first, second, third);
+        case SHMCTL:
+            return sys_shmctl(first, second, ptr);
+    }
     return _ENOSYS;
 }
@@ -0,0 +1,323 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "kernel/errno.h"
+#include "kernel/ksm.h"
+#include "kernel/memory.h"
+#include "kernel/mm.h"
+#include "kernel/task.h"
+#include "util/list.h"
+#include "util/sync.h"
+
+// Merges identical private pages across all processes, like Linux's KSM.
+//
+// The scanner walks every address space a few pages at a time. A page that's
+// identical to one in the stable table gets replaced with a CoW reference to
+// it. A page whose hash was already seen during this pass gets copied into a
+// new stable page, and the earlier page with the same contents gets merged
+// the next time the scanner comes around. Writing to a merged page copies it
+// back out through the usual P_COW path.
+
+static lock_t ksm_lock = LOCK_INITIALIZER;
+static cond_t ksm_cond;
+static bool ksm_thread_started;
+
+// tunables, same names and defaults as linux
+static bool ksm_run;
+static unsigned ksm_pages_to_scan = 100;
+static unsigned ksm_sleep_millisecs = 20;
+
+static unsigned long ksm_full_scans;
+static unsigned long ksm_pages_unshared;
+
+// where the scanner left off
+static dword_t ksm_scan_pid;
+static page_t ksm_scan_page;
+
+struct ksm_page {
+    uint64_t hash;
+    struct data *data; // null for pages in the unstable table
+    struct list chain;
+};
+
+#define KSM_HASH_SIZE (1 << 12)
+// pages that have been merged into, each holds a reference to its data
+static struct list ksm_stable[KSM_HASH_SIZE];
+// hashes of pages seen during this pass that had no match, cleared every pass
+static struct list ksm_unstable[KSM_HASH_SIZE];
+
+static uint64_t ksm_hash(const void *page) {
+    const uint64_t *words = page;
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        hash = (hash ^ words[i]) * 0x100000001b3;
+    return hash;
+}
+
+static struct list *ksm_bucket(struct list *table, uint64_t hash) {
+    struct list *bucket = &table[hash % KSM_HASH_SIZE];
+    if (list_null(bucket))
+        list_init(bucket);
+    return bucket;
+}
+
+static struct data *ksm_stable_find(const void *page, uint64_t hash) {
+    struct ksm_page *kpage;
+    list_for_each_entry(ksm_bucket(ksm_stable, hash), kpage, chain) {
+        if (kpage->hash == hash && memcmp(kpage->data->data, page, PAGE_SIZE) == 0)
+            return kpage->data;
+    }
+    return NULL;
+}
+
+static struct data *ksm_stable_add(const void *page, uint64_t hash) {
+    void *memory = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+    memcpy(memory, page, PAGE_SIZE);
+    // nothing is ever supposed to write to it again
+    mprotect(memory, PAGE_SIZE, PROT_READ);
+    struct ksm_page *kpage = malloc(sizeof(struct ksm_page));
+    struct data *data = malloc(sizeof(struct data));
+    if (kpage == NULL || data == NULL) {
+        free(kpage);
+        free(data);
+        munmap(memory, PAGE_SIZE);
+        return NULL;
+    }
+    *data = (struct data) {
+        .data = memory,
+        .size = PAGE_SIZE,
+        .refcount = 1,
+    };
+    kpage->hash = hash;
+    kpage->data = data;
+    list_add(ksm_bucket(ksm_stable, hash), &kpage->chain);
+    return data;
+}
+
+// Returns true if the hash was already in the unstable table, otherwise adds it
+static bool ksm_unstable_check(uint64_t hash) {
+    struct list *bucket = ksm_bucket(ksm_unstable, hash);
+    struct ksm_page *kpage;
+    list_for_each_entry(bucket, kpage, chain) {
+        if (kpage->hash == hash)
+            return true;
+    }
+    kpage = malloc(sizeof(struct ksm_page));
+    if (kpage == NULL)
+        return false;
+    kpage->hash = hash;
+    kpage->data = NULL;
+    list_add(bucket, &kpage->chain);
+    ksm_pages_unshared++;
+    return false;
+}
+
+// Called after every full pass. Throws away the unstable table, and stable
+// pages that nothing maps anymore (the only reference left is the table's,
+// and new references are only ever made from an existing one or by us).
+static void ksm_end_pass() {
+    for (int i = 0; i < KSM_HASH_SIZE; i++) {
+        struct ksm_page *kpage, *tmp;
+        if (!list_null(&ksm_unstable[i])) {
+            list_for_each_entry_safe(&ksm_unstable[i], kpage, tmp, chain) {
+                list_remove(&kpage->chain);
+                free(kpage);
+            }
+        }
+        if (!list_null(&ksm_stable[i])) {
+            list_for_each_entry_safe(&ksm_stable[i], kpage, tmp, chain) {
+                if (kpage->data->refcount == 1) {
+                    munmap(kpage->data->data, PAGE_SIZE);
+                    free(kpage->data);
+                    list_remove(&kpage->chain);
+                    free(kpage);
+                }
+            }
+        }
+    }
+    ksm_pages_unshared = 0;
+    ksm_full_scans++;
+}
+
+// Merging a page only saves memory if nothing else is using the memory behind
+// it. Every mapping of a struct data is at the same address in every process
+// (CoW copies keep the address), so it's enough to check that all of the
+// references are from this address space.
+static bool ksm_data_exclusive(struct mem *mem, struct pt_entry *entry, page_t page) {
+    struct data *data = entry->data;
+    if (data->refcount == 1)
+        return true;
+    page_t start = page - entry->offset / PAGE_SIZE;
+    unsigned refs = 0;
+    for (page_t p = start; p < start + data->size / PAGE_SIZE && p < MEM_PAGES; p++) {
+        struct pt_entry *pt = mem_pt(mem, p);
+        if (pt != NULL && pt->data == data)
+            refs++;
+    }
+    return refs == data->refcount;
+}
+
+// Look at up to pages_to_scan pages in mem starting from ksm_scan_page.
+// Returns false once it's reached the end. Must call with mem write-locked.
+static bool ksm_scan_mem(struct mem *mem) {
+    struct data *last_data = NULL;
+    bool last_exclusive = false;
+    unsigned scanned = 0;
+    for (page_t page = ksm_scan_page; page < MEM_PAGES; mem_next_page(mem, &page)) {
+        if (scanned >= ksm_pages_to_scan) {
+            ksm_scan_page = page;
+            return true;
+        }
+        struct pt_entry *entry = mem_pt(mem, page);
+        if (entry == NULL)
+            continue;
+        scanned++;
+        struct data *data = entry->data;
+        // only private memory that isn't backed by a file (or special)
+        if (entry->flags & (P_SHARED | P_GROWSDOWN) || data == &zero_page ||
+                data->fd != NULL || data->name != NULL)
+            continue;
+        if (data != last_data) {
+            last_data = data;
+            last_exclusive = ksm_data_exclusive(mem, entry, page);
+        }
+        if (!last_exclusive)
+            continue;
+
+        void *ptr = (char *) data->data + entry->offset;
+        uint64_t hash = ksm_hash(ptr);
+        struct data *stable = ksm_stable_find(ptr, hash);
+        if (stable == NULL && ksm_unstable_check(hash))
+            stable = ksm_stable_add(ptr, hash);
+        if (stable == NULL)
+            continue;
+
+        // If the data is going to survive the merge, give back the page
+        // we're done with. This needs the guest and host pages to be the
+        // same size.
+        bool survives = data->refcount > 1;
+        pt_merge(mem, page, stable);
+        if (!survives)
+            last_data = NULL;
+        else if (real_page_size == PAGE_SIZE)
+            madvise(ptr, PAGE_SIZE, MADV_DONTNEED);
+    }
+    ksm_scan_page = 0;
+    return false;
+}
+
+// Scan the next batch of pages. Must call with ksm_lock.
+static void ksm_scan_batch() {
+    while (true) {
+        struct mm *mm = NULL;
+        lock(&pids_lock);
+        struct task *task = pid_get_task(ksm_scan_pid);
+        // threads share the leader's mm
+        if (task != NULL && task_is_leader(task)) {
+            lock(&task->general_lock);
+            mm = task->mm;
+            if (mm != NULL)
+                mm_retain(mm);
+            unlock(&task->general_lock);
+        }
+        unlock(&pids_lock);
+
+        if (mm != NULL) {
+            write_wrlock(&mm->mem.lock);
+            bool more = ksm_scan_mem(&mm->mem);
+            write_wrunlock(&mm->mem.lock);
+            mm_release(mm);
+            if (more)
+                return;
+        }
+        lock(&pids_lock);
+        ksm_scan_pid = pid_next(ksm_scan_pid);
+        unlock(&pids_lock);
+        ksm_scan_page = 0;
+        if (ksm_scan_pid == 0)
+            break;
+        if (mm != NULL)
+            return;
+    }
+    ksm_end_pass();
+}
+
+static void *ksm_thread(void *UNUSED(arg)) {
+    lock(&ksm_lock);
+    while (true) {
+        while (!ksm_run)
+            wait_for_ignore_signals(&ksm_cond, &ksm_lock, NULL);
+        ksm_scan_batch();
+        struct timespec sleep = {
+            .tv_sec = ksm_sleep_millisecs / 1000,
+            .tv_nsec = (ksm_sleep_millisecs % 1000) * 1000000,
+        };
+        wait_for_ignore_signals(&ksm_cond, &ksm_lock, &sleep);
+    }
+    return NULL;
+}
+
+int ksm_set_run(unsigned run) {
+    if (run > 1)
+        return _EINVAL;
+    lock(&ksm_lock);
+    if (run && !ksm_thread_started) {
+        cond_init(&ksm_cond);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ksm_thread, NULL) != 0) {
+            unlock(&ksm_lock);
+            return _ENOMEM;
+        }
+        pthread_detach(thread);
+        ksm_thread_started = true;
+    }
+    ksm_run = run;
+    if (ksm_thread_started)
+        notify(&ksm_cond);
+    unlock(&ksm_lock);
+    return 0;
+}
+
+int ksm_set_pages_to_scan(unsigned pages) {
+    if (pages == 0)
+        return _EINVAL;
+    lock(&ksm_lock);
+    ksm_pages_to_scan = pages;
+    unlock(&ksm_lock);
+    return 0;
+}
+
+int ksm_set_sleep_millisecs(unsigned msecs) {
+    lock(&ksm_lock);
+    ksm_sleep_millisecs = msecs;
+    unlock(&ksm_lock);
+    return 0;
+}
+
+void ksm_get_stats(struct ksm_stats *stats) {
+    lock(&ksm_lock);
+    *stats = (struct ksm_stats) {
+        .run = ksm_run,
+        .pages_to_scan = ksm_pages_to_scan,
+        .sleep_millisecs = ksm_sleep_millisecs,
+        .pages_unshared = ksm_pages_unshared,
+        .full_scans = ksm_full_scans,
+    };
+    for (int i = 0; i < KSM_HASH_SIZE; i++) {
+        if (list_null(&ksm_stable[i]))
+            continue;
+        struct ksm_page *kpage;
+        list_for_each_entry(&ksm_stable[i], kpage, chain) {
+            unsigned users = kpage->data->refcount - 1;
+            if (users >= 2) {
+                stats->pages_shared++;
+                stats->pages_sharing += users - 1;
+            }
+        }
+    }
+    unlock(&ksm_lock);
+}
@@ -0,0 +1,25 @@
+#ifndef KERNEL_KSM_H
+#define KERNEL_KSM_H
+
+// Background merging of identical pages across processes. Off until
+// something writes 1 to /proc/ish/ksm/run.
+
+struct ksm_stats {
+    unsigned run;
+    unsigned pages_to_scan;
+    unsigned sleep_millisecs;
+    // stable pages that are mapped more than once
+    unsigned long pages_shared;
+    // mappings of those beyond the first, i.e. how many pages were saved
+    unsigned long pages_sharing;
+    // pages checked during the current pass that had nothing to merge with
+    unsigned long pages_unshared;
+    unsigned long full_scans;
+};
+
+int ksm_set_run(unsigned run);
+int ksm_set_pages_to_scan(unsigned pages);
+int ksm_set_sleep_millisecs(unsigned msecs);
+void ksm_get_stats(struct ksm_stats *stats);
+
+#endif
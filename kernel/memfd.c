@@ -0,0 +1,178 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kernel/calls.h"
+#include "kernel/fs.h"
+#include "fs/fd.h"
+#include "fs/real.h"
+#include "platform/platform.h"
+
+#define MFD_CLOEXEC_ 0x1
+#define MFD_ALLOW_SEALING_ 0x2
+#define MFD_HUGETLB_ 0x4
+#define MFD_NAME_MAX 249
+
+static const struct fd_ops memfd_ops;
+static struct mount memfd_mount;
+
+// memfds are host memfds (or unlinked temp files where there's no such thing)
+// wrapped in the realfs fd ops, so mmap(MAP_SHARED) goes straight to the host
+// and the memory is shared with anyone else who maps the same fd, including
+// across fork.
+fd_t sys_memfd_create(addr_t name_addr, uint_t flags) {
+    char name[MFD_NAME_MAX + 1];
+    if (user_read_string(name_addr, name, sizeof(name)))
+        return _EFAULT;
+    STRACE("memfd_create(\"%.*s\", %#x)", (int) sizeof(name), name, flags);
+    if (memchr(name, '\0', sizeof(name)) == NULL)
+        return _EINVAL;
+    if (flags & ~(MFD_CLOEXEC_|MFD_ALLOW_SEALING_|MFD_HUGETLB_))
+        return _EINVAL;
+    if (flags & MFD_HUGETLB_)
+        TRACE("ignoring MFD_HUGETLB");
+
+    int real_fd = create_shared_memory(0);
+    if (real_fd < 0)
+        return errno_map();
+    struct fd *fd = fd_create(&memfd_ops);
+    if (fd == NULL) {
+        close(real_fd);
+        return _ENOMEM;
+    }
+    fd->real_fd = real_fd;
+    fd->dir = NULL;
+    fd->type = S_IFREG;
+    mount_retain(&memfd_mount);
+    fd->mount = &memfd_mount;
+    fd->memfd.name = strdup(name);
+    // without MFD_ALLOW_SEALING no seals can ever be added
+    fd->memfd.seals = flags & MFD_ALLOW_SEALING_ ? 0 : F_SEAL_SEAL_;
+    return f_install(fd, flags & MFD_CLOEXEC_ ? O_CLOEXEC_ : 0);
+}
+
+static bool is_memfd(struct fd *fd) {
+    return fd->ops == &memfd_ops;
+}
+
+int memfd_add_seals(struct fd *fd, unsigned seals) {
+    if (!is_memfd(fd))
+        return _EINVAL;
+    if (seals & ~(F_SEAL_SEAL_|F_SEAL_SHRINK_|F_SEAL_GROW_|F_SEAL_WRITE_|F_SEAL_FUTURE_WRITE_))
+        return _EINVAL;
+    lock(&fd->lock);
+    if (fd->memfd.seals & F_SEAL_SEAL_) {
+        unlock(&fd->lock);
+        return _EPERM;
+    }
+    // FIXME: adding F_SEAL_WRITE should fail with EBUSY while there are shared writable mappings
+    fd->memfd.seals |= seals;
+    unlock(&fd->lock);
+    return 0;
+}
+
+int memfd_get_seals(struct fd *fd) {
+    if (!is_memfd(fd))
+        return _EINVAL;
+    lock(&fd->lock);
+    int seals = fd->memfd.seals;
+    unlock(&fd->lock);
+    return seals;
+}
+
+static unsigned memfd_seals(struct fd *fd) {
+    lock(&fd->lock);
+    unsigned seals = fd->memfd.seals;
+    unlock(&fd->lock);
+    return seals;
+}
+
+// Checks a write of size bytes at off (or at the end of the file if
+// off is -1) against the seals.
+static int memfd_check_write(struct fd *fd, size_t size, off_t off) {
+    unsigned seals = memfd_seals(fd);
+    if (seals & (F_SEAL_WRITE_|F_SEAL_FUTURE_WRITE_))
+        return _EPERM;
+    if (seals & F_SEAL_GROW_) {
+        struct stat stat;
+        if (fstat(fd->real_fd, &stat) < 0)
+            return errno_map();
+        if (off < 0)
+            off = lseek(fd->real_fd, 0, SEEK_CUR);
+        if (off + (off_t) size > stat.st_size)
+            return _EPERM;
+    }
+    return 0;
+}
+
+static ssize_t memfd_write(struct fd *fd, const void *buf, size_t bufsize) {
+    int err = memfd_check_write(fd, bufsize, -1);
+    if (err < 0)
+        return err;
+    return realfs_write(fd, buf, bufsize);
+}
+
+static ssize_t memfd_pwrite(struct fd *fd, const void *buf, size_t bufsize, off_t off) {
+    int err = memfd_check_write(fd, bufsize, off);
+    if (err < 0)
+        return err;
+    return realfs_pwrite(fd, buf, bufsize, off);
+}
+
+static int memfd_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off_t offset, int prot, int flags) {
+    if (flags & MMAP_SHARED && prot & P_WRITE &&
+            memfd_seals(fd) & (F_SEAL_WRITE_|F_SEAL_FUTURE_WRITE_))
+        return _EPERM;
+    return realfs_mmap(fd, mem, start, pages, offset, prot, flags);
+}
+
+static int memfd_close(struct fd *fd) {
+    free(fd->memfd.name);
+    return realfs_close(fd);
+}
+
+static const struct fd_ops memfd_ops = {
+    .read = realfs_read,
+    .write = memfd_write,
+    .pread = realfs_pread,
+    .pwrite = memfd_pwrite,
+    .lseek = realfs_lseek,
+    .mmap = memfd_mmap,
+    .poll = realfs_poll,
+    .fsync = realfs_fsync,
+    .close = memfd_close,
+    .getflags = realfs_getflags,
+    .setflags = realfs_setflags,
+};
+
+static int memfd_fsetattr(struct fd *fd, struct attr attr) {
+    if (attr.type == attr_size) {
+        unsigned seals = memfd_seals(fd);
+        if (seals & (F_SEAL_SHRINK_|F_SEAL_GROW_)) {
+            struct stat stat;
+            if (fstat(fd->real_fd, &stat) < 0)
+                return errno_map();
+            if (seals & F_SEAL_SHRINK_ && (off_t) attr.size < stat.st_size)
+                return _EPERM;
+            if (seals & F_SEAL_GROW_ && (off_t) attr.size > stat.st_size)
+                return _EPERM;
+        }
+    }
+    return realfs_fsetattr(fd, attr);
+}
+
+static int memfd_getpath(struct fd *fd, char *buf) {
+    snprintf(buf, MAX_PATH + 1, "/memfd:%s (deleted)", fd->memfd.name);
+    return 0;
+}
+
+static const struct fs_ops memfd_fs = {
+    .name = "memfd", .magic = 0x01021994, // same as tmpfs
+    .fstat = realfs_fstat,
+    .fsetattr = memfd_fsetattr,
+    .getpath = memfd_getpath,
+};
+
+static struct mount memfd_mount = {
+    .fs = &memfd_fs,
+    .point = "",
+};
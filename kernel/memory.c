@@ -135,6 +135,19 @@ int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, size_t of
     return 0;
 }
 
+int pt_map_data(struct mem *mem, page_t start, pages_t pages, struct data *data, unsigned flags) {
+    for (page_t page = start; page < start + pages; page++) {
+        if (mem_pt(mem, page) != NULL)
+            pt_unmap(mem, page, 1);
+        data->refcount++;
+        struct pt_entry *pt = mem_pt_new(mem, page);
+        pt->data = data;
+        pt->offset = (page - start) << PAGE_BITS;
+        pt->flags = flags;
+    }
+    return 0;
+}
+
 int pt_unmap(struct mem *mem, page_t start, pages_t pages) {
     for (page_t page = start; page < start + pages; page++)
         if (mem_pt(mem, page) == NULL)
@@ -150,28 +163,133 @@ int pt_unmap_always(struct mem *mem, page_t start, pages_t pages) {
         asbestos_invalidate_page(mem->mmu.asbestos, page);
         struct data *data = pt->data;
         mem_pt_del(mem, page);
-        if (--data->refcount == 0) {
-            // vdso wasn't allocated with mmap, it's just in our data segment
-            if (data->data != vdso_data) {
-                int err = munmap(data->data, data->size);
-                if (err != 0)
-                    die("munmap(%p, %lu) failed: %s", data->data, data->size, strerror(errno));
-            }
-            if (data->fd != NULL) {
-                fd_close(data->fd);
-            }
-            free(data);
-        }
+        data_release(data);
     }
     mem_changed(mem);
     return 0;
 }
 
+void data_release(struct data *data) {
+    if (--data->refcount != 0)
+        return;
+    // vdso wasn't allocated with mmap, it's just in our data segment
+    if (data->data != vdso_data) {
+        int err = munmap(data->data, data->size);
+        if (err != 0)
+            die("munmap(%p, %lu) failed: %s", data->data, data->size, strerror(errno));
+    }
+    if (data->fd != NULL) {
+        fd_close(data->fd);
+    }
+    free(data);
+}
+
+void pt_set_file(struct mem *mem, page_t page, struct fd *fd, size_t offset) {
+    struct pt_entry *pt = mem_pt(mem, page);
+    struct data *data = pt->data;
+    // anonymous memory (like tmpfs past the end of the file) isn't the file's,
+    // and zero_page is shared by everything
+    if (data->name != NULL || data == &zero_page || pt->flags & P_ANONYMOUS)
+        return;
+    data->fd = fd_retain(fd);
+    // the first page isn't at the start of data if the host's pages are bigger
+    data->file_offset = offset - pt->offset;
+}
+
+// Transparent huge page size on the hosts we care about (x86_64 and arm64
+// with 4K pages)
+#define HUGE_PAGE_SIZE (1 << 21)
+
+// Allocate anonymous host memory. Regions of at least a huge page are aligned
+// to one and marked for transparent huge pages, so the host can back them
+// with far fewer TLB entries. Guest pages are 4K either way. Only memory
+// that's allocated up front (shared mappings) gets that big, since the host
+// backs a whole huge page as soon as any of it is written.
+static void *mmap_anonymous(size_t size, int flags) {
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_PAGE_SIZE) {
+        char *memory = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                flags | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return MAP_FAILED;
+        char *aligned = (char *) (((uintptr_t) memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+        if (aligned != memory)
+            munmap(memory, aligned - memory);
+        munmap(aligned + size, memory + HUGE_PAGE_SIZE - aligned);
+        // just a hint, fine if the host says no
+        madvise(aligned, size, MADV_HUGEPAGE);
+        return aligned;
+    }
+#endif
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0);
+}
+
+// Untouched private anonymous pages all point at this read-only page of zeros
+// with P_COW set, and only get real memory when they're first written to.
+// It holds a reference to itself so it's never freed.
+struct data zero_page = {
+    .refcount = 1,
+};
+
+__attribute__((constructor)) static void zero_page_init() {
+    zero_page.data = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (zero_page.data == MAP_FAILED)
+        die("could not allocate the zero page: %s", strerror(errno));
+    zero_page.size = PAGE_SIZE;
+}
+
 int pt_map_nothing(struct mem *mem, page_t start, pages_t pages, unsigned flags) {
     if (pages == 0) return 0;
-    void *memory = mmap(NULL, pages * PAGE_SIZE,
-            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-    return pt_map(mem, start, pages, memory, 0, flags | P_ANONYMOUS);
+    if (flags & P_SHARED) {
+        // shared memory can't be CoW, so it has to be allocated up front
+        void *memory = mmap_anonymous(pages * PAGE_SIZE, MAP_SHARED);
+        return pt_map(mem, start, pages, memory, 0, flags | P_ANONYMOUS);
+    }
+
+    for (page_t page = start; page < start + pages; page++) {
+        if (mem_pt(mem, page) != NULL)
+            pt_unmap(mem, page, 1);
+        zero_page.refcount++;
+        struct pt_entry *pt = mem_pt_new(mem, page);
+        pt->data = &zero_page;
+        pt->offset = 0;
+        pt->flags = flags | P_ANONYMOUS | P_COW;
+    }
+    return 0;
+}
+
+// Maximum number of zero pages that get replaced with real memory on one
+// write fault. Allocating a chunk at a time keeps a big region from turning
+// into one host mapping per page, and the host still won't back the parts
+// that aren't touched. This stays under a huge page so the first write to a
+// sparse heap or stack doesn't get a whole one.
+#define ZERO_FILL_PAGES 256
+
+// Give real memory to the zero page at page, and to the other zero pages
+// with the same flags in the same chunk. Must call with mem write-locked.
+static int pt_zero_fill(struct mem *mem, page_t page) {
+    struct pt_entry *entry = mem_pt(mem, page);
+    if (entry == NULL || entry->data != &zero_page)
+        return 0;
+    unsigned flags = entry->flags;
+    page_t chunk = page & ~(ZERO_FILL_PAGES - 1);
+    page_t start = page;
+    while (start > chunk) {
+        struct pt_entry *pt = mem_pt(mem, start - 1);
+        if (pt == NULL || pt->data != &zero_page || pt->flags != flags)
+            break;
+        start--;
+    }
+    page_t end = page + 1;
+    while (end < chunk + ZERO_FILL_PAGES) {
+        struct pt_entry *pt = mem_pt(mem, end);
+        if (pt == NULL || pt->data != &zero_page || pt->flags != flags)
+            break;
+        end++;
+    }
+
+    void *memory = mmap_anonymous((end - start) * PAGE_SIZE, MAP_PRIVATE);
+    return pt_map(mem, start, end - start, memory, 0, flags & ~P_COW);
 }
 
 int pt_set_flags(struct mem *mem, page_t start, pages_t pages, int flags) {
@@ -181,9 +299,12 @@ int pt_set_flags(struct mem *mem, page_t start, pages_t pages, int flags) {
     for (page_t page = start; page < start + pages; page++) {
         struct pt_entry *entry = mem_pt(mem, page);
         int old_flags = entry->flags;
-        entry->flags = flags;
+        // only the protection changes, the rest of the flags describe the mapping
+        entry->flags = (old_flags & ~P_RWX) | (flags & P_RWX);
         // check if protection is increasing
-        if ((flags & ~old_flags) & (P_READ|P_WRITE)) {
+        // cow pages are copied before they're written to so they can stay
+        // read-only (the zero page has to)
+        if ((flags & ~old_flags) & (P_READ|P_WRITE) && !(old_flags & P_COW)) {
             void *data = (char *) entry->data->data + entry->offset;
             // force to be page aligned
             data = (void *) ((uintptr_t) data & ~(real_page_size - 1));
@@ -217,6 +338,16 @@ int pt_copy_on_write(struct mem *src, struct mem *dst, page_t start, page_t page
     return 0;
 }
 
+void pt_merge(struct mem *mem, page_t page, struct data *data) {
+    unsigned flags = mem_pt(mem, page)->flags;
+    pt_unmap_always(mem, page, 1);
+    data->refcount++;
+    struct pt_entry *pt = mem_pt_new(mem, page);
+    pt->data = data;
+    pt->offset = 0;
+    pt->flags = flags | P_COW;
+}
+
 static void mem_changed(struct mem *mem) {
     mem->mmu.changes++;
 }
@@ -275,7 +406,14 @@ void *mem_ptr(struct mem *mem, addr_t addr, int type) {
         // get rid of any compiled blocks in this page
         asbestos_invalidate_page(mem->mmu.asbestos, page);
         // if page is cow, ~~milk~~ copy it
-        if (entry->flags & P_COW) {
+        if (entry->data == &zero_page) {
+            // copy/paste from above
+            read_wrunlock(&mem->lock);
+            write_wrlock(&mem->lock);
+            pt_zero_fill(mem, page);
+            write_wrunlock(&mem->lock);
+            read_wrlock(&mem->lock);
+        } else if (entry->flags & P_COW) {
             void *data = (char *) entry->data->data + entry->offset;
             void *copy = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
                     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
@@ -39,9 +39,9 @@ struct data {
     size_t size; // also immutable
     atomic_uint refcount;
 
-    // for display in /proc/pid/maps
+    // for display in /proc/pid/maps, and to find shared futexes
     struct fd *fd;
-    size_t file_offset;
+    size_t file_offset; // of the start of data, which isn't always the start of the mapping
     const char *name;
 #if LEAK_DEBUG
     int pid;
@@ -77,6 +77,9 @@ page_t pt_find_hole(struct mem *mem, pages_t size);
 // ownership of memory. It will be freed with:
 // munmap(memory, pages * PAGE_SIZE)
 int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, size_t offset, unsigned flags);
+// Map pages of an existing struct data into fake memory, starting from the
+// beginning of it
+int pt_map_data(struct mem *mem, page_t start, pages_t pages, struct data *data, unsigned flags);
 // Map empty space into fake memory
 int pt_map_nothing(struct mem *mem, page_t page, pages_t pages, unsigned flags);
 // Unmap fake memory, return -1 if any part of the range isn't mapped and 0 otherwise
@@ -87,6 +90,19 @@ int pt_unmap_always(struct mem *mem, page_t start, pages_t pages);
 int pt_set_flags(struct mem *mem, page_t start, pages_t pages, int flags);
 // Copy pages from src memory to dst memory using copy-on-write
 int pt_copy_on_write(struct mem *src, struct mem *dst, page_t start, page_t pages);
+// Record that the mapping starting at page is of fd at offset, for
+// /proc/pid/maps. Left alone if the memory already has a name, which is how
+// filesystems that map their own pages (tmpfs) avoid being kept open by them,
+// and for anonymous memory.
+void pt_set_file(struct mem *mem, page_t page, struct fd *fd, size_t offset);
+// Drop a reference to data, freeing it when it's the last one
+void data_release(struct data *data);
+// Replace a page with a copy-on-write reference to a single page of data with
+// the same contents. Used to merge identical pages, see kernel/ksm.c.
+void pt_merge(struct mem *mem, page_t page, struct data *data);
+
+// Shared by all untouched private anonymous pages, see pt_map_nothing
+extern struct data zero_page;
 
 // Must call with mem read-locked.
 void *mem_ptr(struct mem *mem, addr_t addr, int type);
@@ -8,8 +8,9 @@
 // Returns stopped child with the given pid, locked with the ptrace lock
 static struct task *find_child(pid_t_ pid) {
     struct task *child = NULL;
-    list_for_each_entry(&current->children, child, siblings) {
-        if (child->pid == pid) {
+    lock(&current->group->children_lock);
+    list_for_each_entry(&current->group->children, child, siblings) {
+        if (child->parent == current && child->pid == pid) {
             lock(&child->ptrace.lock);
             if (child->ptrace.stopped) {
                 goto found;
@@ -20,6 +21,7 @@ static struct task *find_child(pid_t_ pid) {
     }
     child = NULL;
 found:
+    unlock(&current->group->children_lock);
     return child;
 }
 
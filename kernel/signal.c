@@ -54,16 +54,25 @@ static void deliver_signal_unlocked(struct task *task, int sig, struct siginfo_
     if (sigset_has(task->pending, sig))
         return;
 
-    sigset_add(&task->pending, sig);
-    struct sigqueue *sigqueue = malloc(sizeof(struct sigqueue));
+    // If the task already has a signal it hasn't received yet, it's already
+    // been woken up and will receive this one along with it, so a burst of
+    // signals only interrupts it once. SIGKILL always goes through, it has
+    // to get a task out of a ptrace stop.
+    bool already_woken = signal_pending(task) && sig != SIGKILL_;
+
+    struct sigqueue *sigqueue = &task->sigqueue[sig];
     sigqueue->info = info;
     sigqueue->info.sig = sig;
     list_add_tail(&task->queue, &sigqueue->queue);
+    sigset_add_atomic(&task->pending, sig);
 
     if (sigset_has(task->blocked & ~task->waiting, sig) && signal_is_blockable(sig))
         return;
 
-    if (task != current) {
+    if (task != current && !already_woken) {
+        // the poke gets a task running guest code out at the next block, the
+        // host signal gets one blocked in a host syscall out with EINTR
+        cpu_poke(&task->cpu);
         pthread_kill(task->thread, SIGUSR1);
 
         // wake up any pthread condition waiters
@@ -312,7 +321,7 @@ void signal_delivery_stop(int sig, struct siginfo_ *info) {
     while (current->ptrace.stopped) {
         wait_for_ignore_signals(&current->ptrace.cond, &current->ptrace.lock, NULL);
         lock(&current->sighand->lock);
-        bool got_sigkill = sigset_has(current->pending, SIGKILL_);
+        bool got_sigkill = sigset_has(__atomic_load_n(&current->pending, __ATOMIC_ACQUIRE), SIGKILL_);
         unlock(&current->sighand->lock);
         if (got_sigkill) {
             STRACE("%d received a SIGKILL in signal delivery stop\n", current->pid);
@@ -325,6 +334,11 @@ void signal_delivery_stop(int sig, struct siginfo_ *info) {
 }
 
 void receive_signals() {
+    // This is called after every interrupt and there's almost never anything
+    // to do, so find that out without taking any locks.
+    if (!current->has_saved_mask && !signal_pending(current))
+        return;
+
     lock(&current->group->lock);
     bool was_stopped = current->group->stopped;
     unlock(&current->group->lock);
@@ -348,19 +362,20 @@ void receive_signals() {
         int sig = sigqueue->info.sig;
         if (sigset_has(blocked, sig))
             continue;
+        // the slot can be reused as soon as the signal isn't pending
+        struct siginfo_ info = sigqueue->info;
         list_remove(&sigqueue->queue);
-        sigset_del(&current->pending, sig);
+        sigset_del_atomic(&current->pending, sig);
 
         if (current->ptrace.traced && sig != SIGKILL_) {
             // This notifies the parent, goes to sleep, and waits for the
             // parent to tell it to continue.
             // Any signals received while waiting are left on the queue, except
             // for SIGKILL_, which causes an immediate exit.
-            signal_delivery_stop(sig, &sigqueue->info);
+            signal_delivery_stop(sig, &info);
         } else {
-            receive_signal(sighand, &sigqueue->info);
+            receive_signal(sighand, &info);
         }
-        free(sigqueue);
     }
 
     unlock(&sighand->lock);
@@ -371,11 +386,13 @@ void receive_signals() {
         bool now_stopped = current->group->stopped;
         unlock(&current->group->lock);
         if (now_stopped) {
-            lock(&pids_lock);
-            notify(&current->parent->group->child_exit);
-            // TODO add siginfo
-            send_signal(current->parent, current->group->leader->exit_signal, SIGINFO_NIL);
-            unlock(&pids_lock);
+            struct task *parent = task_lock_parent(current);
+            if (parent != NULL) {
+                notify(&parent->group->child_exit);
+                // TODO add siginfo
+                send_signal(parent, current->group->leader->exit_signal, SIGINFO_NIL);
+                unlock(&parent->group->children_lock);
+            }
         }
     }
 }
@@ -673,19 +690,20 @@ int_t sys_rt_sigtimedwait(addr_t set_addr, addr_t info_addr, addr_t timeout_addr
     }
 
     struct sigqueue *sigqueue;
+    struct siginfo_ info;
     bool found = false;
     list_for_each_entry(&current->queue, sigqueue, queue) {
         if (sigset_has(set, sigqueue->info.sig)) {
             found = true;
+            info = sigqueue->info;
             list_remove(&sigqueue->queue);
+            sigset_del_atomic(&current->pending, info.sig);
             break;
         }
     }
     unlock(&current->sighand->lock);
     if (!found)
         return _EINTR;
-    struct siginfo_ info = sigqueue->info;
-    free(sigqueue);
     if (info_addr != 0)
         if (user_put(info_addr, info))
             return _EFAULT;
@@ -728,7 +746,7 @@ static int kill_group(pid_t_ pgid, dword_t sig) {
 
 static int kill_everything(dword_t sig) {
     int err = _EPERM;
-    for (int i = 2; i < MAX_PID; i++) {
+    for (dword_t i = pid_next(1); i != 0; i = pid_next(i)) {
         struct task *task = pid_get_task(i);
         if (task == NULL || task == current || !task_is_leader(task))
             continue;
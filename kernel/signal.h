@@ -173,6 +173,14 @@ static inline void sigset_add(sigset_t_ *set, int sig) {
 static inline void sigset_del(sigset_t_ *set, int sig) {
     *set &= ~sig_mask(sig);
 }
+// For task->pending, which is only changed with sighand->lock held, but can
+// be read without it
+static inline void sigset_add_atomic(sigset_t_ *set, int sig) {
+    __atomic_fetch_or(set, sig_mask(sig), __ATOMIC_RELEASE);
+}
+static inline void sigset_del_atomic(sigset_t_ *set, int sig) {
+    __atomic_fetch_and(set, ~sig_mask(sig), __ATOMIC_RELEASE);
+}
 
 struct stack_t_ {
     addr_t stack;
@@ -9,17 +9,41 @@
 
 __thread struct task *current;
 
-static struct pid pids[MAX_PID + 1] = {};
 lock_t pids_lock = LOCK_INITIALIZER;
 
+// The pid table is two levels, like a small radix tree, so the memory for
+// struct pids only gets allocated for the ranges of pids that are used. A
+// bitmap of the pids that have a task makes allocating a pid and walking the
+// process list skip over the empty parts 64 at a time.
+#define PID_CHUNK_BITS 9
+#define PID_CHUNK_SIZE (1 << PID_CHUNK_BITS)
+#define PID_CHUNKS ((MAX_PID >> PID_CHUNK_BITS) + 1)
+static struct pid *pid_chunks[PID_CHUNKS];
+static uint64_t pid_used[MAX_PID / 64 + 1];
+static dword_t last_pid;
+
 static bool pid_empty(struct pid *pid) {
     return pid->task == NULL && list_empty(&pid->session) && list_empty(&pid->pgroup);
 }
 
+// Returns the slot for the pid, allocating its chunk if needed
+static struct pid *pid_slot(dword_t id) {
+    struct pid **chunk = &pid_chunks[id >> PID_CHUNK_BITS];
+    if (*chunk == NULL) {
+        *chunk = calloc(PID_CHUNK_SIZE, sizeof(struct pid));
+        if (*chunk == NULL)
+            return NULL;
+    }
+    return &(*chunk)[id & (PID_CHUNK_SIZE - 1)];
+}
+
 struct pid *pid_get(dword_t id) {
-    if (id > sizeof(pids)/sizeof(pids[0]))
+    if (id > MAX_PID)
         return NULL;
-    struct pid *pid = &pids[id];
+    struct pid *chunk = pid_chunks[id >> PID_CHUNK_BITS];
+    if (chunk == NULL)
+        return NULL;
+    struct pid *pid = &chunk[id & (PID_CHUNK_SIZE - 1)];
     if (pid_empty(pid))
         return NULL;
     return pid;
@@ -40,35 +64,83 @@ struct task *pid_get_task(dword_t id) {
     return task;
 }
 
-struct task *task_create_(struct task *parent) {
-    lock(&pids_lock);
-    static int cur_pid = 0;
-    do {
-        cur_pid++;
-        if (cur_pid > MAX_PID) cur_pid = 1;
-    } while (!pid_empty(&pids[cur_pid]));
-    struct pid *pid = &pids[cur_pid];
-    pid->id = cur_pid;
-    list_init(&pid->session);
-    list_init(&pid->pgroup);
+dword_t pid_next(dword_t id) {
+    for (dword_t i = id + 1; i <= MAX_PID; i = (i | 63) + 1) {
+        uint64_t word = pid_used[i / 64] >> (i % 64);
+        if (word != 0)
+            return i + __builtin_ctzll(word);
+    }
+    return 0;
+}
 
+// Finds a pid that isn't in use, going round in order like linux does so
+// pids don't get reused right away. Must be called with pids_lock.
+static struct pid *pid_alloc() {
+    dword_t id = last_pid;
+    dword_t searched = 0;
+    while (searched < MAX_PID) {
+        if (++id > MAX_PID)
+            id = 1;
+        searched++;
+        // skip to the first pid in this word without a task
+        uint64_t word = ~pid_used[id / 64] >> (id % 64);
+        if (word == 0) {
+            searched += 63 - id % 64;
+            id |= 63;
+            continue;
+        }
+        unsigned skip = __builtin_ctzll(word);
+        id += skip;
+        searched += skip;
+        if (id > MAX_PID)
+            continue;
+        struct pid *pid = pid_slot(id);
+        if (pid == NULL)
+            return NULL;
+        // no task, but it could still be the id of a session or process group
+        if (!pid_empty(pid))
+            continue;
+        last_pid = id;
+        pid->id = id;
+        list_init(&pid->session);
+        list_init(&pid->pgroup);
+        return pid;
+    }
+    return NULL;
+}
+
+struct task *task_create_(struct task *parent) {
+    // do as much as possible before taking pids_lock, everyone forking and
+    // exiting needs it
     struct task *task = malloc(sizeof(struct task));
     if (task == NULL)
         return NULL;
     *task = (struct task) {};
     if (parent != NULL)
         *task = *parent;
+    list_init(&task->siblings);
+
+    lock(&pids_lock);
+    struct pid *pid = pid_alloc();
+    if (pid == NULL) {
+        unlock(&pids_lock);
+        free(task);
+        return NULL;
+    }
     task->pid = pid->id;
     pid->task = task;
-
-    list_init(&task->children);
-    list_init(&task->siblings);
+    pid_used[pid->id / 64] |= 1ull << (pid->id % 64);
     if (parent != NULL) {
         task->parent = parent;
-        list_add(&parent->children, &task->siblings);
+        lock(&parent->group->children_lock);
+        list_add(&parent->group->children, &task->siblings);
+        unlock(&parent->group->children_lock);
     }
     unlock(&pids_lock);
 
+    // the copy from the parent points at the parent's flag
+    task->cpu.poked_ptr = &task->poked;
+    task->poked = false;
     task->pending = 0;
     list_init(&task->queue);
     task->clear_tid = 0;
@@ -90,11 +162,31 @@ struct task *task_create_(struct task *parent) {
 }
 
 void task_destroy(struct task *task) {
-    list_remove(&task->siblings);
     pid_get(task->pid)->task = NULL;
+    pid_used[task->pid / 64] &= ~(1ull << (task->pid % 64));
     free(task);
 }
 
+void task_leave_parent(struct task *task) {
+    struct task *parent = task->parent;
+    if (parent == NULL)
+        return;
+    lock(&parent->group->children_lock);
+    list_remove(&task->siblings);
+    unlock(&parent->group->children_lock);
+}
+
+struct task *task_lock_parent(struct task *task) {
+    // pids_lock keeps the parent from changing until its children_lock is
+    // held, and after that exiting parents have to take the lock to reparent
+    lock(&pids_lock);
+    struct task *parent = task->parent;
+    if (parent != NULL)
+        lock(&parent->group->children_lock);
+    unlock(&pids_lock);
+    return parent;
+}
+
 void task_run_current() {
     struct cpu_state *cpu = &current->cpu;
     struct tlb tlb = {};
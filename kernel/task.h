@@ -39,9 +39,16 @@ struct task {
     // locked by sighand->lock
     struct sighand *sighand;
     sigset_t_ blocked;
-    sigset_t_ pending;
+    sigset_t_ pending; // written with sighand->lock, see signal_pending
     sigset_t_ waiting; // if nonzero, an ongoing call to sigtimedwait is waiting on these
+    // what cpu.poked_ptr points at, set by cpu_poke to get the task out of
+    // guest code. It's not cpu._poked because the jit runs on a copy of cpu
+    // and copies it back after every block, which would put back a stale flag.
+    bool poked;
     struct list queue;
+    // A signal can only be pending once, so each one has a place to be queued
+    // from, indexed by signal number. In use if the bit in pending is set.
+    struct sigqueue sigqueue[NUM_SIGS];
     cond_t pause; // please don't signal this
     // private
     sigset_t_ saved_mask;
@@ -59,18 +66,20 @@ struct task {
         int trap_event;
     } ptrace;
 
-    // locked by pids_lock
+    // parent is written with both pids_lock and the parent's
+    // group->children_lock held (both parents' when reparenting), so either
+    // is enough to read it. siblings is the link in the parent's
+    // group->children, locked by that group's children_lock.
     struct task *parent;
-    struct list children;
     struct list siblings;
 
     addr_t clear_tid;
     addr_t robust_list;
 
-    // locked by pids_lock
+    // set by the task itself before it becomes a zombie
     dword_t exit_code;
-    bool zombie;
-    bool exiting;
+    bool zombie; // locked like parent
+    bool exiting; // locked by pids_lock
 
     // this structure is allocated on the stack of the parent's clone() call
     struct vfork_info {
@@ -106,8 +115,15 @@ static inline void task_set_mm(struct task *task, struct mm *mm) {
 // parent as NULL to create the init process. Returns NULL if out of memory.
 // Ends with an underscore because there's a mach function by the same name
 struct task *task_create_(struct task *parent);
-// Removes the process from the process table and frees it. Must be called with pids_lock.
+// Removes the process from the process table and frees it. Must be called with
+// pids_lock, after the task has been taken off its parent's children.
 void task_destroy(struct task *task);
+// Takes the task off its parent's children. Must be called with pids_lock.
+void task_leave_parent(struct task *task);
+// Locks the children_lock of the task's parent's group and returns the parent,
+// or returns NULL if the task is init. The parent can't exit until the lock
+// is released. Must not be called with pids_lock.
+struct task *task_lock_parent(struct task *task);
 
 // misc
 void vfork_notify(struct task *task);
@@ -158,6 +174,10 @@ struct tgroup {
     dword_t group_exit_code;
 
     struct rusage_ children_rusage;
+    // The children of every thread in the group, which is what wait looks
+    // through. Locked by children_lock, which child_exit is waited on with.
+    struct list children;
+    lock_t children_lock;
     cond_t child_exit;
 
     dword_t personality;
@@ -166,6 +186,15 @@ struct tgroup {
     lock_t lock;
 };
 
+// Whether the task has a signal that should interrupt it: one that's pending
+// and either not blocked or being waited for. Needs no locks if task is
+// current, since only current changes its own mask. Otherwise call with
+// sighand->lock.
+static inline bool signal_pending(struct task *task) {
+    sigset_t_ pending = __atomic_load_n(&task->pending, __ATOMIC_ACQUIRE);
+    return !!(pending & (~task->blocked | task->waiting));
+}
+
 static inline bool task_is_leader(struct task *task) {
     return task->group->leader == task;
 }
@@ -178,11 +207,20 @@ struct pid {
 };
 
 // synchronizes obtaining a pointer to a task and freeing that task
+//
+// Lock order: pids_lock, group->children_lock, then the task's own locks
+// (sighand->lock, group->lock, ptrace.lock). Two children_locks are only ever
+// held together under pids_lock, so fork, exit and wait of unrelated
+// processes only meet on pids_lock for the short parts that change the pid
+// table, and wait sleeps without it.
 extern lock_t pids_lock;
 // these functions must be called with pids_lock
 struct pid *pid_get(dword_t pid);
 struct task *pid_get_task(dword_t pid);
 struct task *pid_get_task_zombie(dword_t id); // don't return null if the task exists as a zombie
+// The next pid after id that has a task (which could be a zombie), or 0 if
+// there isn't one. Start from 0 to go through every task.
+dword_t pid_next(dword_t id);
 
 #define MAX_PID (1 << 15) // oughta be enough
 
@@ -10,6 +10,7 @@
 #include "kernel/errno.h"
 #include "kernel/resource.h"
 #include "kernel/time.h"
+#include "kernel/vdso.h"
 #include "fs/poll.h"
 
 static int clockid_to_real(uint_t clock, clockid_t *real) {
@@ -44,6 +45,7 @@ static struct itimerspec_ timer_spec_from_real(struct timer_spec spec) {
 };
 
 dword_t sys_time(addr_t time_out) {
+    vvar_update();
     dword_t now = time(NULL);
     if (time_out != 0)
         if (user_put(time_out, now))
@@ -57,6 +59,7 @@ dword_t sys_stime(addr_t UNUSED(time)) {
 
 dword_t sys_clock_gettime(dword_t clock, addr_t tp) {
     STRACE("clock_gettime(%d, 0x%x)", clock, tp);
+    vvar_update();
 
     struct timespec ts;
     if (clock == CLOCK_PROCESS_CPUTIME_ID_) {
@@ -219,6 +222,7 @@ dword_t sys_times(addr_t tbuf) {
 
 dword_t sys_gettimeofday(addr_t tv, addr_t tz) {
     STRACE("gettimeofday(0x%x, 0x%x)", tv, tz);
+    vvar_update();
     struct timeval timeval;
     struct timezone timezone;
     if (gettimeofday(&timeval, &timezone) < 0) {
@@ -1,8 +1,15 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "debug.h"
 #include "kernel/elf.h"
+#include "kernel/memory.h"
 #include "kernel/vdso.h"
+#include "util/sync.h"
+#include "vdso/vvar.h"
 
 __asm__(".data\n"
         ".global vdso_data\n"
@@ -58,3 +65,58 @@ fail:
     fflush(stderr);
     abort();
 }
+
+// The vvar pages. Every process maps the same memory, copy-on-write so that
+// nothing can scribble on it through mprotect, and it holds a reference to
+// itself so it's never freed.
+static struct data vvar = {
+    .refcount = 1,
+    .name = "[vvar]",
+};
+static lock_t vvar_lock = LOCK_INITIALIZER;
+
+// How long the vdso can go on using the same realtime offset before it makes
+// a syscall to refresh it, so it can keep up when the host's clock is set.
+#define VVAR_EXPIRE_NS 1000000000ull
+
+__attribute__((constructor)) static void vvar_init() {
+    vvar.data = mmap(NULL, VVAR_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vvar.data == MAP_FAILED)
+        die("could not allocate the vvar pages: %s", strerror(errno));
+    vvar.size = VVAR_PAGES * PAGE_SIZE;
+    struct vvar_data *data = vvar.data;
+#if ENGINE_ASBESTOS
+    // asbestos's rdtsc is CLOCK_MONOTONIC in nanoseconds, see helper_rdtsc
+    data->clock_mode = VCLOCK_RDTSC_NS;
+#else
+    data->clock_mode = VCLOCK_NONE;
+#endif
+}
+
+int vvar_map(struct mem *mem, page_t page) {
+    return pt_map_data(mem, page, VVAR_PAGES, &vvar, P_COW);
+}
+
+static uint64_t timespec_ns(struct timespec ts) {
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void vvar_update() {
+    struct vvar_data *data = vvar.data;
+    if (data->clock_mode == VCLOCK_NONE)
+        return;
+    struct timespec monotonic, realtime;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    if (timespec_ns(monotonic) < __atomic_load_n(&data->expires, __ATOMIC_RELAXED))
+        return;
+
+    lock(&vvar_lock);
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&data->realtime_offset, (int64_t) (timespec_ns(realtime) - timespec_ns(monotonic)), __ATOMIC_RELAXED);
+    __atomic_store_n(&data->expires, timespec_ns(monotonic) + VVAR_EXPIRE_NS, __ATOMIC_RELAXED);
+    __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELEASE);
+    unlock(&vvar_lock);
+}
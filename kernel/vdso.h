@@ -1,8 +1,16 @@
 #ifndef KERNEL_VDSO_H
 #define KERNEL_VDSO_H
+#include "emu/mmu.h"
 #include "tools/ptraceomatic-config.h"
 
 extern const char vdso_data[VDSO_PAGES * (1 << 12)] __asm__("vdso_data");
 int vdso_symbol(const char *name);
 
+struct mem;
+// Map the vvar pages, which the vdso expects to find right before it
+int vvar_map(struct mem *mem, page_t page);
+// Refresh the clock data in the vvar page if it's gone stale. Called by the
+// time syscalls, which is what the vdso falls back to when it is.
+void vvar_update(void);
+
 #endif
@@ -1,6 +1,12 @@
 #include <mach/mach.h>
 #include <sys/sysctl.h>
 #include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "platform/platform.h"
 
 struct cpu_usage get_cpu_usage() {
@@ -63,3 +69,25 @@ struct uptime_info get_uptime() {
     };
     return uptime;
 }
+
+int create_shared_memory(size_t size) {
+    // shm_open isn't allowed in the app sandbox, and its objects can only be
+    // sized once, so use an unlinked file in the temporary directory instead.
+    const char *tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/ish-shm.XXXXXX", tmpdir);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (ftruncate(fd, size) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
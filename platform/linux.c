@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include <sys/sysinfo.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <unistd.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
@@ -51,3 +55,16 @@ struct uptime_info get_uptime() {
     };
     return uptime;
 }
+
+int create_shared_memory(size_t size) {
+    int fd = memfd_create("ish-shm", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
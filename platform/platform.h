@@ -25,4 +25,8 @@ struct uptime_info {
 };
 struct uptime_info get_uptime(void);
 
+// Create an anonymous host memory object of the given size that can be mapped
+// with MAP_SHARED any number of times. Returns a host fd, or -1 and sets errno.
+int create_shared_memory(size_t size);
+
 #endif
@@ -0,0 +1,3 @@
+#!/bin/sh
+gcc test_ipc.c -o test_ipc
+./test_ipc
@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+struct message {
+    long type;
+    char text[32];
+};
+
+int main() {
+    int shm = shmget(IPC_PRIVATE, 10000, IPC_CREAT | 0600);
+    int *mem = shmat(shm, NULL, 0);
+    mem[0] = 0;
+    int sem = semget(IPC_PRIVATE, 1, IPC_CREAT | 0600);
+    semctl(sem, 0, SETVAL, 0);
+    int queue = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+
+    if (fork() == 0) {
+        mem[0] = 1234;
+        struct message msg = {2, "world"};
+        msgsnd(queue, &msg, sizeof(msg.text), 0);
+        msg = (struct message) {1, "hello"};
+        msgsnd(queue, &msg, sizeof(msg.text), 0);
+        struct sembuf up = {0, 1, 0};
+        semop(sem, &up, 1);
+        return 0;
+    }
+
+    struct sembuf down = {0, -1, 0};
+    semop(sem, &down, 1);
+    printf("shared memory: %d\n", mem[0]);
+
+    struct message msg;
+    msgrcv(queue, &msg, sizeof(msg.text), -2, 0);
+    printf("message %ld: %s\n", msg.type, msg.text);
+    msgrcv(queue, &msg, sizeof(msg.text), 0, 0);
+    printf("message %ld: %s\n", msg.type, msg.text);
+    wait(NULL);
+
+    struct shmid_ds ds;
+    shmctl(shm, IPC_STAT, &ds);
+    printf("size %zu attached %lu\n", ds.shm_segsz, (unsigned long) ds.shm_nattch);
+    shmctl(shm, IPC_RMID, NULL);
+    printf("still attached: %d\n", mem[0]);
+    shmdt(mem);
+    semctl(sem, 0, IPC_RMID);
+    msgctl(queue, IPC_RMID, NULL);
+    return 0;
+}
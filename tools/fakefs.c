@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -72,12 +73,210 @@ static const char *schema = Q(
     insert into meta (db_inode) values (0);
     create table stats (inode integer primary key, stat blob);
     create table paths (path blob primary key, inode integer references stats(inode));
-    create index inode_to_path on paths (inode, path);
+    // the inode_to_path index is created after everything's imported, which is faster
     // no index is needed on stats, because the rows are ordered by the primary key
     pragma user_version=3;
 );
 
-bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_error *err_out, struct progress p) {
+// Reading the archive has to happen in order, since it's one gzip stream, but
+// the files in it can be written out in any order. So while this thread reads,
+// a few others write. A file always goes to the same writer as anything
+// earlier in the archive with the same path, so the last one still wins.
+
+#define WRITERS 4
+#define WRITE_QUEUE_MAX (64 << 20) // bytes of file data waiting to be written
+#define WRITE_JOB_MAX (1 << 20) // bigger files are streamed on this thread
+
+struct write_job {
+    struct write_job *next;
+    char *path;
+    char *data;
+    size_t size;
+    struct timespec times[2];
+};
+
+struct writer {
+    pthread_t thread;
+    struct write_job *first;
+    struct write_job *last;
+    struct writers *pool;
+};
+
+struct writers {
+    int root_fd;
+    int count; // 0 if the files are written on this thread
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct writer writers[WRITERS];
+    size_t queued_bytes;
+    unsigned pending; // jobs queued or being written
+    bool stopping;
+    int error; // errno from the first job that failed
+};
+
+static void write_job_free(struct write_job *job) {
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+// Returns an errno or 0
+static int write_job_run(int root_fd, struct write_job *job) {
+    int fd = openat(root_fd, fix_path(job->path), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        if (errno == EISDIR) return 0; // assuming it's case insensitivity
+        return errno;
+    }
+    size_t written = 0;
+    while (written < job->size) {
+        ssize_t len = write(fd, job->data + written, job->size - written);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            int err = errno;
+            close(fd);
+            return err;
+        }
+        written += len;
+    }
+    close(fd);
+    if (utimensat(root_fd, fix_path(job->path), job->times, 0) < 0)
+        return errno;
+    return 0;
+}
+
+static void *writer_thread(void *data) {
+    struct writer *writer = data;
+    struct writers *pool = writer->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (writer->first == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        struct write_job *job = writer->first;
+        if (job == NULL)
+            break;
+        writer->first = job->next;
+        if (writer->first == NULL)
+            writer->last = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        int err = write_job_run(pool->root_fd, job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (err != 0 && pool->error == 0)
+            pool->error = err;
+        pool->queued_bytes -= job->size;
+        pool->pending--;
+        pthread_cond_broadcast(&pool->changed);
+        write_job_free(job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void writers_start(struct writers *pool, int root_fd) {
+    pool->root_fd = root_fd;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+    // with one CPU, handing off just adds overhead
+    long writers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (writers > WRITERS)
+        writers = WRITERS;
+    for (pool->count = 0; pool->count < writers; pool->count++) {
+        struct writer *writer = &pool->writers[pool->count];
+        writer->pool = pool;
+        if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0)
+            break;
+    }
+}
+
+static void writers_add(struct writers *pool, struct write_job *job) {
+    if (pool->count == 0) {
+        int err = write_job_run(pool->root_fd, job);
+        if (err != 0 && pool->error == 0)
+            pool->error = err;
+        write_job_free(job);
+        return;
+    }
+
+    uint32_t hash = 2166136261u;
+    for (const char *c = job->path; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char) *c) * 16777619;
+    struct writer *writer = &pool->writers[hash % pool->count];
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued_bytes > WRITE_QUEUE_MAX && pool->pending > 0)
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    job->next = NULL;
+    if (writer->last != NULL)
+        writer->last->next = job;
+    else
+        writer->first = job;
+    writer->last = job;
+    pool->queued_bytes += job->size;
+    pool->pending++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for everything queued to be written, returns an errno or 0
+static int writers_drain(struct writers *pool) {
+    if (pool->count == 0)
+        return pool->error;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    int err = pool->error;
+    pthread_mutex_unlock(&pool->lock);
+    return err;
+}
+
+static void writers_stop(struct writers *pool) {
+    if (pool->count == 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->count; i++)
+        pthread_join(pool->writers[i].thread, NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->changed);
+    pool->count = 0;
+}
+
+// Reads the rest of the entry's data into a buffer
+static char *read_entry_data(struct archive *archive, struct archive_entry *entry, size_t *size_out) {
+    size_t capacity = archive_entry_size_is_set(entry) ? (size_t) archive_entry_size(entry) : 0;
+    if (capacity == 0)
+        capacity = 65536;
+    char *data = malloc(capacity);
+    size_t size = 0;
+    for (;;) {
+        if (data == NULL)
+            return NULL;
+        if (size == capacity) {
+            capacity *= 2;
+            char *new_data = realloc(data, capacity);
+            if (new_data == NULL)
+                free(data);
+            data = new_data;
+            continue;
+        }
+        la_ssize_t len = archive_read_data(archive, data + size, capacity - size);
+        if (len < 0) {
+            free(data);
+            return NULL;
+        }
+        if (len == 0)
+            break;
+        size += len;
+    }
+    *size_out = size;
+    return data;
+}
+
+static bool import_archive(const char *archive_path, const char *fs, struct writers *writers, struct fakefsify_error *err_out, struct progress p) {
     int err = mkdir(fs, 0777);
     if (err < 0)
         POSIX_ERR();
@@ -89,6 +288,7 @@ bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_er
     int root_fd = open(path_tmp, O_RDONLY);
     if (root_fd < 0)
         POSIX_ERR();
+    writers_start(writers, root_fd);
 
     // open the database
     snprintf(path_tmp, sizeof(path_tmp), "%s/meta.db", fs);
@@ -140,6 +340,10 @@ bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_er
                 fprintf(stderr, "warning: almost pwned by hardlink %s\n", hardlink);
                 continue;
             }
+            // the file being linked to might not be written yet
+            errno = writers_drain(writers);
+            if (errno != 0)
+                POSIX_ERR();
             if (linkat(root_fd, fix_path(hardlink_path), root_fd, fix_path(entry_path), 0) < 0)
                 POSIX_ERR();
             sqlite3_bind_blob64(insert_hardlink, 1, entry_path, strlen(entry_path), SQLITE_TRANSIENT);
@@ -162,11 +366,58 @@ bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_er
         }
         free(entry_path_copy);
 
+        struct timespec times[2] = {
+            // for utimes, atime is first, mtime is second
+            {.tv_sec = archive_entry_atime(entry), .tv_nsec = archive_entry_atime_nsec(entry)},
+            {.tv_sec = archive_entry_mtime(entry), .tv_nsec = archive_entry_mtime_nsec(entry)},
+            // utimes cannot set ctime
+        };
+        if (!archive_entry_atime_is_set(entry))
+            times[0].tv_nsec = UTIME_OMIT;
+        if (!archive_entry_mtime_is_set(entry))
+            times[1].tv_nsec = UTIME_OMIT;
+
         int fd = -1;
-        // first, create node
+        struct write_job *job = NULL;
         switch (archive_entry_filetype(entry)) {
+            // files with contents are handed off to the writers, except for
+            // big ones, which would have to be read into memory all at once
             case AE_IFREG:
+                if (writers->count == 0 || !archive_entry_size_is_set(entry) ||
+                        archive_entry_size(entry) > WRITE_JOB_MAX) {
+                    // anything queued could have the same path, and has to
+                    // be written first so this one wins
+                    errno = writers_drain(writers);
+                    if (errno != 0)
+                        POSIX_ERR();
+                    fd = openat(root_fd, fix_path(entry_path), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                    if (fd < 0) {
+                        if (errno == EISDIR) continue; // assuming it's case insensitivity
+                        POSIX_ERR();
+                    }
+                    if (archive_read_data_into_fd(archive, fd) != ARCHIVE_OK)
+                        ARCHIVE_ERR(archive);
+                    close(fd);
+                    break;
+                }
+                fallthrough;
             case AE_IFLNK:
+                job = malloc(sizeof(struct write_job));
+                if (job == NULL)
+                    POSIX_ERR();
+                job->path = strdup(entry_path);
+                memcpy(job->times, times, sizeof(times));
+                if (archive_entry_filetype(entry) == AE_IFREG) {
+                    job->data = read_entry_data(archive, entry, &job->size);
+                    if (job->data == NULL)
+                        ARCHIVE_ERR(archive);
+                } else {
+                    job->data = strdup(archive_entry_symlink(entry));
+                    job->size = strlen(job->data);
+                }
+                writers_add(writers, job);
+                break;
+
             case AE_IFBLK:
             case AE_IFCHR:
             case AE_IFSOCK:
@@ -175,6 +426,7 @@ bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_er
                     if (errno == EISDIR) continue; // assuming it's case insensitivity
                     POSIX_ERR();
                 }
+                close(fd);
                 break;
 
             case AE_IFDIR:
@@ -189,42 +441,11 @@ bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_er
                 unlock_fchdir();
                 break;
         }
-        // second, fill in contents, if needed
-        switch (archive_entry_filetype(entry)) {
-            case AE_IFREG:
-                if (archive_read_data_into_fd(archive, fd) != ARCHIVE_OK)
-                    ARCHIVE_ERR(archive);
-                break;
-
-            case AE_IFLNK:
-                err = (int) write(fd, archive_entry_symlink(entry), strlen(archive_entry_symlink(entry)));
-                if (err < 0)
-                    POSIX_ERR();
-                break;
-
-            case AE_IFDIR:
-            case AE_IFBLK:
-            case AE_IFCHR:
-            case AE_IFSOCK:
-            case AE_IFIFO:
-                break;
+        if (job == NULL) {
+            err = utimensat(root_fd, fix_path(entry_path), times, 0);
+            if (err < 0)
+                POSIX_ERR();
         }
-        if (fd != -1)
-            close(fd);
-
-        struct timespec times[2] = {
-            // for utimes, atime is first, mtime is second
-            {.tv_sec = archive_entry_atime(entry), .tv_nsec = archive_entry_atime_nsec(entry)},
-            {.tv_sec = archive_entry_mtime(entry), .tv_nsec = archive_entry_mtime_nsec(entry)},
-            // utimes cannot set ctime
-        };
-        if (!archive_entry_atime_is_set(entry))
-            times[0].tv_nsec = UTIME_OMIT;
-        if (!archive_entry_mtime_is_set(entry))
-            times[1].tv_nsec = UTIME_OMIT;
-        err = utimensat(root_fd, fix_path(entry_path), times, 0);
-        if (err < 0)
-            POSIX_ERR();
 
         struct ish_stat stat = {
             .mode = (uint32_t) archive_entry_mode(entry),
@@ -251,9 +472,14 @@ bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_er
         STEP_RESET(insert_path);
     }
 
+    errno = writers_drain(writers);
+    if (errno != 0)
+        POSIX_ERR();
+
     FINALIZE(insert_stat);
     FINALIZE(insert_path);
     FINALIZE(insert_hardlink);
+    EXEC("create index inode_to_path on paths (inode, path)");
     EXEC("commit");
     sqlite3_close(db);
     close(root_fd);
@@ -263,6 +489,13 @@ bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_er
     return true;
 }
 
+bool fakefs_import(const char *archive_path, const char *fs, struct fakefsify_error *err_out, struct progress p) {
+    struct writers writers = {};
+    bool ok = import_archive(archive_path, fs, &writers, err_out, p);
+    writers_stop(&writers);
+    return ok;
+}
+
 bool fakefs_export(const char *fs, const char *archive_path, struct fakefsify_error *err_out, struct progress p) {
     // open the archive
     struct archive *archive = archive_write_new();
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #define ISH_INTERNAL
 #include "fs/fake.h"
@@ -11,6 +13,17 @@ enum cmd {
     cmd_export,
 };
 
+// the progress callback is called once per file
+static void count_entry(void *cookie, double UNUSED(progress), const char *UNUSED(message), bool *UNUSED(cancel_out)) {
+    (*(unsigned long *) cookie)++;
+}
+
+static double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
 int main(int argc, const char *argv[]) {
     enum cmd cmd = cmd_import;
     if (strcmp(basename((char *) argv[0]), "unfakefsify") == 0) {
@@ -36,8 +49,21 @@ int main(int argc, const char *argv[]) {
         func = fakefs_import;
     else if (cmd == cmd_export)
         func = fakefs_export;
-    if (!(*func)(argv[1], argv[2], &err, (struct progress) {})) {
+    unsigned long entries = 0;
+    double start = seconds_now();
+    if (!(*func)(argv[1], argv[2], &err, (struct progress) {.cookie = &entries, .callback = count_entry})) {
         fprintf(stderr, "error!!1! %d %d %s\n", err.line, err.type, err.message);
         return 1;
     }
+    double secs = seconds_now() - start;
+    if (secs <= 0)
+        secs = 1e-9;
+
+    // throughput in terms of the archive, compressed
+    struct stat archive_stat;
+    double archive_mb = 0;
+    if (stat(cmd == cmd_import ? argv[1] : argv[2], &archive_stat) == 0)
+        archive_mb = archive_stat.st_size / 1048576.0;
+    fprintf(stderr, "%lu files, %.1f MB archive in %.2fs (%.0f files/s, %.1f MB/s)\n",
+            entries, archive_mb, secs, entries / secs, archive_mb / secs);
 }
@@ -17,24 +17,19 @@ void cond_destroy(cond_t *cond) {
     pthread_cond_destroy(&cond->cond);
 }
 
-static bool is_signal_pending(lock_t *lock) {
+static bool is_signal_pending() {
     if (!current)
         return false;
-    if (lock != &current->sighand->lock)
-        lock(&current->sighand->lock);
-    bool pending = !!(current->pending & ~current->blocked);
-    if (lock != &current->sighand->lock)
-        unlock(&current->sighand->lock);
-    return pending;
+    return signal_pending(current);
 }
 
 int wait_for(cond_t *cond, lock_t *lock, struct timespec *timeout) {
-    if (is_signal_pending(lock))
+    if (is_signal_pending())
         return _EINTR;
     int err = wait_for_ignore_signals(cond, lock, timeout);
     if (err < 0)
         return _ETIMEDOUT;
-    if (is_signal_pending(lock))
+    if (is_signal_pending())
         return _EINTR;
     return 0;
 }
@@ -4,6 +4,237 @@
 #include "util/timer.h"
 #include "misc.h"
 
+// All timers are kept in one hierarchical timer wheel, run by one thread.
+//
+// Time is counted in ticks of CLOCK_MONOTONIC. Level 0 has a slot for each of
+// the next 64 ticks, level 1 a slot for each of the next 64 runs of 64 ticks,
+// and so on. A timer goes in the lowest level whose range covers it, and gets
+// moved down a level (cascaded) when the levels below have wrapped around to
+// its slot, so arming and cancelling are both just a list operation. Timers
+// fire at the first tick after they expire, so they're never early and at
+// most a tick late.
+//
+// Each level has a bitmap of which slots have anything in them, so finding
+// out how long the thread can sleep for doesn't involve looking at timers.
+
+#define TICK_SHIFT 16 // 65.536us
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 6 // covers 2^36 ticks, about 52 days
+#define WHEEL_MAX_DELTA ((1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define NEVER UINT64_MAX
+
+static lock_t timer_lock = LOCK_INITIALIZER;
+static cond_t timer_cond;
+static bool timer_thread_started;
+static pthread_t timer_thread_id;
+static struct list wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_bitmap[WHEEL_LEVELS];
+// the next tick that hasn't been run
+static uint64_t wheel_time;
+// the tick the timer thread is sleeping until
+static uint64_t wheel_wakeup = NEVER;
+// the timer whose callback is being called right now
+static struct timer *timer_running;
+
+static void __attribute__((constructor)) init_wheel() {
+    // cond_init makes timeouts use the monotonic clock, COND_INITIALIZER doesn't
+    cond_init(&timer_cond);
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < WHEEL_SIZE; slot++)
+            list_init(&wheel[level][slot]);
+}
+
+static uint64_t ticks_now() {
+    struct timespec now = timespec_now(CLOCK_MONOTONIC);
+    return ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec) >> TICK_SHIFT;
+}
+
+static uint64_t timespec_ticks_up(struct timespec ts) {
+    uint64_t ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return (ns + (1 << TICK_SHIFT) - 1) >> TICK_SHIFT;
+}
+
+// When the timer's end is, in ticks, rounded up so it's never early
+static uint64_t timer_expires(struct timer *timer) {
+    if (timer->clockid == CLOCK_MONOTONIC)
+        return timespec_ticks_up(timer->end);
+    struct timespec left = timespec_subtract(timer->end, timespec_now(timer->clockid));
+    uint64_t now = ticks_now();
+    if (!timespec_positive(left))
+        return now;
+    return now + timespec_ticks_up(left);
+}
+
+static void wheel_insert(struct timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel_time)
+        expires = wheel_time;
+    uint64_t delta = expires - wheel_time;
+    if (delta > WHEEL_MAX_DELTA) {
+        // it'll get put back in the right place when it's cascaded
+        delta = WHEEL_MAX_DELTA;
+        expires = wheel_time + delta;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1ull << (WHEEL_BITS * (level + 1)))
+        level++;
+    int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    list_add_tail(&wheel[level][slot], &timer->wheel);
+    wheel_bitmap[level] |= 1ull << slot;
+}
+
+static void wheel_remove(struct timer *timer) {
+    if (list_null(&timer->wheel))
+        return;
+    struct list *next = timer->wheel.next;
+    list_remove(&timer->wheel);
+    // if the slot's empty now, the list that's left is the slot's own head
+    if (list_empty(next)) {
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            if (next >= &wheel[level][0] && next < &wheel[level][WHEEL_SIZE])
+                wheel_bitmap[level] &= ~(1ull << (next - &wheel[level][0]));
+        }
+    }
+}
+
+// The first slot at or after start that has something in it, as an offset
+// from start, or -1
+static int bitmap_next(uint64_t bitmap, int start) {
+    uint64_t rotated = bitmap >> start | (start ? bitmap << (WHEEL_SIZE - start) : 0);
+    if (rotated == 0)
+        return -1;
+    return __builtin_ctzll(rotated);
+}
+
+// The next tick that has any timers to fire or cascade
+static uint64_t wheel_next_tick() {
+    uint64_t next = NEVER;
+    int offset = bitmap_next(wheel_bitmap[0], wheel_time & WHEEL_MASK);
+    if (offset >= 0)
+        next = wheel_time + offset;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        // a slot is cascaded when the levels below wrap around to it
+        int shift = WHEEL_BITS * level;
+        uint64_t base = ((wheel_time - 1) >> shift) + 1;
+        offset = bitmap_next(wheel_bitmap[level], base & WHEEL_MASK);
+        if (offset >= 0) {
+            uint64_t tick = (base + offset) << shift;
+            if (tick < next)
+                next = tick;
+        }
+    }
+    return next;
+}
+
+static void wheel_cascade(int level, int slot) {
+    // take everything off first, a timer that's too far out for the wheel
+    // can go right back in the same slot
+    struct list list;
+    list_init(&list);
+    if (!list_empty(&wheel[level][slot])) {
+        list_add_after(&wheel[level][slot], &list);
+        list_remove(&wheel[level][slot]);
+        list_init(&wheel[level][slot]);
+    }
+    wheel_bitmap[level] &= ~(1ull << slot);
+    struct timer *timer, *tmp;
+    list_for_each_entry_safe(&list, timer, tmp, wheel) {
+        list_remove(&timer->wheel);
+        wheel_insert(timer);
+    }
+}
+
+// Must be called with timer_lock, which will be unlocked while the callback
+// is called.
+static void timer_fire(struct timer *timer) {
+    if (timer->clockid == CLOCK_REALTIME) {
+        // the realtime clock was set back since the timer was armed
+        struct timespec left = timespec_subtract(timer->end, timespec_now(CLOCK_REALTIME));
+        if (timespec_positive(left)) {
+            timer->expires = timer_expires(timer);
+            wheel_insert(timer);
+            return;
+        }
+    }
+
+    // rearm before calling the callback, so it's free to timer_set
+    if (timespec_positive(timer->interval)) {
+        timer->end = timespec_add(timer->end, timer->interval);
+        timer->expires = timer_expires(timer);
+        wheel_insert(timer);
+    } else {
+        timer->active = false;
+    }
+
+    timer_running = timer;
+    unlock(&timer_lock);
+    timer->callback(timer->data);
+    lock(&timer_lock);
+    timer_running = NULL;
+    if (timer->dead)
+        free(timer);
+    notify(&timer_cond);
+}
+
+// Run every tick up to now
+static void wheel_run(uint64_t now) {
+    while (wheel_time <= now) {
+        uint64_t next = wheel_next_tick();
+        if (next > now) {
+            // nothing to do in between, the slots are still right
+            wheel_time = now + 1;
+            break;
+        }
+        wheel_time = next;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel_time & ((1ull << (WHEEL_BITS * level)) - 1))
+                break;
+            wheel_cascade(level, (wheel_time >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+        // timers that get rearmed for this tick end up back in this slot, so
+        // keep going until it's empty
+        struct list *slot = &wheel[0][wheel_time & WHEEL_MASK];
+        while (!list_empty(slot)) {
+            struct timer *timer = list_first_entry(slot, struct timer, wheel);
+            wheel_remove(timer);
+            timer_fire(timer);
+        }
+        wheel_time++;
+    }
+}
+
+static void *timer_thread(void *UNUSED(param)) {
+    lock(&timer_lock);
+    while (true) {
+        wheel_run(ticks_now());
+        wheel_wakeup = wheel_next_tick();
+        if (wheel_wakeup == NEVER) {
+            wait_for_ignore_signals(&timer_cond, &timer_lock, NULL);
+        } else {
+            uint64_t now = ticks_now();
+            if (wheel_wakeup > now) {
+                uint64_t ns = (wheel_wakeup - now) << TICK_SHIFT;
+                struct timespec timeout = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+                wait_for_ignore_signals(&timer_cond, &timer_lock, &timeout);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Must be called with timer_lock
+static void timer_thread_start() {
+    if (timer_thread_started)
+        return;
+    wheel_time = ticks_now();
+    if (pthread_create(&timer_thread_id, NULL, timer_thread, NULL) != 0)
+        die("could not start the timer thread");
+    pthread_detach(timer_thread_id);
+    timer_thread_started = true;
+}
+
 struct timer *timer_new(clockid_t clockid, timer_callback_t callback, void *data) {
 //    assert(clockid == CLOCK_MONOTONIC || clockid == CLOCK_REALTIME);
     struct timer *timer = malloc(sizeof(struct timer));
@@ -11,72 +242,55 @@ struct timer *timer_new(clockid_t clockid, timer_callback_t callback, void *data
     timer->callback = callback;
     timer->data = data;
     timer->active = false;
-    timer->thread_running = false;
-    lock_init(&timer->lock);
+    timer->end = timer->interval = (struct timespec) {0};
+    timer->wheel = (struct list) {NULL, NULL};
     timer->dead = false;
     return timer;
 }
 
 void timer_free(struct timer *timer) {
-    lock(&timer->lock);
+    lock(&timer_lock);
     timer->active = false;
-    if (timer->thread_running) {
-        timer->dead = true;
-        pthread_kill(timer->thread, SIGUSR1);
-        unlock(&timer->lock);
-    } else {
-        unlock(&timer->lock);
-        free(timer);
-    }
-}
-
-static void *timer_thread(void *param) {
-    struct timer *timer = param;
-    lock(&timer->lock);
-    while (true) {
-        struct timespec remaining = timespec_subtract(timer->end, timespec_now(timer->clockid));
-        while (timer->active && timespec_positive(remaining)) {
-            unlock(&timer->lock);
-            nanosleep(&remaining, NULL);
-            lock(&timer->lock);
-            remaining = timespec_subtract(timer->end, timespec_now(timer->clockid));
-        }
-        if (timer->active)
-            timer->callback(timer->data);
-        if (timer->active && timespec_positive(timer->interval)) {
-            timer->start = timer->end;
-            timer->end = timespec_add(timer->start, timer->interval);
-        } else {
-            break;
+    wheel_remove(timer);
+    if (timer_running == timer) {
+        if (pthread_equal(pthread_self(), timer_thread_id)) {
+            timer->dead = true;
+            unlock(&timer_lock);
+            return;
         }
+        while (timer_running == timer)
+            wait_for_ignore_signals(&timer_cond, &timer_lock, NULL);
     }
-    timer->thread_running = false;
-    if (timer->dead)
-        free(timer);
-    else
-        unlock(&timer->lock);
-    return NULL;
+    unlock(&timer_lock);
+    free(timer);
 }
 
 int timer_set(struct timer *timer, struct timer_spec spec, struct timer_spec *oldspec) {
-    lock(&timer->lock);
+    lock(&timer_lock);
     struct timespec now = timespec_now(timer->clockid);
     if (oldspec != NULL) {
-        oldspec->value = timespec_subtract(timer->end, now);
-        oldspec->interval = timer->interval;
+        *oldspec = (struct timer_spec) {0};
+        if (timer->active) {
+            oldspec->value = timespec_subtract(timer->end, now);
+            oldspec->interval = timer->interval;
+        }
     }
 
-    timer->start = now;
-    timer->end = timespec_add(timer->start, spec.value);
+    wheel_remove(timer);
+    timer->end = timespec_add(now, spec.value);
     timer->interval = spec.interval;
     timer->active = !timespec_is_zero(spec.value);
-    if (timer->thread_running) {
-        pthread_kill(timer->thread, SIGUSR1);
-    } else if (timer->active) {
-        timer->thread_running = true;
-        pthread_create(&timer->thread, NULL, timer_thread, timer);
-        pthread_detach(timer->thread);
+    if (timer->active) {
+        timer_thread_start();
+        // the thread doesn't keep wheel_time up to date while there's nothing to do
+        if (wheel_wakeup == NEVER && wheel_next_tick() == NEVER)
+            wheel_time = ticks_now();
+        timer->expires = timer_expires(timer);
+        wheel_insert(timer);
+        // wake up the thread if it's going to sleep past this one
+        if (timer->expires < wheel_wakeup)
+            notify(&timer_cond);
     }
-    unlock(&timer->lock);
+    unlock(&timer_lock);
     return 0;
 }
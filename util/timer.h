@@ -5,6 +5,7 @@
 #include <time.h>
 #include <pthread.h>
 #include <assert.h>
+#include "util/list.h"
 #include "util/sync.h"
 
 static inline struct timespec timespec_now(clockid_t clockid) {
@@ -52,21 +53,21 @@ static inline struct timespec timespec_normalize(struct timespec ts) {
 typedef void (*timer_callback_t)(void *data);
 struct timer {
     clockid_t clockid;
-    struct timespec start;
-    struct timespec end;
+    struct timespec end; // on clockid
     struct timespec interval;
-
     bool active;
-    bool thread_running;
-    pthread_t thread;
     timer_callback_t callback;
     void *data;
-    lock_t lock;
 
-    bool dead; // set by timer_free, the thread will free the timer if this is set when it finishes
+    // the rest is locked by the timer wheel's lock, see timer.c
+    uint64_t expires; // in ticks of CLOCK_MONOTONIC
+    struct list wheel;
+    bool dead; // set by timer_free while the callback is running, the timer thread will free it when it's done
 };
 
 struct timer *timer_new(clockid_t clockid, timer_callback_t callback, void *data);
+// Once this returns the callback isn't running and won't be called again
+// (unless this is called from the callback itself)
 void timer_free(struct timer *timer);
 // value is how long to wait until the next fire
 // interval is how long after that to wait until the next fire (if non-zero)
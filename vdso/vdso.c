@@ -2,10 +2,82 @@
 #error "VDSO must be built for i386 elf"
 #endif
 
+#include "vvar.h"
+
 typedef long time_t;
 typedef int clockid_t;
+typedef unsigned uint32_t;
+typedef unsigned long long uint64_t;
+typedef long long int64_t;
+
+struct timespec {
+    time_t tv_sec;
+    long tv_nsec;
+};
+struct timeval {
+    time_t tv_sec;
+    long tv_usec;
+};
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_REALTIME_COARSE 5
+
+// defined by the linker script to be the first vvar page
+extern const volatile struct vvar_data vvar __attribute__((visibility("hidden")));
+
+#define barrier() __asm__ volatile("" ::: "memory")
+
+static uint64_t rdtsc(void) {
+    uint64_t tsc;
+    __asm__ volatile("rdtsc" : "=A" (tsc));
+    return tsc;
+}
+
+// Returns 0 and the time in nanoseconds, or -1 if it has to be a syscall
+static int vdso_clock_ns(clockid_t clock, uint64_t *ns) {
+    if (clock != CLOCK_REALTIME && clock != CLOCK_REALTIME_COARSE && clock != CLOCK_MONOTONIC)
+        return -1;
+    uint32_t seq;
+    uint64_t now;
+    int64_t offset;
+    do {
+        seq = vvar.seq;
+        barrier();
+        if (seq & 1 || vvar.clock_mode != VCLOCK_RDTSC_NS)
+            return -1;
+        now = rdtsc();
+        // only the realtime offset goes stale
+        if (clock != CLOCK_MONOTONIC && now >= vvar.expires)
+            return -1;
+        offset = vvar.realtime_offset;
+        barrier();
+    } while (vvar.seq != seq);
+    if (clock != CLOCK_MONOTONIC)
+        now += offset;
+    *ns = now;
+    return 0;
+}
+
+// There's no libgcc to do 64-bit division, but divl does 64 by 32 as long as
+// the quotient fits, which it does for seconds until 2106.
+static uint32_t div_ns(uint64_t ns, uint32_t *rem) {
+    uint32_t quot;
+    __asm__("divl %4" : "=a" (quot), "=d" (*rem) :
+            "a" ((uint32_t) ns), "d" ((uint32_t) (ns >> 32)), "rm" (1000000000u));
+    return quot;
+}
 
 time_t __vdso_time(time_t *t) {
+    uint64_t ns;
+    if (vdso_clock_ns(CLOCK_REALTIME, &ns) == 0) {
+        uint32_t nsec;
+        time_t result = div_ns(ns, &nsec);
+        if (t)
+            *t = result;
+        return result;
+    }
+
     time_t result;
     __asm__("int $0x80" : "=a" (result) :
             "0" (13 /* __NR_time */), "b" (t));
@@ -13,6 +85,15 @@ time_t __vdso_time(time_t *t) {
 }
 
 int __vdso_gettimeofday(void *timeval, void *timezone) {
+    uint64_t ns;
+    if (timeval != 0 && timezone == 0 && vdso_clock_ns(CLOCK_REALTIME, &ns) == 0) {
+        struct timeval *tv = timeval;
+        uint32_t nsec;
+        tv->tv_sec = div_ns(ns, &nsec);
+        tv->tv_usec = nsec / 1000;
+        return 0;
+    }
+
     int result;
     __asm__("int $0x80" : "=a" (result) :
             "0" (78 /* __NR_gettimeofday */), "b" (timeval), "c" (timezone));
@@ -20,9 +101,17 @@ int __vdso_gettimeofday(void *timeval, void *timezone) {
 }
 
 int __vdso_clock_gettime(clockid_t clock, void *timespec) {
+    uint64_t ns;
+    if (vdso_clock_ns(clock, &ns) == 0) {
+        struct timespec *ts = timespec;
+        uint32_t nsec;
+        ts->tv_sec = div_ns(ns, &nsec);
+        ts->tv_nsec = nsec;
+        return 0;
+    }
+
     int result;
     __asm__("int $0x80" : "=a" (result) :
             "0" (265 /* __NR_clock_gettime */), "b" (clock), "c" (timespec));
     return result;
 }
-
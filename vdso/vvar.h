@@ -0,0 +1,29 @@
+#ifndef VDSO_VVAR_H
+#define VDSO_VVAR_H
+
+// Clock data the kernel shares with the vdso, at the start of the vvar pages
+// which are mapped read-only right before the vdso. It's one page shared by
+// every process.
+//
+// Updates are done under a sequence count: seq is odd while the kernel is
+// writing, so a reader has to retry if it's odd or if it changed while the
+// other fields were being read.
+//
+// This gets compiled for the i386 vdso with no libc headers, so it sticks to
+// types that are the same size there and on the host.
+struct vvar_data {
+    unsigned seq;
+    unsigned clock_mode;
+    // CLOCK_REALTIME minus CLOCK_MONOTONIC in nanoseconds
+    long long realtime_offset __attribute__((aligned(8)));
+    // the CLOCK_MONOTONIC time after which realtime_offset is stale, and the
+    // vdso should make a syscall instead, which brings it up to date
+    unsigned long long expires __attribute__((aligned(8)));
+};
+
+// the vdso can't tell the time by itself, always make the syscall
+#define VCLOCK_NONE 0
+// rdtsc returns CLOCK_MONOTONIC in nanoseconds
+#define VCLOCK_RDTSC_NS 1
+
+#endif
@@ -50,7 +50,8 @@ static inline int xX_main_Xx(int argc, char *const argv[], const char *envp) {
     const char *workdir = NULL;
     const struct fs_ops *fs = &realfs;
     const char *console = "/dev/tty1";
-    while ((opt = getopt(argc, argv, "+r:f:d:c:")) != -1) {
+    const char *root_options = "";
+    while ((opt = getopt(argc, argv, "+r:f:d:c:o:")) != -1) {
         switch (opt) {
             case 'r':
             case 'f':
@@ -64,6 +65,9 @@ static inline int xX_main_Xx(int argc, char *const argv[], const char *envp) {
             case 'c':
                 console = optarg;
                 break;
+            case 'o':
+                root_options = optarg;
+                break;
 
         }
     }
@@ -77,7 +81,7 @@ static inline int xX_main_Xx(int argc, char *const argv[], const char *envp) {
     }
     if (fs == &fakefs)
         strcat(root_realpath, "/data");
-    int err = mount_root(fs, root_realpath);
+    int err = mount_root(fs, root_realpath, root_options);
     if (err < 0)
         return err;
 